@@ -0,0 +1,5 @@
+@echo off
+if not exist bin mkdir bin
+cl /O2 src\jumbo_cli.c /Feneske_cli.exe
+move neske_cli.exe bin
+del *.obj
\ No newline at end of file
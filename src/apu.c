@@ -1,5 +1,8 @@
 #include "neske.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
 
 #define APU_FLAG_DMC    (1 << 4)
 #define APU_FLAG_NOISE  (1 << 3)
@@ -20,6 +23,12 @@ static const uint16_t period_lut[] =
     4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068
 };
 
+// NTSC, in CPU cycles per output bit
+static const uint16_t dmc_rate_lut[] =
+{
+    428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54
+};
+
 static uint8_t duty_get_cycle(uint8_t duty, uint8_t cycle)
 {
     return (duty_cycles[duty] & (1 << cycle)) > 0;
@@ -132,6 +141,25 @@ void apu_reg_write(struct apu *apu, enum apu_reg reg, uint8_t value)
         // printf("N1C: %d\n", apu->noise.length);
         break;
 
+    case APU_DMCCHN_ILXX_RRRR:
+        apu->dmc.flag_irq_enable = value >> 7;
+        apu->dmc.flag_loop       = (value >> 6)&1;
+        apu->dmc.rate            = dmc_rate_lut[value&0xF];
+        if (!apu->dmc.flag_irq_enable)
+        {
+            apu->dmc.flag_irq    = 0;
+        }
+        break;
+    case APU_DMCCHN_XDDD_DDDD:
+        apu->dmc.level       = value & 0x7F;
+        break;
+    case APU_DMCCHN_AAAA_AAAA:
+        apu->dmc.sample_addr = 0xC000 + value*64;
+        break;
+    case APU_DMCCHN_LLLL_LLLL:
+        apu->dmc.sample_len  = value*16 + 1;
+        break;
+
     case APU_STATUS_IFXD_NT21:
         apu->pulse1.enabled = (value & 1) > 0;
         if (!apu->pulse1.enabled)
@@ -153,6 +181,16 @@ void apu_reg_write(struct apu *apu, enum apu_reg reg, uint8_t value)
         {
             apu->noise.length = 0;
         }
+        if ((value & APU_FLAG_DMC) == 0)
+        {
+            apu->dmc.bytes_remaining = 0;
+        }
+        else if (apu->dmc.bytes_remaining == 0)
+        {
+            apu->dmc.address = apu->dmc.sample_addr;
+            apu->dmc.bytes_remaining = apu->dmc.sample_len;
+        }
+        apu->dmc.flag_irq = 0;
         // TODO: i dont use this
         apu->status = value;
         break;
@@ -180,6 +218,10 @@ uint8_t apu_reg_read(struct apu *apu, enum apu_reg reg)
             flags |= (apu->tri.length > 0)<<2;
             // noise enabled
             flags |= (apu->noise.length > 0)<<3;
+            // dmc still has bytes to fetch
+            flags |= (apu->dmc.bytes_remaining > 0)<<4;
+            // dmc reached the end of the sample
+            flags |= apu->dmc.flag_irq << 7;
             // interrupt inhibit flag
             flags |= apu->flag_frame_interrupt << 6;
             apu->flag_frame_interrupt = 0;
@@ -192,67 +234,128 @@ uint8_t apu_reg_read(struct apu *apu, enum apu_reg reg)
     return 0;
 }
 
-static float do_high_pass_filter(struct apu_pass *pass, float sample)
+// Nonlinear DAC mix from the NESdev wiki, indexed by the summed channel levels
+// pulse_lut[p1 + p2]              = 95.52/(8128/n + 100)
+// tnd_lut[3*tri + 2*noise + dmc]  = 163.67/(24329/n + 100)
+static const float pulse_lut[31] =
 {
-    float rc = 1.0/(37.0*2*3.1415);
-    float dt = 1.0/44100.0;
-    float alpha = rc/(rc + dt);
-    float value = alpha * pass->last_out + alpha * (sample - pass->last_in);
-    pass->last_in = sample;
-    pass->last_out = value;
-    return value;
-}
+    0.00000000f, 0.01160914f, 0.02293948f, 0.03400095f, 0.04480300f, 0.05535466f, 0.06566453f, 0.07574082f,
+    0.08559140f, 0.09522375f, 0.10464505f, 0.11386216f, 0.12288165f, 0.13170980f, 0.14035264f, 0.14881595f,
+    0.15710526f, 0.16522589f, 0.17318292f, 0.18098125f, 0.18862559f, 0.19612045f, 0.20347018f, 0.21067894f,
+    0.21775076f, 0.22468950f, 0.23149888f, 0.23818249f, 0.24474378f, 0.25118607f, 0.25751258f,
+};
 
-static int16_t read_sample(struct apu *apu)
-{   
-    uint8_t pulse1 = 0;
+static const float tnd_lut[203] =
+{
+    0.00000000f, 0.00669982f, 0.01334502f, 0.01993625f, 0.02647418f, 0.03295944f, 0.03939268f, 0.04577450f,
+    0.05210554f, 0.05838638f, 0.06461763f, 0.07079987f, 0.07693368f, 0.08301963f, 0.08905826f, 0.09505014f,
+    0.10099580f, 0.10689577f, 0.11275058f, 0.11856075f, 0.12432679f, 0.13004919f, 0.13572845f, 0.14136505f,
+    0.14695948f, 0.15251221f, 0.15802369f, 0.16349439f, 0.16892477f, 0.17431525f, 0.17966629f, 0.18497831f,
+    0.19025173f, 0.19548699f, 0.20068448f, 0.20584462f, 0.21096781f, 0.21605444f, 0.22110491f, 0.22611959f,
+    0.23109887f, 0.23604312f, 0.24095271f, 0.24582801f, 0.25066936f, 0.25547712f, 0.26025165f, 0.26499328f,
+    0.26970236f, 0.27437921f, 0.27902417f, 0.28363757f, 0.28821972f, 0.29277093f, 0.29729153f, 0.30178182f,
+    0.30624211f, 0.31067268f, 0.31507385f, 0.31944590f, 0.32378911f, 0.32810378f, 0.33239019f, 0.33664860f,
+    0.34087930f, 0.34508255f, 0.34925862f, 0.35340778f, 0.35753028f, 0.36162637f, 0.36569632f, 0.36974037f,
+    0.37375876f, 0.37775175f, 0.38171956f, 0.38566245f, 0.38958063f, 0.39347435f, 0.39734383f, 0.40118930f,
+    0.40501098f, 0.40880909f, 0.41258385f, 0.41633547f, 0.42006416f, 0.42377014f, 0.42745361f, 0.43111478f,
+    0.43475384f, 0.43837100f, 0.44196646f, 0.44554040f, 0.44909302f, 0.45262452f, 0.45613508f, 0.45962488f,
+    0.46309411f, 0.46654295f, 0.46997158f, 0.47338017f, 0.47676891f, 0.48013797f, 0.48348750f, 0.48681770f,
+    0.49012871f, 0.49342071f, 0.49669386f, 0.49994833f, 0.50318426f, 0.50640183f, 0.50960118f, 0.51278247f,
+    0.51594585f, 0.51909147f, 0.52221949f, 0.52533004f, 0.52842328f, 0.53149935f, 0.53455839f, 0.53760054f,
+    0.54062595f, 0.54363474f, 0.54662706f, 0.54960305f, 0.55256283f, 0.55550653f, 0.55843429f, 0.56134624f,
+    0.56424251f, 0.56712321f, 0.56998848f, 0.57283844f, 0.57567321f, 0.57849292f, 0.58129768f, 0.58408760f,
+    0.58686282f, 0.58962345f, 0.59236959f, 0.59510136f, 0.59781888f, 0.60052226f, 0.60321161f, 0.60588703f,
+    0.60854863f, 0.61119653f, 0.61383082f, 0.61645161f, 0.61905901f, 0.62165311f, 0.62423403f, 0.62680185f,
+    0.62935667f, 0.63189861f, 0.63442775f, 0.63694419f, 0.63944802f, 0.64193934f, 0.64441825f, 0.64688483f,
+    0.64933919f, 0.65178139f, 0.65421155f, 0.65662975f, 0.65903607f, 0.66143060f, 0.66381343f, 0.66618465f,
+    0.66854434f, 0.67089258f, 0.67322945f, 0.67555505f, 0.67786944f, 0.68017272f, 0.68246495f, 0.68474623f,
+    0.68701662f, 0.68927621f, 0.69152508f, 0.69376329f, 0.69599093f, 0.69820807f, 0.70041478f, 0.70261113f,
+    0.70479721f, 0.70697308f, 0.70913881f, 0.71129448f, 0.71344014f, 0.71557589f, 0.71770177f, 0.71981786f,
+    0.72192423f, 0.72402095f, 0.72610807f, 0.72818568f, 0.73025382f, 0.73231257f, 0.73436198f, 0.73640213f,
+    0.73843308f, 0.74045488f, 0.74246761f,
+};
 
-    if (apu->pulse1.length != 0 && !apu->pulse1.sweep_lock)
+static uint8_t pulse_level(struct apu_pulse_chan *pulse)
+{
+    if (pulse->length == 0 || pulse->sweep_lock || pulse->timer_init < 8)
     {
-        uint8_t volume = apu->pulse1.envl_constant ? apu->pulse1.envl_volume_or_period : apu->pulse1.decay;
-        pulse1 = duty_get_cycle(apu->pulse1.duty, apu->pulse1.duty_cycle) * 255;//volume;
+        return 0;
     }
-    
-    /*
-    uint8_t pulse2 = 0;
-    
-    if (apu->pulse2.length != 0 && !apu->pulse2.sweep_lock)
+
+    uint8_t volume = pulse->envl_constant ? pulse->envl_volume_or_period : pulse->decay;
+    return duty_get_cycle(pulse->duty, pulse->duty_cycle) * volume;
+}
+
+static uint8_t tri_level(struct apu_tri_chan *tri)
+{
+    // Ultrasonic periods would just alias, real hardware averages them out to the middle
+    if (tri->timer_init < 2)
     {
-        uint8_t volume = apu->pulse2.envl_constant ? apu->pulse2.envl_volume_or_period : apu->pulse2.decay;
-        pulse2 = duty_get_cycle(apu->pulse2.duty, apu->pulse2.duty_cycle) * volume;
+        return 7;
     }
 
-    uint8_t tri = 0;
+    // The sequencer holds its position when halted, so the output holds too instead of popping to 0
+    return tri->sequence < 16 ? 15-tri->sequence : tri->sequence-16;
+}
 
-    if (apu->tri.length != 0 && apu->tri.counter != 0 && apu->tri.timer_init > 7)
+static uint8_t noise_level(struct apu_noise_chan *noise)
+{
+    if (noise->length == 0 || (noise->lfsr&1) != 0)
     {
-        tri = apu->tri.sequence-16;
-        if (apu->tri.sequence < 16) tri = 15-apu->tri.sequence;
+        return 0;
     }
 
-    uint8_t noise = 0;
+    return noise->envl_constant ? noise->envl_volume_or_period : noise->decay;
+}
+
+static void read_levels(struct apu *apu, float *levels)
+{
+    uint8_t pulse1 = pulse_level(&apu->pulse1);
+    uint8_t pulse2 = pulse_level(&apu->pulse2);
+    uint8_t tri = tri_level(&apu->tri);
+    uint8_t noise = noise_level(&apu->noise);
+    uint8_t dmc = apu->dmc.level;
 
-    if (apu->noise.length != 0 && (apu->noise.lfsr&1) != 0)
+    levels[APU_STREAM_MIX] = pulse_lut[pulse1 + pulse2] + tnd_lut[3*tri + 2*noise + dmc];
+
+    if (apu->stream_count > 1)
     {
-        uint8_t volume = apu->noise.envl_constant ? apu->noise.envl_volume_or_period : apu->noise.decay;
-        noise = volume;
+        // Each stem is what the channel would sound like playing alone
+        levels[APU_STREAM_PULSE1] = pulse_lut[pulse1];
+        levels[APU_STREAM_PULSE2] = pulse_lut[pulse2];
+        levels[APU_STREAM_TRI] = tnd_lut[3*tri];
+        levels[APU_STREAM_NOISE] = tnd_lut[2*noise];
+        levels[APU_STREAM_DMC] = tnd_lut[dmc];
     }
+}
 
-    float pulse = 95.88/((8128.0/((float)(pulse1 + pulse2)))+100.0);
-    // i don't implement DMC (TODO)
-    float tri_noise_dmc = 159.79/(1.0/((tri/8227.0)+(noise/12241.0))+100.0);
+// DC blocker, runs once per output block so the first pass vectorizes and
+// only the one-multiply recursion is left serial
+static void high_pass_block(struct apu_pass *pass, float *samples, uint32_t count, uint32_t rate)
+{
+    float rc = 1.0/(37.0*2*3.1415);
+    float dt = 1.0/rate;
+    float alpha = rc/(rc + dt);
 
-    float volume = (pulse + tri_noise_dmc)/1.2;
+    float last_in = pass->last_in;
+    float diff[APU_BLOCK_LEN];
 
-    float value = do_high_pass_filter(&apu->high_pass, volume);
+    diff[0] = alpha*(samples[0] - last_in);
+    for (uint32_t i = 1; i < count; i++)
+    {
+        diff[i] = alpha*(samples[i] - samples[i-1]);
+    }
 
-    if (value > 1.0) value = 1.0;
-    if (value < -1.0) value = -1.0;
+    pass->last_in = samples[count-1];
 
-    int sample = value * 32766;
-    */
+    float out = pass->last_out;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        out = alpha*out + diff[i];
+        samples[i] = out;
+    }
 
-    return (((int16_t)pulse1)-128)*255;
+    pass->last_out = out;
 }
 
 static void pulse_envelope_cycle(struct apu_pulse_chan *pulse)
@@ -381,10 +484,287 @@ static void noise_envelope_cycle(struct apu_noise_chan *noise)
     }
 }
 
-void apu_init(struct apu *apu)
+#define APU_PI 3.14159265358979323846
+
+static double _sinc(double x)
+{
+    if (fabs(x) < 1e-9)
+    {
+        return 1.0;
+    }
+
+    return sin(APU_PI*x)/(APU_PI*x);
+}
+
+static struct apu_sinc sinc_kernels[APU_SINC_RATES];
+static uint32_t sinc_kernel_count;
+static volatile uint32_t sinc_kernel_lock;
+
+static void sinc_kernel_build(struct apu_sinc *sinc, uint32_t rate, double step)
+{
+    sinc->rate = rate;
+
+    // Cut off a bit under the output Nyquist, the kernel spans APU_SINC_ZEROS zero crossings each side
+    // Width of the passband in cycles per input sample, both sides of DC
+    double cutoff = 2.0*APU_SINC_CUTOFF/step;
+    double half_width = APU_SINC_ZEROS/cutoff;
+
+    // Low output rates get fewer zero crossings rather than a truncated window
+    if (half_width > APU_SINC_MAX_TAPS/2 - 1)
+    {
+        half_width = APU_SINC_MAX_TAPS/2 - 1;
+    }
+
+    // Multiple of APU_DOT_LANES so the dot product has no tail, the extra taps fall outside the window
+    sinc->taps = 2*(int)ceil(half_width);
+    sinc->taps = (sinc->taps + APU_DOT_LANES-1) / APU_DOT_LANES * APU_DOT_LANES;
+
+    int half = sinc->taps/2;
+
+    for (int phase = 0; phase <= APU_SINC_PHASES; phase++)
+    {
+        double frac = (double)phase/APU_SINC_PHASES;
+        double sum = 0;
+
+        for (int k = 0; k < sinc->taps; k++)
+        {
+            double t = k - half + frac;
+            double w = 0;
+
+            if (fabs(t) < half_width)
+            {
+                // Blackman window
+                double x = (t/half_width + 1.0)*0.5;
+                w = 0.42 - 0.5*cos(2*APU_PI*x) + 0.08*cos(4*APU_PI*x);
+            }
+
+            double h = cutoff*_sinc(cutoff*t)*w;
+            sinc->kernel[phase][k] = h;
+            sum += h;
+        }
+
+        // Every phase has unity DC gain so the fractional position doesn't modulate volume
+        for (int k = 0; k < sinc->taps; k++)
+        {
+            sinc->kernel[phase][k] /= sum;
+        }
+    }
+}
+
+// The first APU at a rate builds its kernel, every later one, fork and loaded
+// state just points at it. Any thread can make an APU, hence the lock.
+static const struct apu_sinc *sinc_kernel_get(uint32_t rate, double step)
+{
+    atomic32_lock(&sinc_kernel_lock);
+
+    struct apu_sinc *sinc = NULL;
+    for (uint32_t i = 0; i < sinc_kernel_count && !sinc; i++)
+    {
+        if (sinc_kernels[i].rate == rate)
+        {
+            sinc = &sinc_kernels[i];
+        }
+    }
+
+    if (!sinc && sinc_kernel_count < APU_SINC_RATES)
+    {
+        sinc = &sinc_kernels[sinc_kernel_count++];
+        sinc_kernel_build(sinc, rate, step);
+    }
+    else if (!sinc)
+    {
+        // Only after going through a lot of rates, the closest one is near enough
+        sinc = &sinc_kernels[0];
+        for (uint32_t i = 1; i < APU_SINC_RATES; i++)
+        {
+            if (labs((long)sinc_kernels[i].rate - (long)rate) < labs((long)sinc->rate - (long)rate))
+            {
+                sinc = &sinc_kernels[i];
+            }
+        }
+        printf("No room for a %u Hz resampler kernel, using the %u Hz one\n", rate, sinc->rate);
+    }
+
+    atomic32_unlock(&sinc_kernel_lock);
+    return sinc;
+}
+
+static void resampler_init(struct apu_resampler *rs, uint32_t rate)
+{
+    memset(rs, 0, sizeof *rs);
+
+    rs->rate = rate;
+    rs->step_nominal = APU_CPU_RATE/APU_DECIMATION/rate;
+    rs->step = rs->step_nominal;
+    rs->sinc = sinc_kernel_get(rate, rs->step_nominal);
+}
+
+// Both neighbouring phases in one pass over the history, with independent
+// partial sums per lane so the compiler can keep them in vector registers
+static float resampler_dot(struct apu_resampler *rs, const float *history, int phase, float blend)
+{
+    const float *kernel0 = rs->sinc->kernel[phase];
+    const float *kernel1 = rs->sinc->kernel[phase+1];
+    float sum0[APU_DOT_LANES] = { 0 };
+    float sum1[APU_DOT_LANES] = { 0 };
+
+    for (int k = 0; k < rs->sinc->taps; k += APU_DOT_LANES)
+    {
+        for (int lane = 0; lane < APU_DOT_LANES; lane++)
+        {
+            sum0[lane] += history[k+lane]*kernel0[k+lane];
+            sum1[lane] += history[k+lane]*kernel1[k+lane];
+        }
+    }
+
+    float value0 = 0;
+    float value1 = 0;
+
+    for (int lane = 0; lane < APU_DOT_LANES; lane++)
+    {
+        value0 += sum0[lane];
+        value1 += sum1[lane];
+    }
+
+    return value0*(1.0f - blend) + value1*blend;
+}
+
+static void resampler_push(struct apu *apu, const float *samples)
+{
+    struct apu_resampler *rs = &apu->resampler;
+
+    for (int stream = 0; stream < apu->stream_count; stream++)
+    {
+        rs->history[stream][rs->history_at] = samples[stream];
+        rs->history[stream][rs->history_at + APU_HISTORY_LEN] = samples[stream];
+    }
+    rs->history_at = (rs->history_at + 1) % APU_HISTORY_LEN;
+
+    rs->time += 1.0;
+
+    if (rs->time < rs->step)
+    {
+        return;
+    }
+
+    rs->time -= rs->step;
+
+    // The newest input is rs->time input samples past the output point
+    double position = rs->time*APU_SINC_PHASES;
+    int phase = (int)position;
+    float blend = position - phase;
+    uint32_t start = rs->history_at + APU_HISTORY_LEN - rs->sinc->taps;
+
+    for (int stream = 0; stream < apu->stream_count; stream++)
+    {
+        apu->block[stream][apu->block_len] = resampler_dot(rs, rs->history[stream] + start, phase, blend);
+    }
+
+    if (++apu->block_len == APU_BLOCK_LEN)
+    {
+        apu_flush(apu);
+    }
+}
+
+void apu_flush(struct apu *apu)
+{
+    if (apu->block_len == 0)
+    {
+        return;
+    }
+
+    int16_t pcm[APU_STREAM_COUNT][APU_BLOCK_LEN];
+    int16_t *streams[APU_STREAM_COUNT];
+
+    for (int stream = 0; stream < apu->stream_count; stream++)
+    {
+        float *block = apu->block[stream];
+
+        high_pass_block(&apu->high_pass[stream], block, apu->block_len, apu->resampler.rate);
+
+        for (uint32_t i = 0; i < apu->block_len; i++)
+        {
+            float value = block[i];
+            value = value > 1.0f ? 1.0f : value;
+            value = value < -1.0f ? -1.0f : value;
+            pcm[stream][i] = (int16_t)(value*32767.0f);
+        }
+
+        streams[stream] = pcm[stream];
+    }
+
+    if (apu->ring)
+    {
+        sample_ring_write(apu->ring, pcm[APU_STREAM_MIX], apu->block_len);
+    }
+
+    if (apu->writer.write)
+    {
+        apu->writer.write(apu->writer.userdata, streams, apu->stream_count, apu->block_len);
+    }
+
+    if (apu->ring && apu->rate_control)
+    {
+        apu_sync_rate(apu, sample_ring_fill(apu->ring), APU_RING_TARGET(apu->resampler.rate));
+    }
+
+    apu->block_len = 0;
+}
+
+void apu_init(struct apu *apu, uint32_t sample_rate)
 {
     apu->pulse1.sweep_onecomp = 1;
     apu->noise.lfsr = 1;
+    apu->dmc.rate = dmc_rate_lut[0];
+    apu->dmc.timer = apu->dmc.rate;
+    apu->dmc.bits_remaining = 8;
+    apu->dmc.silence = 1;
+    apu->dmc.sample_addr = 0xC000;
+    apu->dmc.sample_len = 1;
+    apu->stream_count = 1;
+    apu_set_sample_rate(apu, sample_rate);
+}
+
+void apu_set_sample_rate(struct apu *apu, uint32_t sample_rate)
+{
+    resampler_init(&apu->resampler, sample_rate);
+}
+
+void apu_set_writer(struct apu *apu, struct apu_writer writer, bool stems)
+{
+    apu_flush(apu);
+    apu->writer = writer;
+
+    int stream_count = writer.write && stems ? APU_STREAM_COUNT : 1;
+
+    // Stems join with an empty history, they fade in over one kernel length
+    for (int stream = apu->stream_count; stream < stream_count; stream++)
+    {
+        memset(apu->resampler.history[stream], 0, sizeof apu->resampler.history[stream]);
+        apu->resampler.box_sum[stream] = 0;
+        apu->high_pass[stream] = (struct apu_pass){ 0 };
+    }
+
+    apu->stream_count = stream_count;
+}
+
+// The only thing that follows the ring fill. The pacer keeps frames at the
+// exact NTSC rate, a second loop on the same fill would fight this one.
+void apu_sync_rate(struct apu *apu, uint32_t fill, uint32_t target)
+{
+    struct apu_resampler *rs = &apu->resampler;
+
+    // Smooth over callback and frame granularity, we only care about drift
+    rs->fill_avg += (fill - rs->fill_avg)*0.05;
+
+    double error = (rs->fill_avg - target)/target;
+    double adjust = error*APU_RATE_GAIN;
+
+    if (adjust > APU_RATE_MAX_ADJUST) adjust = APU_RATE_MAX_ADJUST;
+    if (adjust < -APU_RATE_MAX_ADJUST) adjust = -APU_RATE_MAX_ADJUST;
+
+    // Buffer too full means we produce too many samples, so take bigger steps
+    rs->step = rs->step_nominal*(1.0 + adjust);
 }
 
 static void pulse_clock(struct apu_pulse_chan *pulse)
@@ -437,6 +817,82 @@ static void noise_clock(struct apu_noise_chan *noise)
     }
 }
 
+static void dmc_clock(struct apu_dmc_chan *dmc)
+{
+    if (--dmc->timer != 0)
+    {
+        return;
+    }
+
+    dmc->timer = dmc->rate;
+
+    if (!dmc->silence)
+    {
+        if ((dmc->shift & 1) && dmc->level <= 125)
+        {
+            dmc->level += 2;
+        }
+        else if (!(dmc->shift & 1) && dmc->level >= 2)
+        {
+            dmc->level -= 2;
+        }
+    }
+
+    dmc->shift >>= 1;
+
+    if (--dmc->bits_remaining == 0)
+    {
+        dmc->bits_remaining = 8;
+        dmc->silence = !dmc->buffer_full;
+        dmc->shift = dmc->buffer;
+        // The buffer is now empty, apu_dmc_next_fetch reports this cycle to the scheduler
+        dmc->buffer_full = 0;
+    }
+}
+
+// The DMC only touches memory when its buffer empties, which is fully
+// determined by the timer, so the system can schedule the fetch instead of
+// asking every cycle. Returns UINT64_MAX when no fetch is pending.
+uint64_t apu_dmc_next_fetch(struct apu *apu)
+{
+    struct apu_dmc_chan *dmc = &apu->dmc;
+
+    if (dmc->bytes_remaining == 0)
+    {
+        return UINT64_MAX;
+    }
+
+    if (!dmc->buffer_full)
+    {
+        return apu->cycles;
+    }
+
+    return apu->cycles + dmc->timer + (uint64_t)(dmc->bits_remaining-1)*dmc->rate;
+}
+
+void apu_dmc_fill(struct apu *apu, uint8_t byte)
+{
+    struct apu_dmc_chan *dmc = &apu->dmc;
+
+    dmc->buffer = byte;
+    dmc->buffer_full = 1;
+    dmc->address = dmc->address == 0xFFFF ? 0x8000 : dmc->address+1;
+    dmc->bytes_remaining--;
+
+    if (dmc->bytes_remaining == 0)
+    {
+        if (dmc->flag_loop)
+        {
+            dmc->address = dmc->sample_addr;
+            dmc->bytes_remaining = dmc->sample_len;
+        }
+        else if (dmc->flag_irq_enable)
+        {
+            dmc->flag_irq = 1;
+        }
+    }
+}
+
 static void envelope_cycle(struct apu *apu)
 {
     pulse_envelope_cycle(&apu->pulse1);
@@ -489,25 +945,19 @@ static void frame_cycle(struct apu *apu)
     apu->frame_counter++;
 }
 
-void apu_ring_write(struct apu *apu, uint16_t value)
+static void _apu_box_push(struct apu *apu)
 {
-    apu->sample_ring[apu->sample_ring_write_at++] = value;
-    apu->sample_ring_write_at %= APU_SAMPLE_RING_LEN;
-}
+    struct apu_resampler *rs = &apu->resampler;
+    float samples[APU_STREAM_COUNT];
 
-void apu_ring_read(struct apu *apu, uint16_t *dest, uint32_t count)
-{
-    int at = apu->sample_ring_read_at;
-
-    while (at < 0) at += APU_SAMPLE_RING_LEN;
-
-    for (int i = 0; i < count; i++)
+    for (int stream = 0; stream < apu->stream_count; stream++)
     {
-        at %= APU_SAMPLE_RING_LEN;
-        *dest++ = apu->sample_ring[at++];
+        samples[stream] = rs->box_sum[stream]*(1.0f/APU_DECIMATION);
+        rs->box_sum[stream] = 0;
     }
 
-    apu->sample_ring_read_at = at;
+    rs->box_count = 0;
+    resampler_push(apu, samples);
 }
 
 void apu_cycle(struct apu *apu)
@@ -524,15 +974,11 @@ void apu_cycle(struct apu *apu)
 
     noise_clock(&apu->noise);
     tri_clock(&apu->tri);
+    dmc_clock(&apu->dmc);
 
     // dats cycles per frame
-    uint64_t cpf = 1789773 / 240;
+    uint64_t cpf = APU_FRAME_CYCLES;
     uint64_t cpf_treshold = apu->last_cpf + cpf;
-    
-    // this is cycles per sample
-    // 44.1 khz for the target sample
-    uint64_t cps = 1789773 / 44100;
-    uint64_t cps_treshold = apu->last_cps + cps;
 
     if (apu->cycles > cpf_treshold)
     {
@@ -540,30 +986,128 @@ void apu_cycle(struct apu *apu)
         frame_cycle(apu);
     }
 
-    if (apu->cycles > cps_treshold)
+    // Box filter down to an intermediate rate, the resampler takes it from there
+    struct apu_resampler *rs = &apu->resampler;
+    float levels[APU_STREAM_COUNT];
+    read_levels(apu, levels);
+
+    for (int stream = 0; stream < apu->stream_count; stream++)
+    {
+        rs->box_sum[stream] += levels[stream];
+    }
+
+    if (++rs->box_count == APU_DECIMATION)
     {
-        apu->last_cps = cps_treshold;
-        apu_ring_write(apu, read_sample(apu));
-        apu->samples_written++;
-    }  
+        _apu_box_push(apu);
+    }
 }
 
-// TODO: Not used, because still creates delayed and choppy sound if too
-//       much samples submitted, this solution sacrifices accuracy ;-;
-void apu_catchup_cycles(struct apu *apu, uint64_t cycles)
+static uint64_t _apu_timer_clocks(uint16_t timer, uint16_t timer_init)
 {
-    while (apu->cycles < cycles)
+    // Timers reload when they go past timer_init, which a register write can cause right away
+    return timer > timer_init ? 1 : (uint64_t)timer + 1;
+}
+
+// Where a timer ends up after some clocks. Only crosses a reload for
+// halted channels, where reloading is all that happens.
+static uint16_t _apu_timer_after(uint16_t timer, uint16_t timer_init, uint64_t clocks)
+{
+    uint64_t first = _apu_timer_clocks(timer, timer_init);
+
+    if (clocks < first)
     {
-        apu_cycle(apu);
+        return timer - clocks;
+    }
+
+    return timer_init - (clocks - first) % ((uint64_t)timer_init + 1);
+}
+
+static uint64_t _apu_pulse_cycles_to_event(struct apu *apu, struct apu_pulse_chan *pulse)
+{
+    if (pulse->length == 0 || pulse->sweep_lock)
+    {
+        return UINT64_MAX;
     }
+
+    // Pulses clock on odd cycles only
+    uint64_t first_odd = (apu->cycles & 1) ? 2 : 1;
+    return first_odd + 2*(_apu_timer_clocks(pulse->timer, pulse->timer_init) - 1);
 }
 
-void apu_catchup_samples(struct apu *apu, uint32_t samples_added)
+// Cycles until some channel steps, the frame counter ticks or the DMC
+// shifts. Levels only change at those points, everything in between is
+// counting. Halted channels only reload their timer so they don't count.
+static uint64_t _apu_cycles_to_event(struct apu *apu)
 {
-    while (apu->samples_written < samples_added)
+    uint64_t n = apu->last_cpf + APU_FRAME_CYCLES + 1 - apu->cycles;
+    uint64_t pulse1 = _apu_pulse_cycles_to_event(apu, &apu->pulse1);
+    uint64_t pulse2 = _apu_pulse_cycles_to_event(apu, &apu->pulse2);
+    uint64_t noise = apu->noise.length == 0 ? UINT64_MAX : _apu_timer_clocks(apu->noise.timer, apu->noise.timer_init);
+    uint64_t tri = apu->tri.length == 0 || apu->tri.counter == 0 ? UINT64_MAX : _apu_timer_clocks(apu->tri.timer, apu->tri.timer_init);
+    uint64_t dmc = apu->dmc.timer;
+
+    if (pulse1 < n) n = pulse1;
+    if (pulse2 < n) n = pulse2;
+    if (noise < n) n = noise;
+    if (tri < n) n = tri;
+    if (dmc < n) n = dmc;
+
+    return n;
+}
+
+// Advances through cycles where no event happens, the output level is constant over them
+static void _apu_skip(struct apu *apu, uint64_t count)
+{
+    if (count == 0)
     {
+        return;
+    }
+
+    uint64_t pulse_clocks = ((apu->cycles + count + 1) >> 1) - ((apu->cycles + 1) >> 1);
+
+    apu->pulse1.timer = _apu_timer_after(apu->pulse1.timer, apu->pulse1.timer_init, pulse_clocks);
+    apu->pulse2.timer = _apu_timer_after(apu->pulse2.timer, apu->pulse2.timer_init, pulse_clocks);
+    apu->noise.timer = _apu_timer_after(apu->noise.timer, apu->noise.timer_init, count);
+    apu->tri.timer = _apu_timer_after(apu->tri.timer, apu->tri.timer_init, count);
+    apu->dmc.timer -= count;
+    apu->cycles += count;
+
+    float levels[APU_STREAM_COUNT];
+    read_levels(apu, levels);
+    struct apu_resampler *rs = &apu->resampler;
+
+    while (count > 0)
+    {
+        uint64_t step = APU_DECIMATION - rs->box_count;
+        step = step < count ? step : count;
+
+        for (int stream = 0; stream < apu->stream_count; stream++)
+        {
+            rs->box_sum[stream] += levels[stream]*step;
+        }
+        rs->box_count += step;
+        count -= step;
+
+        if (rs->box_count == APU_DECIMATION)
+        {
+            _apu_box_push(apu);
+        }
+    }
+}
+
+// The emulation thread runs the APU up to the CPU clock, the rate control
+// in the resampler keeps the output matched to what the device consumes.
+// Between channel events only the box filter has work, so those stretches
+// are skipped in one go and apu_cycle only runs on the cycles that matter.
+void apu_catchup_cycles(struct apu *apu, uint64_t cycles)
+{
+    while (apu->cycles < cycles)
+    {
+        uint64_t n = _apu_cycles_to_event(apu);
+        uint64_t left = cycles - apu->cycles;
+
+        _apu_skip(apu, (n < left ? n : left) - 1);
         apu_cycle(apu);
     }
-    apu->samples_written = 0;
 }
 
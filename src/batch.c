@@ -0,0 +1,178 @@
+// Many forks of one player stepped together, for training loops that want
+// frames per second across the batch. Outputs go into contiguous arrays,
+// one row per instance, so they can be handed over without gathering.
+
+#include "neske.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void _batch_build_luma(struct player_batch *batch)
+{
+    struct video_lut lut = { 0 };
+    video_lut_update(&lut, video_palette);
+
+    for (int i = 0; i < VIDEO_LUT_LEN; i++)
+    {
+        uint32_t r = (lut.rgba[i] >> 24) & 0xFF;
+        uint32_t g = (lut.rgba[i] >> 16) & 0xFF;
+        uint32_t b = (lut.rgba[i] >> 8) & 0xFF;
+        batch->luma[i] = (uint8_t)((r*77 + g*150 + b*29) >> 8);
+    }
+}
+
+// Box filtered grayscale, emphasis and grayscale bits applied like the display does
+static void _batch_observe(struct player_batch *batch, struct system_frame_result *frame, uint8_t *out)
+{
+    int scale = batch->obs_scale;
+    int shift = 0;
+    while ((1 << shift) < scale)
+    {
+        shift++;
+    }
+    int width = batch->obs_width;
+    uint16_t sums[256];
+
+    for (int oy = 0; oy < batch->obs_height; oy++)
+    {
+        memset(sums, 0, width*sizeof *sums);
+
+        for (int y = oy*scale; y < (oy+1)*scale; y++)
+        {
+            uint8_t mask = frame->line_mask[y];
+            uint8_t index_mask = (mask & 1) ? 0x30 : 0x3F;
+            const uint8_t *luma = batch->luma + ((mask >> 5) & 7)*64;
+            const uint8_t *line = frame->screen + y*256;
+
+            for (int x = 0; x < 256; x++)
+            {
+                sums[x >> shift] += luma[line[x] & index_mask];
+            }
+        }
+
+        for (int ox = 0; ox < width; ox++)
+        {
+            out[oy*width + ox] = sums[ox] >> (shift*2);
+        }
+    }
+}
+
+static void _batch_step_one(void *userdata, int index)
+{
+    struct player_batch *batch = userdata;
+    struct player *player = &batch->players[index];
+
+    player_set_controller(player, batch->inputs[index]);
+    struct system_frame_result frame = player_frame(player);
+
+    _batch_observe(batch, &frame, batch->observations + (size_t)index*batch->obs_width*batch->obs_height);
+
+    // Probes read memory directly, going through the bus could clear PPU or controller state
+    struct system *system = player_get_system(player);
+    uint8_t *values = batch->probe_values + (size_t)index*batch->probe_count;
+    for (int i = 0; i < batch->probe_count; i++)
+    {
+        values[i] = system->memory[batch->probes[i]];
+    }
+
+    batch->crashed[index] = player_crash(player);
+}
+
+void player_batch_free(struct player_batch *batch)
+{
+    if (batch->players)
+    {
+        for (int i = 0; i < batch->count; i++)
+        {
+            player_free(&batch->players[i]);
+        }
+    }
+
+    free(batch->players);
+    free(batch->start_state);
+    free(batch->probes);
+    free(batch->observations);
+    free(batch->probe_values);
+    free(batch->crashed);
+    free(batch);
+}
+
+// count forks of source, which stays the caller's. obs_scale divides 256x240 and
+// must be 1, 2, 4 or 8. pool can be NULL to step on the calling thread.
+struct player_batch *player_batch_new(struct player *source, int count, int obs_scale, const uint16_t *probes, int probe_count, struct thread_pool *pool)
+{
+    size_t state_size = player_state_size(source);
+    if (!state_size || count <= 0 || (obs_scale != 1 && obs_scale != 2 && obs_scale != 4 && obs_scale != 8))
+    {
+        return NULL;
+    }
+
+    struct player_batch *batch = calloc(1, sizeof *batch);
+    if (!batch)
+    {
+        return NULL;
+    }
+
+    batch->count = count;
+    batch->pool = pool;
+    batch->obs_scale = obs_scale;
+    batch->obs_width = 256/obs_scale;
+    batch->obs_height = 240/obs_scale;
+    batch->probe_count = probe_count;
+
+    batch->players = calloc(count, sizeof *batch->players);
+    batch->start_state = malloc(state_size);
+    batch->probes = malloc((probe_count ? probe_count : 1)*sizeof *batch->probes);
+    batch->observations = malloc((size_t)count*batch->obs_width*batch->obs_height);
+    batch->probe_values = malloc((size_t)count*(probe_count ? probe_count : 1));
+    batch->crashed = calloc(count, 1);
+
+    if (!batch->players || !batch->start_state || !batch->probes || !batch->observations || !batch->probe_values || !batch->crashed)
+    {
+        player_batch_free(batch);
+        return NULL;
+    }
+
+    memcpy(batch->probes, probes, probe_count*sizeof *batch->probes);
+    player_save_state(source, batch->start_state);
+    _batch_build_luma(batch);
+
+    for (int i = 0; i < count; i++)
+    {
+        batch->players[i] = player_fork(source);
+        if (!batch->players[i].is_valid)
+        {
+            player_batch_free(batch);
+            return NULL;
+        }
+    }
+
+    return batch;
+}
+
+// One frame on every instance, inputs has count entries. Results land in
+// observations, probe_values and crashed.
+void players_step(struct player_batch *batch, const struct controller_state *inputs)
+{
+    batch->inputs = inputs;
+
+    if (batch->pool)
+    {
+        thread_pool_run(batch->pool, batch->count, _batch_step_one, batch);
+    }
+    else
+    {
+        for (int i = 0; i < batch->count; i++)
+        {
+            _batch_step_one(batch, i);
+        }
+    }
+
+    batch->inputs = NULL;
+}
+
+// Puts one instance back to where the batch started, for the end of an episode
+void player_batch_restart(struct player_batch *batch, int index)
+{
+    player_load_state(&batch->players[index], batch->start_state);
+    batch->crashed[index] = false;
+}
@@ -0,0 +1,806 @@
+// Straight line 6502 code translated once into ops that carry their operands
+// and cycles, so running it skips fetching and decoding. A block ends at
+// anything that jumps, anything that changes I, and before anything that
+// touches I/O. Addresses that are only known when it runs get checked then,
+// the block stops in front of that instruction and the interpreter does it
+// once the PPU caught up.
+//
+// Blocks are found by where their code is in host memory, so every PRG bank
+// keeps its own and a bank switch needs no flush. Code in RAM is compared with
+// the bytes it was made from before it runs, and a block that writes over
+// itself stops right after.
+//
+// Forks share the ROM, so they share its blocks too. Those go in a table that
+// only ever grows, any thread finds them there without a lock and each player
+// keeps the ones it ran lately in its own small table in front. Only RAM
+// blocks are per player.
+
+#include "neske.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const uint8_t _block_operand_len[ADDR_MODE_COUNT] = {
+    0, 2, 2, 2, 1, 0, 2, 1, 1, 1, 1, 1, 1,
+};
+
+struct block_cache *block_cache_new()
+{
+    struct block_cache *cache = calloc(1, sizeof(struct block_cache));
+    struct block_shared *shared = calloc(1, sizeof(struct block_shared));
+    if (!cache || !shared)
+    {
+        free(cache);
+        free(shared);
+        return NULL;
+    }
+
+    shared->refs = 1;
+    cache->shared = shared;
+    return cache;
+}
+
+// Starts with what the parent found so far, the RAM blocks stay with it since
+// they point at its memory
+struct block_cache *block_cache_fork(struct block_cache *cache)
+{
+    struct block_cache *fork = calloc(1, sizeof(struct block_cache));
+    if (!fork)
+    {
+        return NULL;
+    }
+
+    atomic32_add(&cache->shared->refs, 1);
+    fork->shared = cache->shared;
+    memcpy(fork->rom, cache->rom, sizeof fork->rom);
+    fork->jit = cache->jit;
+    return fork;
+}
+
+void block_cache_free(struct block_cache *cache)
+{
+    struct block_shared *shared = cache->shared;
+    free(cache->ram);
+    if (atomic32_add(&shared->refs, (uint32_t)-1) == 0)
+    {
+        jit_free(shared->jit);
+        for (size_t i = 0; i < sizeof shared->chunks / sizeof *shared->chunks; i++)
+        {
+            free(shared->chunks[i]);
+        }
+        free(shared);
+    }
+    free(cache);
+}
+
+// The JIT lives with the shared blocks, turning it off here only stops this
+// player from running what's compiled
+bool block_cache_set_jit(struct block_cache *cache, bool enabled)
+{
+    if (!enabled)
+    {
+        cache->jit = NULL;
+        return true;
+    }
+
+    struct block_shared *shared = cache->shared;
+    atomic32_lock(&shared->lock);
+    if (!shared->jit)
+    {
+        shared->jit = jit_new(JIT_HOT_RUNS);
+    }
+    cache->jit = shared->jit;
+    atomic32_unlock(&shared->lock);
+    return cache->jit != NULL;
+}
+
+// Where the code at pc is, NULL when fetches there aren't plain memory
+static const uint8_t *_block_code(struct system *system, uint16_t pc)
+{
+    if (pc >= 0x8000)
+    {
+        const uint8_t *page = system->prg_pages[(pc >> 12) & 7];
+        return page ? page + (pc & 0xFFF) : NULL;
+    }
+
+    if (pc < 0x2000 || pc >= 0x6000)
+    {
+        return system->memory + pc;
+    }
+
+    return NULL;
+}
+
+// Same split as system_mem_read and the cartridge, PRG-RAM writes can hit a
+// board's registers so only RAM gets written directly
+static bool _block_plain(uint16_t addr, bool write)
+{
+    return addr < 0x2000 || (!write && addr >= 0x4020);
+}
+
+static bool _block_reads(enum instr id)
+{
+    switch (id)
+    {
+        case ADC: case AND: case BIT: case CMP: case CPX: case CPY:
+        case EOR: case LDA: case LDX: case LDY: case ORA: case SBC:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool _block_writes(enum instr id)
+{
+    switch (id)
+    {
+        case STA: case STX: case STY:
+        case ASL: case LSR: case ROL: case ROR: case INC: case DEC:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool _block_ends(enum instr id)
+{
+    switch (id)
+    {
+        case BCC: case BCS: case BEQ: case BMI: case BNE: case BPL: case BVC: case BVS:
+        case JMP: case JSR: case RTS: case RTI: case BRK:
+        case CLI: case SEI: case PLP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Left to ricoh_run_instr, none of these touch more than the stack and vectors
+static bool _block_generic(enum instr id, enum addr_mode mode)
+{
+    switch (id)
+    {
+        case BRK: case RTI: case PLP: case PHP: case CLI: case SEI: case CLD: case SED:
+            return true;
+        case JMP:
+            return mode == AM_IND;
+        default:
+            return false;
+    }
+}
+
+// One instruction at code, false when it can't go in a block
+static bool _block_decode(struct system *system, const uint8_t *code, size_t room, struct instr_decoded *out)
+{
+    uint8_t id = system->decoder.itbl[code[0]];
+    if (id == 0xFF)
+    {
+        return false;
+    }
+
+    out->id = id;
+    out->addr_mode = system->decoder.atbl[code[0]];
+    out->size = 1 + _block_operand_len[out->addr_mode] + (id == BRK);
+    if (out->size > room)
+    {
+        return false;
+    }
+
+    out->operand[0] = out->size > 1 ? code[1] : 0;
+    out->operand[1] = out->size > 2 ? code[2] : 0;
+
+    uint16_t addr = out->operand[0] | out->operand[1] << 8;
+    if (out->addr_mode == AM_ABS)
+    {
+        if (_block_reads(id) && !_block_plain(addr, false))
+        {
+            return false;
+        }
+        if (_block_writes(id) && !_block_plain(addr, true))
+        {
+            return false;
+        }
+    }
+
+    // The pointer of JMP ($xxxx) is read when it runs, both bytes of it
+    if (out->addr_mode == AM_IND && (!_block_plain(addr, false) || !_block_plain(addr + 1, false)))
+    {
+        return false;
+    }
+
+    return true;
+}
+
+static uint8_t _block_cycles(struct instr_decoded instr)
+{
+    return ricoh_cycle_tbl[instr.addr_mode + instr.id*ADDR_MODE_COUNT];
+}
+
+static uint16_t _block_branch_target(uint16_t next, uint8_t offset)
+{
+    return (uint16_t)(next + (int8_t)offset);
+}
+
+// Folds a with the instruction after it when they make one of the common pairs
+static bool _block_fuse(struct block_op *op, struct instr_decoded a, struct instr_decoded b, uint16_t at)
+{
+    uint16_t a_addr = a.operand[0] | a.operand[1] << 8;
+    uint16_t b_addr = b.operand[0] | b.operand[1] << 8;
+
+    if (a.id == LDA && (a.addr_mode == AM_IMM || a.addr_mode == AM_ZPG || a.addr_mode == AM_ABS) &&
+        b.id == STA && (b.addr_mode == AM_ZPG || b.addr_mode == AM_ABS))
+    {
+        op->kind = BLOCK_LDA_STA;
+        op->target = b_addr;
+    }
+    else if ((a.id == DEX || a.id == DEY) && b.id == BNE)
+    {
+        op->kind = a.id == DEX ? BLOCK_DEX_BNE : BLOCK_DEY_BNE;
+        op->target = _block_branch_target(at + a.size + b.size, b.operand[0]);
+    }
+    else if (a.id == INC && (a.addr_mode == AM_ZPG || a.addr_mode == AM_ABS) && b.id == BNE)
+    {
+        op->kind = BLOCK_INC_BNE;
+        op->target = _block_branch_target(at + a.size + b.size, b.operand[0]);
+    }
+    else
+    {
+        return false;
+    }
+
+    op->mode = a.addr_mode;
+    op->operand = a_addr;
+    op->cycles = _block_cycles(a) + _block_cycles(b);
+    op->size = a.size + b.size;
+    return true;
+}
+
+static void _block_translate(struct block *block, struct system *system, const uint8_t *code, uint16_t pc)
+{
+    block->code = code;
+    block->pc = pc;
+    block->op_count = 0;
+    block->len = 0;
+    block->budget = 0;
+    block->in_ram = pc < 0x8000;
+    block->jit_refused = false;
+    block->jit_pending = false;
+    block->runs = 0;
+    block->native = NULL;
+
+    // A block stays in its 4K page, the next one can be another bank
+    size_t room = 0x1000 - (pc & 0xFFF);
+    room = room < BLOCK_MAX_BYTES ? room : BLOCK_MAX_BYTES;
+    uint8_t last_worst = 0;
+
+    while (block->op_count < BLOCK_MAX_OPS)
+    {
+        struct instr_decoded a;
+        if (!_block_decode(system, code + block->len, room - block->len, &a))
+        {
+            break;
+        }
+
+        uint16_t at = pc + block->len;
+        struct block_op *op = &block->ops[block->op_count];
+        struct instr_decoded b;
+        bool fused = !_block_ends(a.id) &&
+            _block_decode(system, code + block->len + a.size, room - block->len - a.size, &b) &&
+            _block_fuse(op, a, b, at);
+        bool ends = fused ? _block_ends(b.id) : _block_ends(a.id);
+
+        if (!fused)
+        {
+            op->kind = a.id;
+            op->mode = a.addr_mode;
+            op->operand = a.operand[0] | a.operand[1] << 8;
+            op->size = a.size;
+            // ricoh_run_instr counts the generic ones itself
+            op->cycles = _block_generic(a.id, a.addr_mode) ? 0 : _block_cycles(a);
+            op->target = a.addr_mode == AM_REL ? _block_branch_target(at + a.size, a.operand[0]) : 0;
+        }
+
+        // Worst case of everything before the last op, page crossings and
+        // taken branches included, decides whether the block fits before an event
+        block->budget += last_worst;
+        last_worst = fused ? op->cycles : _block_cycles(a);
+        last_worst += op->mode == AM_ABX || op->mode == AM_ABY || op->mode == AM_INY;
+        last_worst += ends ? 2 : 0;
+
+        block->op_count++;
+        block->len += op->size;
+
+        if (ends)
+        {
+            break;
+        }
+    }
+
+    if (block->in_ram)
+    {
+        memcpy(block->bytes, code, block->len);
+    }
+}
+
+static struct block *_block_shared_at(struct block_shared *shared, uint32_t index)
+{
+    return &shared->chunks[index / BLOCK_CHUNK_LEN][index % BLOCK_CHUNK_LEN];
+}
+
+// NULL and the empty slot it would go in when it isn't there. There's always
+// one, the table is never more than 3/4 full.
+static struct block *_block_shared_probe(struct block_shared *shared, const uint8_t *code, uint16_t pc, uint32_t hash, uint32_t *slot)
+{
+    const uint32_t mask = (1 << BLOCK_SHARED_BITS) - 1;
+
+    for (uint32_t i = hash >> (32 - BLOCK_SHARED_BITS); ; i = (i + 1) & mask)
+    {
+        uint32_t at = atomic32_load(&shared->slots[i]);
+        if (!at)
+        {
+            *slot = i;
+            return NULL;
+        }
+
+        struct block *block = _block_shared_at(shared, at - 1);
+        if (block->code == code && block->pc == pc)
+        {
+            return block;
+        }
+    }
+}
+
+// A new block is all written before its slot points at it, so lookups need
+// no lock. Adding one takes it, and looks again in case another player was
+// adding the same one. NULL once the table is full.
+static struct block *_block_shared_find(struct block_cache *cache, struct system *system, const uint8_t *code, uint16_t pc, uint32_t hash)
+{
+    struct block_shared *shared = cache->shared;
+    uint32_t slot;
+
+    struct block *block = _block_shared_probe(shared, code, pc, hash, &slot);
+    if (block)
+    {
+        return block;
+    }
+
+    atomic32_lock(&shared->lock);
+    block = _block_shared_probe(shared, code, pc, hash, &slot);
+    if (!block && shared->count < BLOCK_SHARED_MAX)
+    {
+        struct block **chunk = &shared->chunks[shared->count / BLOCK_CHUNK_LEN];
+        if (!*chunk)
+        {
+            *chunk = calloc(BLOCK_CHUNK_LEN, sizeof(struct block));
+        }
+        if (*chunk)
+        {
+            block = _block_shared_at(shared, shared->count);
+            _block_translate(block, system, code, pc);
+            atomic32_store(&shared->slots[slot], ++shared->count);
+            cache->translated++;
+        }
+    }
+    atomic32_unlock(&shared->lock);
+    return block;
+}
+
+static struct block *_block_find(struct block_cache *cache, struct system *system, uint16_t pc)
+{
+    const uint8_t *code = _block_code(system, pc);
+    if (!code)
+    {
+        return NULL;
+    }
+
+    // Mirrors of one bank share code but not pc, hence the pc in the hash
+    uint32_t hash = ((uint32_t)(uintptr_t)code ^ (uint32_t)pc << 16)*2654435761u;
+
+    if (pc >= 0x8000)
+    {
+        struct block **seen = &cache->rom[hash >> (32 - BLOCK_CACHE_BITS)];
+        if (*seen && (*seen)->code == code && (*seen)->pc == pc)
+        {
+            return *seen;
+        }
+
+        struct block *block = _block_shared_find(cache, system, code, pc, hash);
+        if (block)
+        {
+            *seen = block;
+            return block;
+        }
+    }
+
+    // Most games never run code from RAM, forks don't pay for the ways until they do
+    if (!cache->ram && !(cache->ram = calloc(BLOCK_RAM_LEN, sizeof(struct block))))
+    {
+        return NULL;
+    }
+
+    struct block *set = &cache->ram[(hash >> (32 - BLOCK_RAM_BITS + 1)) * 2];
+
+    for (int way = 0; way < 2; way++)
+    {
+        struct block *block = &set[way];
+        if (block->code == code && block->pc == pc &&
+            (!block->in_ram || memcmp(block->bytes, code, block->len) == 0))
+        {
+            return block;
+        }
+    }
+
+    // Two ways, a new block goes first and the one it displaces gets a
+    // second chance in the other
+    cache->evicted += set[1].code != NULL;
+    cache->translated++;
+    set[1] = set[0];
+    _block_translate(&set[0], system, code, pc);
+    // The JIT only takes shared blocks, these can get evicted under it
+    set[0].jit_refused = true;
+    return &set[0];
+}
+
+static bool _block_read(struct system *system, uint16_t addr, uint8_t *out)
+{
+    if (addr >= 0x8000)
+    {
+        const uint8_t *page = system->prg_pages[(addr >> 12) & 7];
+        if (!page)
+        {
+            return false;
+        }
+        *out = page[addr & 0xFFF];
+        return true;
+    }
+
+    if (_block_plain(addr, false))
+    {
+        *out = system->memory[addr];
+        return true;
+    }
+
+    return false;
+}
+
+// Ends the block when it writes over its own code
+static void _block_write(struct system *system, const struct block *block, uint16_t addr, uint8_t val, bool *stale)
+{
+    system->memory[addr] = val;
+    *stale |= (uint16_t)(addr - block->pc) < block->len;
+}
+
+// The same addresses make_address comes up with, crossing a page costs a
+// cycle whatever the instruction, like it does there
+static uint16_t _block_addr(struct system *system, const struct block_op *op, uint8_t *extra)
+{
+    struct ricoh_state *cpu = &system->cpu;
+    const uint8_t *ram = system->memory;
+    uint16_t base = op->operand;
+
+    switch (op->mode)
+    {
+        case AM_ZPX: return (uint8_t)(op->operand + cpu->x);
+        case AM_ZPY: return (uint8_t)(op->operand + cpu->y);
+        case AM_ABX: *extra = ((uint16_t)(base + cpu->x) ^ base) >> 8 != 0; return base + cpu->x;
+        case AM_ABY: *extra = ((uint16_t)(base + cpu->y) ^ base) >> 8 != 0; return base + cpu->y;
+        case AM_XND:
+            {
+                uint8_t zp = op->operand + cpu->x;
+                return ram[zp] | ram[(uint8_t)(zp + 1)] << 8;
+            }
+        case AM_INY:
+            base = ram[(uint8_t)op->operand] | ram[(uint8_t)(op->operand + 1)] << 8;
+            *extra = ((uint16_t)(base + cpu->y) ^ base) >> 8 != 0;
+            return base + cpu->y;
+        default: return op->operand;
+    }
+}
+
+static bool _block_load(struct system *system, const struct block_op *op, uint8_t *value, uint8_t *extra)
+{
+    if (op->mode == AM_IMM)
+    {
+        *value = (uint8_t)op->operand;
+        return true;
+    }
+
+    return _block_read(system, _block_addr(system, op, extra), value);
+}
+
+static uint8_t _block_nz(struct ricoh_state *cpu, uint8_t value)
+{
+    cpu->n_result = value;
+    cpu->z_result = value;
+    return value;
+}
+
+static uint8_t _block_add(struct ricoh_state *cpu, uint8_t a, uint8_t b)
+{
+    uint16_t sum = (uint16_t)a + b + cpu->carry;
+    uint8_t res = (uint8_t)sum;
+    cpu->carry = sum >> 8;
+    cpu->overflow = (a ^ res) & (b ^ res);
+    return _block_nz(cpu, res);
+}
+
+static void _block_branch(struct ricoh_state *cpu, const struct block_op *op, bool taken, uint16_t *next, uint8_t *extra)
+{
+    if (taken)
+    {
+        *extra = 1 + (((op->target ^ *next) >> 8) != 0);
+        *next = op->target;
+    }
+}
+
+// Compiled blocks leave the CPU where the loop below would
+static int _block_run_native(struct block *block, struct system *system, uint64_t horizon)
+{
+    int count = 0;
+    int ran;
+
+    do
+    {
+        ran = block->native(system);
+        count += ran;
+    }
+    while (ran && system->cpu.pc == block->pc && system->cpu.cycles + block->budget < horizon);
+
+    return count;
+}
+
+// Runs the block at the CPU's pc, or keeps running it while it loops on
+// itself. Instructions only start before horizon, like they would one at a
+// time. Returns how many ran, 0 means interpret the next one.
+int block_run(struct block_cache *cache, struct system *system, uint64_t horizon)
+{
+    struct ricoh_state *cpu = &system->cpu;
+
+    // Boards that don't publish their banks get no blocks, NSF is one
+    if (!system->prg_pages[7])
+    {
+        return 0;
+    }
+
+    struct block *block = _block_find(cache, system, cpu->pc);
+    if (!block || !block->op_count || cpu->cycles + block->budget >= horizon)
+    {
+        return 0;
+    }
+
+    // Forks running the same hot block would fight over the count, so it
+    // stops once the JIT made up its mind
+    bool counting = cache->jit && !block->native && !block->jit_refused;
+    if (counting && block->runs >= cache->jit->hot)
+    {
+        jit_compile(cache->jit, block, atomic32_load(&cache->shared->refs) == 1);
+        counting = !block->native && !block->jit_refused;
+    }
+
+    if (cache->jit && block->native)
+    {
+        return _block_run_native(block, system, horizon);
+    }
+
+    uint16_t pc = cpu->pc;
+    bool stale = false;
+    int count = 0;
+
+again:
+    block->runs += counting;
+
+    for (int i = 0; i < block->op_count; i++)
+    {
+        const struct block_op *op = &block->ops[i];
+        uint16_t next = pc + op->size;
+        uint8_t extra = 0;
+        uint8_t value;
+        uint16_t addr;
+
+        switch (op->kind)
+        {
+            case LDA:
+                if (!_block_load(system, op, &value, &extra)) goto leave;
+                cpu->a = _block_nz(cpu, value);
+                break;
+            case LDX:
+                if (!_block_load(system, op, &value, &extra)) goto leave;
+                cpu->x = _block_nz(cpu, value);
+                break;
+            case LDY:
+                if (!_block_load(system, op, &value, &extra)) goto leave;
+                cpu->y = _block_nz(cpu, value);
+                break;
+            case AND:
+                if (!_block_load(system, op, &value, &extra)) goto leave;
+                cpu->a = _block_nz(cpu, cpu->a & value);
+                break;
+            case ORA:
+                if (!_block_load(system, op, &value, &extra)) goto leave;
+                cpu->a = _block_nz(cpu, cpu->a | value);
+                break;
+            case EOR:
+                if (!_block_load(system, op, &value, &extra)) goto leave;
+                cpu->a = _block_nz(cpu, cpu->a ^ value);
+                break;
+            case ADC:
+                if (!_block_load(system, op, &value, &extra)) goto leave;
+                cpu->a = _block_add(cpu, cpu->a, value);
+                break;
+            case SBC:
+                if (!_block_load(system, op, &value, &extra)) goto leave;
+                cpu->a = _block_add(cpu, cpu->a, ~value);
+                break;
+            case CMP:
+            case CPX:
+            case CPY:
+                {
+                    if (!_block_load(system, op, &value, &extra)) goto leave;
+                    uint8_t reg = op->kind == CMP ? cpu->a : op->kind == CPX ? cpu->x : cpu->y;
+                    cpu->carry = reg >= value;
+                    _block_nz(cpu, reg - value);
+                }
+                break;
+            case BIT:
+                if (!_block_load(system, op, &value, &extra)) goto leave;
+                cpu->n_result = value;
+                cpu->overflow = value << 1;
+                cpu->z_result = value & cpu->a;
+                break;
+
+            case STA:
+            case STX:
+            case STY:
+                addr = _block_addr(system, op, &extra);
+                if (!_block_plain(addr, true)) goto leave;
+                _block_write(system, block, addr, op->kind == STA ? cpu->a : op->kind == STX ? cpu->x : cpu->y, &stale);
+                break;
+
+            case ASL:
+            case LSR:
+            case ROL:
+            case ROR:
+            case INC:
+            case DEC:
+                {
+                    uint8_t result;
+                    addr = 0;
+                    if (op->mode == AM_ACC)
+                    {
+                        value = cpu->a;
+                    }
+                    else
+                    {
+                        addr = _block_addr(system, op, &extra);
+                        if (!_block_plain(addr, true)) goto leave;
+                        value = system->memory[addr];
+                    }
+
+                    switch (op->kind)
+                    {
+                        case ASL: result = value << 1; cpu->carry = value >> 7; break;
+                        case LSR: result = value >> 1; cpu->carry = value & 1; break;
+                        case ROL: result = (value << 1) | cpu->carry; cpu->carry = value >> 7; break;
+                        case ROR: result = (value >> 1) | (cpu->carry << 7); cpu->carry = value & 1; break;
+                        case INC: result = value + 1; break;
+                        default: result = value - 1; break;
+                    }
+
+                    _block_nz(cpu, result);
+                    if (op->mode == AM_ACC)
+                    {
+                        cpu->a = result;
+                    }
+                    else
+                    {
+                        _block_write(system, block, addr, result, &stale);
+                    }
+                }
+                break;
+
+            case CLC: cpu->carry = 0; break;
+            case SEC: cpu->carry = 1; break;
+            case CLV: cpu->overflow = 0; break;
+            case NOP: break;
+            case DEX: cpu->x = _block_nz(cpu, cpu->x - 1); break;
+            case DEY: cpu->y = _block_nz(cpu, cpu->y - 1); break;
+            case INX: cpu->x = _block_nz(cpu, cpu->x + 1); break;
+            case INY: cpu->y = _block_nz(cpu, cpu->y + 1); break;
+            case TAX: cpu->x = _block_nz(cpu, cpu->a); break;
+            case TAY: cpu->y = _block_nz(cpu, cpu->a); break;
+            case TXA: cpu->a = _block_nz(cpu, cpu->x); break;
+            case TYA: cpu->a = _block_nz(cpu, cpu->y); break;
+            case TSX: cpu->x = _block_nz(cpu, cpu->sp); break;
+            case TXS: cpu->sp = cpu->x; break;
+            case PHA:
+                _block_write(system, block, 0x100 + cpu->sp--, cpu->a, &stale);
+                break;
+            case PLA:
+                cpu->sp++;
+                cpu->a = _block_nz(cpu, system->memory[0x100 + cpu->sp]);
+                break;
+
+            case BCC: _block_branch(cpu, op, !cpu->carry, &next, &extra); break;
+            case BCS: _block_branch(cpu, op, cpu->carry, &next, &extra); break;
+            case BEQ: _block_branch(cpu, op, cpu->z_result == 0, &next, &extra); break;
+            case BNE: _block_branch(cpu, op, cpu->z_result != 0, &next, &extra); break;
+            case BMI: _block_branch(cpu, op, (cpu->n_result & 0x80) != 0, &next, &extra); break;
+            case BPL: _block_branch(cpu, op, (cpu->n_result & 0x80) == 0, &next, &extra); break;
+            case BVC: _block_branch(cpu, op, (cpu->overflow & 0x80) == 0, &next, &extra); break;
+            case BVS: _block_branch(cpu, op, (cpu->overflow & 0x80) != 0, &next, &extra); break;
+
+            case JMP:
+                if (op->mode == AM_ABS)
+                {
+                    next = op->operand;
+                    break;
+                }
+                // fallthrough, JMP ($xxxx) is generic
+            case BRK:
+            case RTI:
+            case PLP:
+            case PHP:
+            case CLI:
+            case SEI:
+            case CLD:
+            case SED:
+                {
+                    struct instr_decoded decoded = { op->kind, op->mode, { op->operand & 0xFF, op->operand >> 8 }, op->size };
+                    cpu->pc = pc;
+                    ricoh_run_instr(cpu, decoded, &system->mem);
+                    next = cpu->pc;
+                }
+                break;
+            case JSR:
+                {
+                    uint16_t ret = next - 1;
+                    _block_write(system, block, 0x100 + cpu->sp--, ret >> 8, &stale);
+                    _block_write(system, block, 0x100 + cpu->sp--, ret & 0xFF, &stale);
+                    next = op->operand;
+                }
+                break;
+            case RTS:
+                // Same wrap as pull16, at SP 0 the low byte comes from $00FF
+                cpu->sp += 2;
+                next = (system->memory[cpu->sp + 0x100] << 8 | system->memory[(cpu->sp - 1) + 0x100]) + 1;
+                break;
+
+            case BLOCK_LDA_STA:
+                if (!_block_load(system, op, &value, &extra)) goto leave;
+                cpu->a = _block_nz(cpu, value);
+                _block_write(system, block, op->target, value, &stale);
+                break;
+            case BLOCK_DEX_BNE:
+                cpu->x = _block_nz(cpu, cpu->x - 1);
+                _block_branch(cpu, op, cpu->x != 0, &next, &extra);
+                break;
+            case BLOCK_DEY_BNE:
+                cpu->y = _block_nz(cpu, cpu->y - 1);
+                _block_branch(cpu, op, cpu->y != 0, &next, &extra);
+                break;
+            case BLOCK_INC_BNE:
+                value = _block_nz(cpu, system->memory[op->operand] + 1);
+                _block_write(system, block, op->operand, value, &stale);
+                _block_branch(cpu, op, value != 0, &next, &extra);
+                break;
+        }
+
+        cpu->cycles += op->cycles + extra;
+        count += op->kind > _ICOUNT ? 2 : 1;
+        pc = next;
+
+        if (stale)
+        {
+            break;
+        }
+    }
+
+    // Tight loops go around again without a lookup, if the next pass fits too
+    if (pc == block->pc && !stale && cpu->cycles + block->budget < horizon)
+    {
+        goto again;
+    }
+
+leave:
+    cpu->pc = pc;
+    return count;
+}
@@ -0,0 +1,81 @@
+// Pattern tables decoded to one byte per pixel, for anything that wants tiles
+// rather than bitplanes. CHR-ROM slots get decoded again when a board banks
+// them, CHR-RAM only where the PPU saw writes.
+
+#include "neske.h"
+#include <string.h>
+
+static void _chr_cache_decode(uint8_t *pixels, const uint8_t *planes)
+{
+    for (int y = 0; y < 8; y++)
+    {
+        uint8_t lo = planes[y];
+        uint8_t hi = planes[y + 8];
+        for (int x = 0; x < 8; x++)
+        {
+            int bit = 7 - x;
+            pixels[y*8 + x] = ((lo >> bit) & 1) | (((hi >> bit) & 1) << 1);
+        }
+    }
+}
+
+void chr_cache_update(struct chr_cache *cache, struct ppu *ppu)
+{
+    uint64_t dirty[8];
+    ppu_take_chr_dirty(ppu, dirty);
+    cache->decoded = 0;
+
+    for (int slot = 0; slot < 8; slot++)
+    {
+        // Smaller CHR-RAM repeats, a slot shares its dirty bits with the one it mirrors
+        const uint8_t *rom = ppu->pins.chr_rom[slot];
+        uint16_t offset = (slot*0x400) & ppu->pins.chr_ram_mask;
+        const uint8_t *src = rom ? rom : ppu->pins.chr + offset;
+        uint64_t tiles = rom ? 0 : dirty[offset >> 10];
+
+        if (!cache->valid || cache->slots[slot] != src)
+        {
+            tiles = UINT64_MAX;
+            cache->slots[slot] = src;
+        }
+
+        for (int tile = 0; tiles; tile++, tiles >>= 1)
+        {
+            if (tiles & 1)
+            {
+                _chr_cache_decode(cache->pixels[slot*64 + tile], src + tile*16);
+                cache->decoded++;
+            }
+        }
+    }
+
+    cache->valid = true;
+}
+
+// Both tables side by side in the top 128 lines, in one of the 8 palettes
+void chr_cache_draw(struct chr_cache *cache, struct ppu *ppu, uint8_t palette, struct system_frame_result *out)
+{
+    memset(out->screen, 0x0F, sizeof out->screen);
+    memset(out->line_mask, 0, sizeof out->line_mask);
+
+    uint8_t colors[4];
+    for (int i = 0; i < 4; i++)
+    {
+        colors[i] = ppu->pallete[i ? (palette & 7)*4 + i : 0] & 0x3F;
+    }
+
+    for (int tile = 0; tile < CHR_CACHE_TILES; tile++)
+    {
+        int x0 = (tile >> 8)*128 + (tile & 15)*8;
+        int y0 = ((tile >> 4) & 15)*8;
+        const uint8_t *pixels = cache->pixels[tile];
+
+        for (int y = 0; y < 8; y++)
+        {
+            for (int x = 0; x < 8; x++)
+            {
+                out->screen[(y0 + y)*256 + x0 + x] = colors[pixels[y*8 + x]];
+            }
+        }
+    }
+}
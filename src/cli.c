@@ -0,0 +1,1287 @@
+// Headless frontend, no SDL. Renders audio as fast as the emulator runs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include "neske.h"
+
+#define CLI_FRAME_RATE (APU_CPU_RATE/29780.5)
+#define CLI_DEFAULT_SECONDS 120
+
+static void cli_mux_nop(void *mux)
+{
+}
+
+static struct mux_api cli_mux_make()
+{
+    return (struct mux_api){ NULL, cli_mux_nop, cli_mux_nop };
+}
+
+static void cli_usage()
+{
+    printf(
+        "usage: neske_cli render <file.nsf|file.nes> [options]\n"
+        "       neske_cli convert <capture.nesv> <out.y4m>\n"
+        "       neske_cli replay <file.nes> <movie.nmv|movie.fm2> [-g frame] [-k interval] [-o out.nmv] [--interp|--jit]\n"
+        "       neske_cli rtc <file.nes> [options]\n"
+        "       neske_cli batch <file.nes> [-n count] [-m frames] [-w frames] [-s scale] [-j threads]\n"
+        "       neske_cli info <file.nes>\n"
+        "       neske_cli patterns <file.nes> <out.y4m> [-n frames] [-p palette]\n"
+        "       neske_cli trace <file.nes> [-n count] [-p pc] [-r reference.log] [-t reps] [--blocks|--jit]\n"
+        "       neske_cli bench [convert]\n"
+        "  -t <track>    render only this track (1-based), default all\n"
+        "  -s <seconds>  length of each track, default %d\n"
+        "  -r <rate>     sample rate, default %d\n"
+        "  -o <prefix>   output prefix, default is the input name\n"
+        "  -f <format>   pcm or wav, default pcm\n"
+        "  --stems       also write every channel on its own, wav only\n"
+        "  --no-sav      don't load or write <file>.sav for carts with a battery\n"
+        "  -v <format>   also capture every frame, idx (.nesv) or y4m\n"
+        "Writes <prefix>_<track>.pcm, signed 16-bit little endian mono, or .wav.\n"
+        "replay plays a movie to the end and prints the last frame's hash, -g then seeks\n"
+        "back to a frame and checks it matches, -o saves the movie with its keyframes,\n"
+        "--interp runs the CPU one instruction at a time instead of in blocks, --jit\n"
+        "compiles the hot ones to native code, x86-64 only.\n"
+        "rtc runs seeded corruption schedules from one state and ranks them:\n"
+        "  -w <frames>   start after this many frames from power on, default 300\n"
+        "  -i <movie>    or start where this movie ends\n"
+        "  -n <seeds>    schedules to try, default 1000, -S sets the first seed\n"
+        "  -m <frames>   frames each runs, default 600\n"
+        "  -l low|high   corruption level, default low\n"
+        "  -T <targets>  any of ram,prg,vram,oam, default ram\n"
+        "  -k <count>    results to print, default 20, --crash ranks crashes first\n"
+        "  -j <threads>  default one per CPU\n"
+        "  -x <seed>     replay one seed to <file>_rtc_<seed>.y4m instead\n"
+        "batch forks -n instances, default 64, after -w frames and steps them -m frames\n"
+        "with their own inputs on -j threads, observations scaled down by -s (1, 2, 4\n"
+        "or 8, default 4). Prints frames per second, then checks every instance ends\n"
+        "like a plain fork run alone.\n"
+        "patterns films both pattern tables for -n frames, default 600, in background\n"
+        "palette -p (0-7, default 0) and prints how many tiles had to be decoded.\n"
+        "trace runs just the CPU from the reset vector or -p (hex) and prints -n\n"
+        "instructions, default 100, or checks them against a nestest style log -r.\n"
+        "-t then times that stretch run -t times over. --blocks runs it translated,\n"
+        "checked where each block ends, --jit compiles every block the first time.\n",
+        CLI_DEFAULT_SECONDS, APU_DEFAULT_SAMPLE_RATE
+    );
+}
+
+struct cli_options
+{
+    int only_track;
+    double seconds;
+    uint32_t rate;
+    bool wav;
+    bool stems;
+    bool video;
+    enum vidrec_format video_format;
+    bool no_sav;
+    struct save_file *save; // NULL for carts without a battery or with --no-sav
+};
+
+static bool cli_render_track(struct player *player, struct sample_ring *ring, int track, struct cli_options *options, const char *path)
+{
+    FILE *out = NULL;
+    struct wav_recorder *recorder = NULL;
+    struct video_recorder *video_recorder = NULL;
+
+    player_select_track(player, track);
+    sample_ring_init(ring);
+
+    if (options->wav)
+    {
+        // The recorder's own thread does the writing, the ring isn't needed
+        recorder = wav_recorder_start(path, options->rate, options->stems);
+        if (!recorder)
+        {
+            return false;
+        }
+        player_set_audio_ring(player, NULL, false);
+        player_set_audio_writer(player, wav_recorder_writer(recorder), options->stems);
+    }
+    else
+    {
+        out = fopen(path, "wb");
+        if (!out)
+        {
+            printf("Can't write %s\n", path);
+            return false;
+        }
+        player_set_audio_ring(player, ring, false);
+    }
+
+    if (options->video)
+    {
+        char video_path[1100];
+        snprintf(video_path, sizeof video_path, "%.*s.%s", (int)(strrchr(path, '.') - path), path,
+            options->video_format == VIDREC_Y4M ? "y4m" : "nesv");
+
+        // Nothing is live here, better to wait on the disk than lose a frame
+        video_recorder = video_recorder_start(video_path, options->video_format, true);
+    }
+
+    static int16_t samples[SAMPLE_RING_LEN];
+    uint64_t frames = (uint64_t)(options->seconds*CLI_FRAME_RATE);
+    uint64_t written = 0;
+    clock_t start = clock();
+
+    for (uint64_t i = 0; i < frames && !player_crash(player); i++)
+    {
+        struct system_frame_result frame = player_frame(player);
+
+        if (video_recorder)
+        {
+            video_recorder_push(video_recorder, &frame);
+        }
+
+        if (options->save)
+        {
+            save_file_sync(options->save);
+        }
+
+        if (out)
+        {
+            uint32_t count = sample_ring_read(ring, samples, sample_ring_fill(ring));
+            fwrite(samples, sizeof *samples, count, out);
+            written += count;
+        }
+    }
+
+    if (video_recorder)
+    {
+        video_recorder_stop(video_recorder);
+    }
+
+    if (recorder)
+    {
+        player_set_audio_writer(player, (struct apu_writer){ 0 }, false);
+        written = recorder->samples_written + recorder->block_fill;
+        wav_recorder_stop(recorder);
+    }
+    else
+    {
+        fclose(out);
+    }
+
+    double took = (double)(clock() - start)/CLOCKS_PER_SEC;
+    printf("%s: %llu samples, %.2fs (%.0fx realtime)%s\n",
+        path, (unsigned long long)written, took, took > 0 ? options->seconds/took : 0,
+        player_crash(player) ? ", crashed" : "");
+
+    return true;
+}
+
+static int cli_render(int argc, char **argv)
+{
+    if (argc < 1)
+    {
+        cli_usage();
+        return 1;
+    }
+
+    const char *input = argv[0];
+    const char *prefix = NULL;
+    struct cli_options options = { 0, CLI_DEFAULT_SECONDS, APU_DEFAULT_SAMPLE_RATE, false, false, false, VIDREC_INDEXED };
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value = i+1 < argc ? argv[i+1] : NULL;
+
+        if (strcmp(argv[i], "--stems") == 0) { options.stems = true; continue; }
+        if (strcmp(argv[i], "--no-sav") == 0) { options.no_sav = true; continue; }
+
+        if (!value)
+        {
+            cli_usage();
+            return 1;
+        }
+
+        if (strcmp(argv[i], "-t") == 0) options.only_track = atoi(value);
+        else if (strcmp(argv[i], "-s") == 0) options.seconds = atof(value);
+        else if (strcmp(argv[i], "-r") == 0) options.rate = atoi(value);
+        else if (strcmp(argv[i], "-o") == 0) prefix = value;
+        else if (strcmp(argv[i], "-f") == 0) options.wav = strcmp(value, "wav") == 0;
+        else if (strcmp(argv[i], "-v") == 0)
+        {
+            options.video = true;
+            options.video_format = strcmp(value, "y4m") == 0 ? VIDREC_Y4M : VIDREC_INDEXED;
+        }
+        else
+        {
+            cli_usage();
+            return 1;
+        }
+
+        i++;
+    }
+
+    if (options.stems && !options.wav)
+    {
+        printf("--stems needs -f wav\n");
+        return 1;
+    }
+
+    char default_prefix[1024];
+    if (!prefix)
+    {
+        snprintf(default_prefix, sizeof default_prefix, "%s", input);
+        char *dot = strrchr(default_prefix, '.');
+        if (dot) *dot = 0;
+        prefix = default_prefix;
+    }
+
+    struct rom_file rom;
+    if (!rom_file_open(input, &rom))
+    {
+        return 1;
+    }
+
+    struct player player = player_init(rom.data, rom.size, cli_mux_make());
+    if (!player.is_valid)
+    {
+        printf("Invalid ROM or unsupported mapper\n");
+        rom_file_close(&rom);
+        return 1;
+    }
+
+    if (!options.no_sav)
+    {
+        options.save = save_file_open(&player, input);
+    }
+
+    // Nothing plays this back live, so the resampler stays at the exact nominal ratio
+    struct sample_ring *ring = malloc(sizeof *ring);
+    player_set_sample_rate(&player, options.rate);
+
+    int first = 0;
+    int last = player_track_count(&player);
+    if (options.only_track > 0)
+    {
+        first = options.only_track-1;
+        last = options.only_track;
+    }
+
+    int result = 0;
+
+    for (int track = first; track < last; track++)
+    {
+        char path[1100];
+        snprintf(path, sizeof path, "%s_%02d.%s", prefix, track+1, options.wav ? "wav" : "pcm");
+
+        if (!cli_render_track(&player, ring, track, &options, path))
+        {
+            result = 1;
+            break;
+        }
+    }
+
+    save_file_close(options.save);
+    player_free(&player);
+    free(ring);
+    rom_file_close(&rom);
+
+    return result;
+}
+
+static double cli_seconds_since(clock_t start)
+{
+    return (double)(clock() - start)/CLOCKS_PER_SEC;
+}
+
+static int cli_replay(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        cli_usage();
+        return 1;
+    }
+
+    const char *input = argv[0];
+    const char *movie_path = argv[1];
+    const char *out_path = NULL;
+    int64_t seek_to = -1;
+    uint32_t keyframe_interval = MOVIE_DEFAULT_KEYFRAME_INTERVAL;
+    bool interpret = false;
+    bool jit = false;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--interp") == 0) { interpret = true; continue; }
+        if (strcmp(argv[i], "--jit") == 0) { jit = true; continue; }
+
+        const char *value = i+1 < argc ? argv[i+1] : NULL;
+        if (!value)
+        {
+            cli_usage();
+            return 1;
+        }
+
+        if (strcmp(argv[i], "-g") == 0) seek_to = atoll(value);
+        else if (strcmp(argv[i], "-k") == 0) keyframe_interval = atoi(value);
+        else if (strcmp(argv[i], "-o") == 0) out_path = value;
+        else
+        {
+            cli_usage();
+            return 1;
+        }
+        i++;
+    }
+
+    const char *dot = strrchr(movie_path, '.');
+    struct movie *movie = dot && strcmp(dot, ".fm2") == 0
+        ? movie_import_fm2(movie_path, keyframe_interval)
+        : movie_load(movie_path);
+    if (!movie)
+    {
+        return 1;
+    }
+
+    struct rom_file rom = { 0 };
+    struct player player = rom_file_open(input, &rom) ? player_init(rom.data, rom.size, cli_mux_make()) : (struct player){ 0 };
+    if (!player.is_valid)
+    {
+        printf("Invalid ROM or unsupported mapper\n");
+        movie_free(movie);
+        rom_file_close(&rom);
+        return 1;
+    }
+
+    // Nobody listens, the audio only has to stay deterministic
+    player_set_audio_ring(&player, NULL, false);
+    player_set_blocks(&player, !interpret);
+    if (jit && !player_set_jit(&player, true))
+    {
+        printf("Running blocks without the JIT\n");
+    }
+
+    struct system_frame_result frame;
+    uint64_t hash = 0;
+    uint64_t seek_hash = 0;
+    clock_t start = clock();
+
+    while (movie_play_frame(movie, &player, &frame))
+    {
+        hash = video_frame_hash(&frame);
+        if (movie->cursor - 1 == seek_to)
+        {
+            seek_hash = hash;
+        }
+    }
+
+    double took = cli_seconds_since(start);
+    printf("%u frames in %.2fs (%.0f fps), last frame %016llx%s\n", movie->frame_count, took,
+        took > 0 ? movie->frame_count/took : 0, (unsigned long long)hash, player_crash(&player) ? ", crashed" : "");
+
+    int result = 0;
+
+    if (seek_to >= 0 && seek_to < movie->frame_count)
+    {
+        start = clock();
+        movie_seek(movie, &player, (uint32_t)seek_to);
+        movie_play_frame(movie, &player, &frame);
+        took = cli_seconds_since(start);
+
+        bool match = video_frame_hash(&frame) == seek_hash;
+        printf("seek to frame %lld took %.3fs, %s\n", (long long)seek_to, took, match ? "matches" : "MISMATCH");
+        result = match ? 0 : 1;
+    }
+
+    if (out_path && !movie_save(movie, out_path))
+    {
+        result = 1;
+    }
+
+    player_free(&player);
+    movie_free(movie);
+    rom_file_close(&rom);
+
+    return result;
+}
+
+static uint32_t cli_parse_targets(const char *value)
+{
+    const char *names[] = { "ram", "prg", "vram", "oam" };
+    uint32_t targets = 0;
+
+    while (*value)
+    {
+        size_t len = strcspn(value, ",");
+        for (int i = 0; i < 4; i++)
+        {
+            if (strlen(names[i]) == len && strncmp(value, names[i], len) == 0)
+            {
+                targets |= 1 << i;
+            }
+        }
+        value += len + (value[len] == ',');
+    }
+
+    return targets;
+}
+
+static int cli_rtc(int argc, char **argv)
+{
+    if (argc < 1)
+    {
+        cli_usage();
+        return 1;
+    }
+
+    const char *input = argv[0];
+    const char *movie_path = NULL;
+    uint32_t warmup = 300;
+    uint32_t top = 20;
+    int threads = 0;
+    int64_t replay_seed = -1;
+    struct rtc_explore_options options = { RTC_LOW, RTC_TARGET_RAM, 1, 1000, 600, RTC_RANK_DIFF };
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--crash") == 0) { options.rank = RTC_RANK_CRASH; continue; }
+
+        const char *value = i+1 < argc ? argv[i+1] : NULL;
+        if (!value)
+        {
+            cli_usage();
+            return 1;
+        }
+
+        if (strcmp(argv[i], "-w") == 0) warmup = atoi(value);
+        else if (strcmp(argv[i], "-i") == 0) movie_path = value;
+        else if (strcmp(argv[i], "-n") == 0) options.seeds = atoi(value);
+        else if (strcmp(argv[i], "-S") == 0) options.first_seed = strtoull(value, NULL, 10);
+        else if (strcmp(argv[i], "-m") == 0) options.frames = atoi(value);
+        else if (strcmp(argv[i], "-l") == 0) options.level = strcmp(value, "high") == 0 ? RTC_HIGH : RTC_LOW;
+        else if (strcmp(argv[i], "-T") == 0) options.targets = cli_parse_targets(value);
+        else if (strcmp(argv[i], "-k") == 0) top = atoi(value);
+        else if (strcmp(argv[i], "-j") == 0) threads = atoi(value);
+        else if (strcmp(argv[i], "-x") == 0) replay_seed = strtoll(value, NULL, 10);
+        else
+        {
+            cli_usage();
+            return 1;
+        }
+
+        i++;
+    }
+
+    if (!options.targets || !options.seeds || !options.frames)
+    {
+        cli_usage();
+        return 1;
+    }
+
+    struct rom_file rom = { 0 };
+    struct player player = rom_file_open(input, &rom) ? player_init(rom.data, rom.size, cli_mux_make()) : (struct player){ 0 };
+    if (!player.is_valid || !player_state_size(&player))
+    {
+        printf("Invalid ROM or one without savestates\n");
+        rom_file_close(&rom);
+        return 1;
+    }
+
+    player_set_audio_ring(&player, NULL, false);
+
+    // Get to the state every schedule starts from
+    if (movie_path)
+    {
+        struct movie *movie = movie_load(movie_path);
+        if (!movie)
+        {
+            player_free(&player);
+            rom_file_close(&rom);
+            return 1;
+        }
+        while (movie_play_frame(movie, &player, NULL))
+        {
+        }
+        movie_free(movie);
+    }
+    else
+    {
+        for (uint32_t i = 0; i < warmup; i++)
+        {
+            player_frame(&player);
+        }
+    }
+
+    int result = 0;
+
+    if (replay_seed >= 0)
+    {
+        char path[1100];
+        snprintf(path, sizeof path, "%.*s_rtc_%lld.y4m", (int)(strrchr(input, '.') ? strrchr(input, '.') - input : (long)strlen(input)), input, (long long)replay_seed);
+
+        struct video_recorder *capture = video_recorder_start(path, VIDREC_Y4M, true);
+        struct rtc_result run = rtc_run_seed(&player, &options, (uint64_t)replay_seed, NULL, capture);
+        if (capture)
+        {
+            video_recorder_stop(capture);
+        }
+
+        printf("seed %llu: %u frames%s, written to %s\n", (unsigned long long)run.seed, run.frames_run, run.crashed ? ", crashed" : "", path);
+    }
+    else
+    {
+        struct rtc_result *results = calloc(options.seeds, sizeof *results);
+        struct thread_pool *pool = thread_pool_new(threads);
+        clock_t start = clock();
+
+        if (!results || !pool || !rtc_explore(&player, &options, results, pool))
+        {
+            printf("Couldn't run the explorer\n");
+            result = 1;
+        }
+        else
+        {
+            double took = cli_seconds_since(start);
+            uint32_t crashes = 0;
+            for (uint32_t i = 0; i < options.seeds; i++)
+            {
+                crashes += results[i].crashed;
+            }
+
+            printf("%u seeds x %u frames, %u crashed, %.2fs of CPU time\n", options.seeds, options.frames, crashes, took);
+
+            for (uint32_t i = 0; i < top && i < options.seeds; i++)
+            {
+                struct rtc_result *run = &results[i];
+                printf("seed %-8llu difference %.3f", (unsigned long long)run->seed, run->difference);
+                if (run->crashed)
+                {
+                    printf(", crashed at frame %u", run->frames_run);
+                }
+                printf("\n");
+            }
+        }
+
+        if (pool)
+        {
+            thread_pool_free(pool);
+        }
+        free(results);
+    }
+
+    player_free(&player);
+    rom_file_close(&rom);
+
+    return result;
+}
+
+// Wall clock, clock() adds up every thread's CPU time
+static double cli_wall_seconds()
+{
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return now.tv_sec + now.tv_nsec/1e9;
+}
+
+// Same buttons for an instance and frame on every run, held for 8 frames so things move
+static struct controller_state cli_batch_input(int index, uint32_t frame)
+{
+    uint64_t z = ((uint64_t)index << 32 | frame/8) * 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+
+    struct controller_state input = { 0 };
+    for (int b = 0; b < 8; b++)
+    {
+        input.btns[b] = b != BTN_START && b != BTN_SELECT && ((z >> b) & 1);
+    }
+    return input;
+}
+
+// Save states carry host pointers, so this compares what the game sees instead
+static bool cli_batch_same(struct system *a, struct system *b)
+{
+    return a->cpu.pc == b->cpu.pc && a->cpu.cycles == b->cpu.cycles
+        && memcmp(a->memory, b->memory, 0x800) == 0
+        && memcmp(a->ppu.vram, b->ppu.vram, sizeof a->ppu.vram) == 0
+        && memcmp(a->ppu.screen, b->ppu.screen, sizeof a->ppu.screen) == 0;
+}
+
+static int cli_batch(int argc, char **argv)
+{
+    if (argc < 1)
+    {
+        cli_usage();
+        return 1;
+    }
+
+    const char *input = argv[0];
+    int count = 64;
+    uint32_t frames = 600;
+    uint32_t warmup = 300;
+    int scale = 4;
+    int threads = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value = i+1 < argc ? argv[i+1] : NULL;
+        if (!value)
+        {
+            cli_usage();
+            return 1;
+        }
+
+        if (strcmp(argv[i], "-n") == 0) count = atoi(value);
+        else if (strcmp(argv[i], "-m") == 0) frames = atoi(value);
+        else if (strcmp(argv[i], "-w") == 0) warmup = atoi(value);
+        else if (strcmp(argv[i], "-s") == 0) scale = atoi(value);
+        else if (strcmp(argv[i], "-j") == 0) threads = atoi(value);
+        else
+        {
+            cli_usage();
+            return 1;
+        }
+
+        i++;
+    }
+
+    if (count <= 0 || !frames)
+    {
+        cli_usage();
+        return 1;
+    }
+
+    struct rom_file rom = { 0 };
+    struct player player = rom_file_open(input, &rom) ? player_init(rom.data, rom.size, cli_mux_make()) : (struct player){ 0 };
+    if (!player.is_valid || !player_state_size(&player))
+    {
+        printf("Invalid ROM or one without savestates\n");
+        rom_file_close(&rom);
+        return 1;
+    }
+
+    player_set_audio_ring(&player, NULL, false);
+    for (uint32_t i = 0; i < warmup; i++)
+    {
+        player_frame(&player);
+    }
+
+    // Zero page, where most games keep what a bot would look at
+    uint16_t probes[256];
+    for (int i = 0; i < 256; i++)
+    {
+        probes[i] = (uint16_t)i;
+    }
+
+    struct controller_state *inputs = malloc(count*sizeof *inputs);
+    struct thread_pool *pool = thread_pool_new(threads);
+    struct player_batch *batch = pool ? player_batch_new(&player, count, scale, probes, 256, pool) : NULL;
+
+    int result = 0;
+
+    if (!inputs || !batch)
+    {
+        printf("Couldn't make the batch, -s takes 1, 2, 4 or 8\n");
+        result = 1;
+    }
+    else
+    {
+        double start = cli_wall_seconds();
+        for (uint32_t f = 0; f < frames; f++)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                inputs[i] = cli_batch_input(i, f);
+            }
+            players_step(batch, inputs);
+        }
+        double took = cli_wall_seconds() - start;
+
+        int crashes = 0;
+        for (int i = 0; i < count; i++)
+        {
+            crashes += batch->crashed[i];
+        }
+
+        printf("%d instances x %u frames, %d crashed, %.2fs, %.0f frames/s\n", count, frames, crashes, took, count*(double)frames/took);
+
+        // Every instance again on a plain fork, one at a time, has to end up in the same state
+        int mismatches = 0;
+        for (int i = 0; i < count; i++)
+        {
+            struct player fork = player_fork(&player);
+            if (!fork.is_valid)
+            {
+                printf("Couldn't fork the player\n");
+                result = 1;
+                break;
+            }
+
+            for (uint32_t f = 0; f < frames; f++)
+            {
+                player_set_controller(&fork, cli_batch_input(i, f));
+                player_frame(&fork);
+            }
+
+            bool same = cli_batch_same(player_get_system(&fork), player_get_system(&batch->players[i]));
+            player_free(&fork);
+
+            if (!same)
+            {
+                printf("instance %d doesn't match its serial fork\n", i);
+                mismatches++;
+            }
+        }
+
+        if (!result)
+        {
+            if (mismatches)
+            {
+                printf("%d of %d instances differ\n", mismatches, count);
+                result = 1;
+            }
+            else
+            {
+                printf("all %d instances match serial forks\n", count);
+            }
+        }
+    }
+
+    if (batch)
+    {
+        player_batch_free(batch);
+    }
+    if (pool)
+    {
+        thread_pool_free(pool);
+    }
+    free(inputs);
+    player_free(&player);
+    rom_file_close(&rom);
+
+    return result;
+}
+
+#define CLI_BENCH_READS (1 << 24)
+#define CLI_BENCH_CONFIGS 8
+
+// Cartridge reads under a handful of random bank setups per board. Banks are
+// resolved when registers are written, so the read cost shouldn't move with
+// whatever the registers say.
+static int cli_bench()
+{
+    size_t prg_size = 0x40000;
+    size_t chr_size = 0x8000;
+    uint8_t *ines = calloc(1, 16 + prg_size + chr_size);
+    if (!ines)
+    {
+        return 1;
+    }
+
+    // PRG bytes all differ so a wrong bank would show up in the checksum
+    for (size_t i = 0; i < prg_size + chr_size; i++)
+    {
+        ines[16 + i] = (uint8_t)(i*7 + (i >> 12));
+    }
+
+    printf("board       ns/read min   max    ns/write\n");
+
+    for (int number = 0; number < 256; number++)
+    {
+        const struct cart_board *board = cart_find_board(number);
+        if (!board)
+        {
+            continue;
+        }
+
+        // NROM takes 32K at most, everything else gets the big image
+        bool small = number == 0;
+        memcpy(ines, "NES\x1A", 4);
+        ines[4] = small ? 2 : prg_size/0x4000;
+        ines[5] = small ? 1 : chr_size/0x2000;
+        ines[6] = (number & 0x0F) << 4;
+        ines[7] = number & 0xF0;
+        size_t size = small ? 16 + 0x8000 + 0x2000 : 16 + prg_size + chr_size;
+
+        struct player player = player_init(ines, size, cli_mux_make());
+        if (!player.is_valid)
+        {
+            continue;
+        }
+
+        struct ricoh_mem_interface mem = player_get_system(&player)->mem;
+        uint32_t rng = 1;
+        uint32_t sum = 0;
+        double fastest = 1e9;
+        double slowest = 0;
+
+        for (int config = 0; config < CLI_BENCH_CONFIGS; config++)
+        {
+            // Five writes so shift register boards take one too
+            for (int i = 0; i < 5; i++)
+            {
+                rng = rng*1664525 + 1013904223;
+                mem.set(mem.instance, 0x8000 | (rng >> 17), (rng >> 8) & 0x7F);
+            }
+
+            clock_t start = clock();
+            for (uint32_t i = 0; i < CLI_BENCH_READS; i++)
+            {
+                rng = rng*1664525 + 1013904223;
+                sum += mem.get(mem.instance, 0x8000 | (rng >> 17));
+            }
+            double ns = cli_seconds_since(start)*1e9/CLI_BENCH_READS;
+
+            if (ns < fastest) fastest = ns;
+            if (ns > slowest) slowest = ns;
+        }
+
+        clock_t start = clock();
+        for (uint32_t i = 0; i < CLI_BENCH_READS/16; i++)
+        {
+            rng = rng*1664525 + 1013904223;
+            mem.set(mem.instance, 0x8000 | (rng >> 17), (rng >> 8) & 0x7F);
+        }
+        double write_ns = cli_seconds_since(start)*1e9/(CLI_BENCH_READS/16);
+
+        printf("%-11s %6.2f  %6.2f  %8.2f   (%08X)\n", board->name, fastest, slowest, write_ns, sum);
+        player_free(&player);
+    }
+
+    free(ines);
+    return 0;
+}
+
+#define CLI_BENCH_CONVERT_FRAMES 2000
+
+// The line converter, scalar against the vector path this CPU gets, over
+// one fixed frame that goes through every emphasis and grayscale. Fails when
+// a single pixel differs.
+static int cli_bench_convert()
+{
+    static struct system_frame_result frame;
+    static uint32_t scalar[240*256];
+    static uint32_t vector[240*256];
+    struct video_lut lut = { 0 };
+    video_lut_update(&lut, video_palette);
+
+    // Indices go past 63 too, the converter has to mask them
+    uint32_t rng = 1;
+    for (int i = 0; i < 240*256; i++)
+    {
+        rng = rng*1664525 + 1013904223;
+        frame.screen[i] = rng >> 24;
+    }
+    for (int y = 0; y < 240; y++)
+    {
+        frame.line_mask[y] = (uint8_t)((y & 7) << 5 | (y >> 3 & 1));
+    }
+
+    double best[2] = { 1e9, 1e9 };
+    for (int round = 0; round < 5; round++)
+    {
+        for (int kind = 0; kind < 2; kind++)
+        {
+            uint32_t *dest = kind ? vector : scalar;
+            clock_t start = clock();
+            for (int f = 0; f < CLI_BENCH_CONVERT_FRAMES; f++)
+            {
+                for (int y = 0; y < 240; y++)
+                {
+                    (kind ? video_convert_line : video_convert_line_scalar)(&lut, dest + y*256, frame.screen + y*256, frame.line_mask[y]);
+                }
+            }
+            double ns = cli_seconds_since(start)*1e9/CLI_BENCH_CONVERT_FRAMES/240;
+            best[kind] = ns < best[kind] ? ns : best[kind];
+        }
+    }
+
+    printf("scalar %.1f ns a line, %s %.1f ns a line\n", best[0], video_convert_simd(&lut), best[1]);
+
+    for (int i = 0; i < 240*256; i++)
+    {
+        if (scalar[i] != vector[i])
+        {
+            printf("pixel %d,%d differs: %08X scalar, %08X %s\n", i % 256, i / 256, scalar[i], vector[i], video_convert_simd(&lut));
+            return 1;
+        }
+    }
+    printf("outputs match\n");
+    return 0;
+}
+
+// Prints what the loader made of a ROM, and the database line that would pin it
+static int cli_info(const char *input)
+{
+    struct rom_file rom;
+    if (!rom_file_open(input, &rom))
+    {
+        return 1;
+    }
+
+    struct mapper_data data = mapper_get_data(rom.data, rom.size);
+    if (!data.is_valid)
+    {
+        printf("Not an iNES ROM or the header is broken\n");
+        rom_file_close(&rom);
+        return 1;
+    }
+
+    const char *mirroring[] = { "one screen", "one screen", "vertical", "horizontal", "four screen" };
+    const char *timing[] = { "NTSC", "PAL", "multi region", "Dendy" };
+
+    printf("PRG-ROM %zuK, CHR-ROM %zuK, PRG-RAM %zuK + %zuK battery, CHR-RAM %zuK + %zuK battery\n",
+        data.prg_size/1024, data.chr_size/1024, data.prg_ram_size/1024, data.prg_nvram_size/1024,
+        data.chr_ram_size/1024, data.chr_nvram_size/1024);
+    printf("%s mirroring, %s%s%s\n", mirroring[data.mirroring], timing[data.timing],
+        data.has_battery ? ", battery" : "", data.has_trainer ? ", trainer" : "");
+
+    if (!data.from_db)
+    {
+        printf("romdb.c line if this header is right:\n    { 0x%08X, { 'N','E','S',0x1A", data.crc);
+        for (int i = 4; i < 16; i++)
+        {
+            printf(", 0x%02X", rom.data[i]);
+        }
+        printf(" }, \"\" },\n");
+    }
+
+    rom_file_close(&rom);
+    return 0;
+}
+
+// Films the pattern tables as a game runs, mostly to watch CHR-RAM games build theirs
+static int cli_patterns(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        cli_usage();
+        return 1;
+    }
+
+    const char *input = argv[0];
+    const char *out_path = argv[1];
+    uint64_t frames = 600;
+    uint8_t palette = 0;
+
+    for (int i = 2; i+1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "-n") == 0) frames = strtoull(argv[i+1], NULL, 10);
+        else if (strcmp(argv[i], "-p") == 0) palette = atoi(argv[i+1]);
+        else
+        {
+            cli_usage();
+            return 1;
+        }
+    }
+
+    struct rom_file rom = { 0 };
+    struct player player = rom_file_open(input, &rom) ? player_init(rom.data, rom.size, cli_mux_make()) : (struct player){ 0 };
+    if (!player.is_valid)
+    {
+        printf("Invalid ROM or unsupported mapper\n");
+        rom_file_close(&rom);
+        return 1;
+    }
+    player_set_audio_ring(&player, NULL, false);
+
+    struct video_recorder *recorder = video_recorder_start(out_path, VIDREC_Y4M, true);
+    if (!recorder)
+    {
+        player_free(&player);
+        rom_file_close(&rom);
+        return 1;
+    }
+
+    static struct chr_cache cache;
+    static struct system_frame_result view;
+    struct system *system = player_get_system(&player);
+    uint64_t decoded = 0;
+    uint64_t busiest = 0;
+
+    for (uint64_t i = 0; i < frames && !player_crash(&player); i++)
+    {
+        player_frame(&player);
+        chr_cache_update(&cache, &system->ppu);
+        chr_cache_draw(&cache, &system->ppu, palette, &view);
+        video_recorder_push(recorder, &view);
+
+        // The first frame decodes everything, count what came after
+        if (i > 0)
+        {
+            decoded += cache.decoded;
+            busiest = cache.decoded > busiest ? cache.decoded : busiest;
+        }
+    }
+
+    video_recorder_stop(recorder);
+    printf("%llu tiles decoded after the first frame, %.1f a frame, %llu at most\n",
+        (unsigned long long)decoded, frames > 1 ? (double)decoded/(frames - 1) : 0, (unsigned long long)busiest);
+
+    player_free(&player);
+    rom_file_close(&rom);
+    return 0;
+}
+
+// One line of a nestest style log, PC first and the registers after the disassembly
+static bool cli_trace_parse(const char *line, unsigned *regs, unsigned long long *cycles)
+{
+    const char *at = strstr(line, "A:");
+    const char *cyc = strstr(line, "CYC:");
+    return at && cyc &&
+        sscanf(line, "%4x", &regs[0]) == 1 &&
+        sscanf(at, "A:%x X:%x Y:%x P:%x SP:%x", &regs[1], &regs[2], &regs[3], &regs[4], &regs[5]) == 5 &&
+        sscanf(cyc, "CYC:%llu", cycles) == 1;
+}
+
+// How far ahead a block may run in trace, long enough for the loops it has
+#define CLI_TRACE_HORIZON 1000
+
+// One instruction, or with blocks as many as the block at pc takes.
+// Returns how many ran.
+static long cli_trace_step(struct system *system, bool blocks)
+{
+    if (blocks)
+    {
+        long ran = block_run(system->blocks, system, system->cpu.cycles + CLI_TRACE_HORIZON);
+        if (ran)
+        {
+            return ran;
+        }
+    }
+
+    struct instr_decoded decoded = ricoh_decode_instr(&system->decoder, &system->mem, system->cpu.pc);
+    ricoh_run_instr(&system->cpu, decoded, &system->mem);
+    return 1;
+}
+
+// Runs the CPU on its own from -p, the way nestest wants it without a PPU.
+// Prints a trace, or checks one against -r, and -t times the same stretch
+// again that many times. --blocks runs translated blocks, those can only be
+// checked where they end.
+static int cli_trace(int argc, char **argv)
+{
+    if (argc < 1)
+    {
+        cli_usage();
+        return 1;
+    }
+
+    const char *input = argv[0];
+    const char *ref_path = NULL;
+    long count = -1;
+    int pc = -1;
+    int reps = 0;
+    bool blocks = false;
+    bool jit = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--blocks") == 0) { blocks = true; continue; }
+        if (strcmp(argv[i], "--jit") == 0) { blocks = jit = true; continue; }
+
+        const char *value = i+1 < argc ? argv[i+1] : NULL;
+        if (!value)
+        {
+            cli_usage();
+            return 1;
+        }
+
+        if (strcmp(argv[i], "-n") == 0) count = atol(value);
+        else if (strcmp(argv[i], "-p") == 0) pc = (int)strtol(value, NULL, 16);
+        else if (strcmp(argv[i], "-r") == 0) ref_path = value;
+        else if (strcmp(argv[i], "-t") == 0) reps = atoi(value);
+        else
+        {
+            cli_usage();
+            return 1;
+        }
+        i++;
+    }
+
+    FILE *ref = NULL;
+    if (ref_path && !(ref = fopen(ref_path, "r")))
+    {
+        printf("Can't open %s\n", ref_path);
+        return 1;
+    }
+
+    struct rom_file rom = { 0 };
+    struct player player = rom_file_open(input, &rom) ? player_init(rom.data, rom.size, cli_mux_make()) : (struct player){ 0 };
+    if (!player.is_valid)
+    {
+        printf("Invalid ROM or unsupported mapper\n");
+        rom_file_close(&rom);
+        if (ref)
+        {
+            fclose(ref);
+        }
+        return 1;
+    }
+
+    struct system *system = player_get_system(&player);
+    player_set_blocks(&player, blocks);
+    // Every block compiled on its first run, so the log checks all of them
+    if (jit && player_set_jit(&player, true))
+    {
+        system->blocks->jit->hot = 0;
+    }
+    if (pc >= 0)
+    {
+        system->cpu.pc = (uint16_t)pc;
+    }
+    if (count < 0)
+    {
+        count = ref ? LONG_MAX : 100;
+    }
+
+    // Timing goes back to here, RAM is all the code under test touches
+    struct ricoh_state start = system->cpu;
+    static uint8_t start_ram[0x800];
+    memcpy(start_ram, system->memory, sizeof start_ram);
+
+    char line[256];
+    long ran = 0;
+    long inside = 0; // lines the last block ran through
+    int status = 0;
+
+    while (ran < count && !system->cpu.crash)
+    {
+        struct ricoh_state *cpu = &system->cpu;
+        unsigned got[6] = { cpu->pc, cpu->a, cpu->x, cpu->y, ricoh_get_flags(cpu), cpu->sp };
+
+        if (ref)
+        {
+            unsigned want[6];
+            unsigned long long cycles;
+            if (!fgets(line, sizeof line, ref))
+            {
+                break;
+            }
+            if (!cli_trace_parse(line, want, &cycles))
+            {
+                printf("Can't read line %ld of %s\n", ran + 1, ref_path);
+                status = 1;
+                break;
+            }
+            if (inside)
+            {
+                inside--;
+                ran++;
+                continue;
+            }
+            if (memcmp(got, want, sizeof got) != 0 || cpu->cycles != cycles)
+            {
+                printf("line %ld differs\n  got  %04X A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%llu\n  want %s",
+                    ran + 1, got[0], got[1], got[2], got[3], got[4], got[5], (unsigned long long)cpu->cycles, line);
+                status = 1;
+                break;
+            }
+        }
+        else
+        {
+            char text[32];
+            struct instr_decoded decoded = ricoh_decode_instr(&system->decoder, &system->mem, cpu->pc);
+            ricoh_format_decoded_instr(text, decoded);
+            printf("%04X  %-14s A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%llu\n",
+                got[0], text, got[1], got[2], got[3], got[4], got[5], (unsigned long long)cpu->cycles);
+        }
+
+        long stepped = cli_trace_step(system, blocks);
+        inside = stepped - 1;
+        ran++;
+    }
+
+    if (ref)
+    {
+        printf("%ld lines match%s\n", ran, system->cpu.crash ? ", then the CPU crashed" : "");
+        fclose(ref);
+    }
+
+    // Only what matched gets timed, the best of a few rounds. The JIT goes
+    // back to waiting for blocks to get hot like it would in a game.
+    ran += inside;
+    if (reps > 0 && ran > 0)
+    {
+        if (system->blocks && system->blocks->jit)
+        {
+            system->blocks->jit->hot = JIT_HOT_RUNS;
+        }
+        double best = 1e9;
+        long done = 0;
+        for (int round = 0; round < 5; round++)
+        {
+            clock_t began = clock();
+            done = 0;
+            for (int rep = 0; rep < reps; rep++)
+            {
+                system->cpu = start;
+                memcpy(system->memory, start_ram, sizeof start_ram);
+                for (long i = 0; i < ran; )
+                {
+                    i += cli_trace_step(system, blocks);
+                }
+                done += ran;
+            }
+            double ns = cli_seconds_since(began)*1e9/done;
+            best = ns < best ? ns : best;
+        }
+        printf("%.2f ns an instruction over %ld x %d\n", best, ran, reps);
+    }
+
+    player_free(&player);
+    rom_file_close(&rom);
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 2 && strcmp(argv[1], "bench") == 0)
+    {
+        return cli_bench();
+    }
+
+    if (argc == 3 && strcmp(argv[1], "bench") == 0 && strcmp(argv[2], "convert") == 0)
+    {
+        return cli_bench_convert();
+    }
+
+    if (argc == 3 && strcmp(argv[1], "info") == 0)
+    {
+        return cli_info(argv[2]);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "trace") == 0)
+    {
+        return cli_trace(argc-2, argv+2);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "patterns") == 0)
+    {
+        return cli_patterns(argc-2, argv+2);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "render") == 0)
+    {
+        return cli_render(argc-2, argv+2);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "replay") == 0)
+    {
+        return cli_replay(argc-2, argv+2);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "rtc") == 0)
+    {
+        return cli_rtc(argc-2, argv+2);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "batch") == 0)
+    {
+        return cli_batch(argc-2, argv+2);
+    }
+
+    if (argc == 4 && strcmp(argv[1], "convert") == 0)
+    {
+        return video_capture_to_y4m(argv[2], argv[3]) ? 0 : 1;
+    }
+
+    cli_usage();
+    return 1;
+}
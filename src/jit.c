@@ -0,0 +1,1056 @@
+// Hot ROM blocks compiled to x86-64. A, X, Y, S, what the flags come from and
+// the cycle count stay in host registers for the whole block and go back to
+// the CPU state on the way out. Reads go straight to RAM or through the PRG
+// page table, writes only to RAM. Anything else leaves in front of the
+// instruction with the cycles and pc up to there, the same spot block_run
+// would stop at, and the interpreter does it after the PPU caught up.
+//
+// RAM blocks are left to block_run, they can change under the code. So are
+// blocks with anything generic in them, those are rare and cold anyway.
+//
+// The arena only fills up. A player and its forks share it along with their
+// ROM blocks, and those are never evicted, so nothing in it goes stale. Once
+// it's full new blocks stay in block_run.
+//
+// On anything that isn't x86-64 jit_new says no and blocks run like before.
+
+#include "neske.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+// No page of the arena is writable and executable at once. It starts RW and
+// jit_compile turns pages RX as the code in them is done, see there.
+// x86-64 pages are 4K everywhere this runs.
+#define JIT_PAGE 4096
+
+#if defined(_WIN32)
+#include <windows.h>
+
+static uint8_t *_jit_arena_alloc(size_t size)
+{
+    return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+static bool _jit_arena_protect(uint8_t *arena, size_t size, bool writable)
+{
+    DWORD old;
+    if (!VirtualProtect(arena, size, writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &old))
+    {
+        return false;
+    }
+    return writable || FlushInstructionCache(GetCurrentProcess(), arena, size);
+}
+
+static void _jit_arena_free(uint8_t *arena, size_t size)
+{
+    (void)size;
+    VirtualFree(arena, 0, MEM_RELEASE);
+}
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static uint8_t *_jit_arena_alloc(size_t size)
+{
+#if defined(MAP_ANONYMOUS)
+    void *arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#else
+    // Strict ISO builds (-std=c11 on glibc) hide MAP_ANONYMOUS, a private
+    // map of /dev/zero is the plain POSIX way to the same thing
+    int fd = open("/dev/zero", O_RDWR);
+    void *arena = fd >= 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+#endif
+    return arena == MAP_FAILED ? NULL : arena;
+}
+
+static bool _jit_arena_protect(uint8_t *arena, size_t size, bool writable)
+{
+    return mprotect(arena, size, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0;
+}
+
+static void _jit_arena_free(uint8_t *arena, size_t size)
+{
+    munmap(arena, size);
+}
+#endif
+
+enum jit_reg
+{
+    JIT_RAX, JIT_RCX, JIT_RDX, JIT_RBX, JIT_RSP, JIT_RBP, JIT_RSI, JIT_RDI,
+    JIT_R8, JIT_R9, JIT_R10, JIT_R11, JIT_R12, JIT_R13, JIT_R14, JIT_R15,
+};
+
+// Where the guest lives while a block runs, all 32-bit holding a byte.
+// RAX, RCX, RDX and RDI are scratch.
+#define JIT_SYS JIT_RBX // struct system *
+#define JIT_RAM JIT_RBP // system->memory
+#define JIT_A JIT_R8
+#define JIT_X JIT_R9
+#define JIT_Y JIT_R10
+#define JIT_S JIT_R11
+#define JIT_CYCLES JIT_R12 // all 64 bits
+#define JIT_N JIT_R13
+#define JIT_Z JIT_R14
+#define JIT_C JIT_R15
+#define JIT_V JIT_RSI
+
+// Saved on the way in, the Win64 ABI wants RSI and RDI kept too
+static const uint8_t _jit_saved[] = {
+    JIT_RBX, JIT_RBP, JIT_R12, JIT_R13, JIT_R14, JIT_R15, JIT_RSI, JIT_RDI,
+};
+
+enum jit_cc
+{
+    JIT_CC_B = 0x2, JIT_CC_AE = 0x3, JIT_CC_E = 0x4, JIT_CC_NE = 0x5,
+};
+
+enum jit_alu
+{
+    JIT_ADD = 0x01, JIT_OR = 0x09, JIT_AND = 0x21, JIT_SUB = 0x29, JIT_XOR = 0x31, JIT_CMP = 0x39, JIT_TEST = 0x85,
+};
+
+// The /digit of the 0x81 immediate forms
+enum jit_alu_imm
+{
+    JIT_ADDI = 0, JIT_ANDI = 4, JIT_SUBI = 5, JIT_XORI = 6, JIT_CMPI = 7,
+};
+
+// Operand size bits for the emitters, 32-bit without either
+#define JIT_W 1 // 64-bit
+#define JIT_B8 2 // byte registers, SPL-DIL rather than AH-BH
+
+// One leave per instruction that can stop early, every jump to it gets patched
+// to a stub that settles cycles, pc and count
+#define JIT_MAX_PATCHES 3
+
+struct jit_exit
+{
+    uint8_t *patches[JIT_MAX_PATCHES];
+    int patch_count;
+    uint16_t pc;
+    uint16_t cycles; // of the ops before it, not added yet
+    uint8_t count;
+};
+
+struct jit_asm
+{
+    uint8_t *at;
+    uint8_t *end;
+    bool full;
+    const uint8_t *epilogue;
+    struct jit_exit exits[BLOCK_MAX_OPS];
+    int exit_count;
+};
+
+static void _jit_byte(struct jit_asm *a, uint8_t b)
+{
+    if (a->at < a->end)
+    {
+        *a->at++ = b;
+    }
+    else
+    {
+        a->full = true;
+    }
+}
+
+static void _jit_u32(struct jit_asm *a, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        _jit_byte(a, (uint8_t)(v >> 8*i));
+    }
+}
+
+static void _jit_rex(struct jit_asm *a, int size, int reg, int index, int base)
+{
+    uint8_t rex = 0x40 | (size & JIT_W) << 3 | (reg >> 3 & 1) << 2 | (index >> 3 & 1) << 1 | (base >> 3 & 1);
+    if (rex != 0x40 || (size & JIT_B8))
+    {
+        _jit_byte(a, rex);
+    }
+}
+
+// 0x0Fxx ones get their escape byte
+static void _jit_opcode(struct jit_asm *a, uint16_t opcode)
+{
+    if (opcode > 0xFF)
+    {
+        _jit_byte(a, opcode >> 8);
+    }
+    _jit_byte(a, opcode & 0xFF);
+}
+
+static void _jit_rr(struct jit_asm *a, int size, uint16_t opcode, int reg, int rm)
+{
+    _jit_rex(a, size, reg, 0, rm);
+    _jit_opcode(a, opcode);
+    _jit_byte(a, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// [base + index + disp], index -1 for none. Always a 32-bit displacement,
+// RSP and R12 as base need a SIB byte
+static void _jit_rm(struct jit_asm *a, int size, uint16_t opcode, int reg, int base, int index, int32_t disp)
+{
+    _jit_rex(a, size, reg, index < 0 ? 0 : index, base);
+    _jit_opcode(a, opcode);
+    if (index < 0 && (base & 7) != 4)
+    {
+        _jit_byte(a, 0x80 | (reg & 7) << 3 | (base & 7));
+    }
+    else
+    {
+        _jit_byte(a, 0x84 | (reg & 7) << 3);
+        _jit_byte(a, (index < 0 ? 4 : index & 7) << 3 | (base & 7));
+    }
+    _jit_u32(a, (uint32_t)disp);
+}
+
+static void _jit_mov(struct jit_asm *a, int dst, int src)
+{
+    _jit_rr(a, 0, 0x89, src, dst);
+}
+
+static void _jit_mov_imm(struct jit_asm *a, int dst, uint32_t imm)
+{
+    _jit_rex(a, 0, 0, 0, dst);
+    _jit_byte(a, 0xB8 + (dst & 7));
+    _jit_u32(a, imm);
+}
+
+// Truncates to the low byte
+static void _jit_byte_of(struct jit_asm *a, int dst, int src)
+{
+    _jit_rr(a, JIT_B8, 0x0FB6, dst, src);
+}
+
+static void _jit_load8(struct jit_asm *a, int dst, int base, int index, int32_t disp)
+{
+    _jit_rm(a, 0, 0x0FB6, dst, base, index, disp);
+}
+
+static void _jit_store8(struct jit_asm *a, int src, int base, int index, int32_t disp)
+{
+    _jit_rm(a, JIT_B8, 0x88, src, base, index, disp);
+}
+
+static void _jit_alu(struct jit_asm *a, enum jit_alu op, int dst, int src)
+{
+    _jit_rr(a, 0, op, src, dst);
+}
+
+static void _jit_alu_imm(struct jit_asm *a, int size, enum jit_alu_imm op, int dst, uint32_t imm)
+{
+    _jit_rex(a, size, 0, 0, dst);
+    _jit_byte(a, 0x81);
+    _jit_byte(a, 0xC0 | op << 3 | (dst & 7));
+    _jit_u32(a, imm);
+}
+
+static void _jit_test_imm(struct jit_asm *a, int reg, uint32_t imm)
+{
+    _jit_rex(a, 0, 0, 0, reg);
+    _jit_byte(a, 0xF7);
+    _jit_byte(a, 0xC0 | (reg & 7));
+    _jit_u32(a, imm);
+}
+
+static void _jit_shl(struct jit_asm *a, int reg, uint8_t n)
+{
+    _jit_rex(a, 0, 0, 0, reg);
+    _jit_byte(a, 0xC1);
+    _jit_byte(a, 0xE0 | (reg & 7));
+    _jit_byte(a, n);
+}
+
+static void _jit_shr(struct jit_asm *a, int reg, uint8_t n)
+{
+    _jit_rex(a, 0, 0, 0, reg);
+    _jit_byte(a, 0xC1);
+    _jit_byte(a, 0xE8 | (reg & 7));
+    _jit_byte(a, n);
+}
+
+static void _jit_add_cycles(struct jit_asm *a, uint32_t cycles)
+{
+    if (cycles)
+    {
+        _jit_alu_imm(a, JIT_W, JIT_ADDI, JIT_CYCLES, cycles);
+    }
+}
+
+// Forward jumps hand back their rel32 for _jit_land, NULL once out of room
+static uint8_t *_jit_jcc(struct jit_asm *a, enum jit_cc cc)
+{
+    _jit_byte(a, 0x0F);
+    _jit_byte(a, 0x80 | cc);
+    uint8_t *patch = a->at;
+    _jit_u32(a, 0);
+    return a->full ? NULL : patch;
+}
+
+static uint8_t *_jit_jmp(struct jit_asm *a)
+{
+    _jit_byte(a, 0xE9);
+    uint8_t *patch = a->at;
+    _jit_u32(a, 0);
+    return a->full ? NULL : patch;
+}
+
+static void _jit_land(struct jit_asm *a, uint8_t *patch)
+{
+    if (patch && !a->full)
+    {
+        int32_t rel = (int32_t)(a->at - (patch + 4));
+        memcpy(patch, &rel, 4);
+    }
+}
+
+static void _jit_jmp_back(struct jit_asm *a, const uint8_t *to)
+{
+    _jit_byte(a, 0xE9);
+    _jit_u32(a, (uint32_t)(int32_t)(to - (a->at + 4)));
+}
+
+static void _jit_to_exit(struct jit_asm *a, struct jit_exit *exit, enum jit_cc cc)
+{
+    uint8_t *patch = _jit_jcc(a, cc);
+    if (exit->patch_count < JIT_MAX_PATCHES)
+    {
+        exit->patches[exit->patch_count++] = patch;
+    }
+    else
+    {
+        a->full = true;
+    }
+}
+
+// Finished, at pc after count instructions
+static void _jit_leave(struct jit_asm *a, uint32_t cycles, uint16_t pc, uint8_t count)
+{
+    _jit_add_cycles(a, cycles);
+    _jit_mov_imm(a, JIT_RDX, pc);
+    _jit_mov_imm(a, JIT_RAX, count);
+    _jit_jmp_back(a, a->epilogue);
+}
+
+static void _jit_nz(struct jit_asm *a, int reg)
+{
+    _jit_mov(a, JIT_N, reg);
+    _jit_mov(a, JIT_Z, reg);
+}
+
+static bool _jit_static(const struct block_op *op)
+{
+    return op->mode == AM_ZPG || op->mode == AM_ABS;
+}
+
+// Same addresses as _block_addr into EAX, true when ECX then has the cycle
+// a page crossing costs
+static bool _jit_addr(struct jit_asm *a, const struct block_op *op)
+{
+    uint8_t zp = (uint8_t)op->operand;
+
+    switch (op->mode)
+    {
+        case AM_ZPX:
+        case AM_ZPY:
+            _jit_rm(a, 0, 0x8D, JIT_RAX, op->mode == AM_ZPX ? JIT_X : JIT_Y, -1, zp);
+            _jit_byte_of(a, JIT_RAX, JIT_RAX);
+            return false;
+        case AM_XND:
+            _jit_rm(a, 0, 0x8D, JIT_RAX, JIT_X, -1, zp);
+            _jit_byte_of(a, JIT_RAX, JIT_RAX);
+            _jit_load8(a, JIT_RDX, JIT_RAM, JIT_RAX, 0);
+            _jit_alu_imm(a, 0, JIT_ADDI, JIT_RAX, 1);
+            _jit_byte_of(a, JIT_RAX, JIT_RAX);
+            _jit_load8(a, JIT_RAX, JIT_RAM, JIT_RAX, 0);
+            _jit_shl(a, JIT_RAX, 8);
+            _jit_alu(a, JIT_OR, JIT_RAX, JIT_RDX);
+            return false;
+        case AM_ABX:
+        case AM_ABY:
+            _jit_mov_imm(a, JIT_RDX, op->operand);
+            _jit_rm(a, 0, 0x8D, JIT_RAX, op->mode == AM_ABX ? JIT_X : JIT_Y, -1, op->operand);
+            break;
+        case AM_INY:
+            _jit_load8(a, JIT_RDX, JIT_RAM, -1, zp);
+            _jit_load8(a, JIT_RAX, JIT_RAM, -1, (uint8_t)(zp + 1));
+            _jit_shl(a, JIT_RAX, 8);
+            _jit_alu(a, JIT_OR, JIT_RDX, JIT_RAX);
+            _jit_rm(a, 0, 0x8D, JIT_RAX, JIT_Y, JIT_RDX, 0);
+            break;
+        default:
+            _jit_mov_imm(a, JIT_RAX, op->operand);
+            return false;
+    }
+
+    // Base in EDX, base + index in EAX, bit 8 flips when the high byte moves
+    _jit_mov(a, JIT_RCX, JIT_RAX);
+    _jit_alu(a, JIT_XOR, JIT_RCX, JIT_RDX);
+    _jit_shr(a, JIT_RCX, 8);
+    _jit_alu_imm(a, 0, JIT_ANDI, JIT_RCX, 1);
+    _jit_rr(a, 0, 0x0FB7, JIT_RAX, JIT_RAX);
+    return true;
+}
+
+// The page of addr from the table into RDX, leaves when there is none
+static void _jit_page(struct jit_asm *a, struct jit_exit *exit, int index, int32_t disp)
+{
+    _jit_rm(a, JIT_W, 0x8B, JIT_RDX, JIT_SYS, index, (int32_t)offsetof(struct system, prg_pages) + disp);
+    _jit_rr(a, JIT_W, JIT_TEST, JIT_RDX, JIT_RDX);
+    _jit_to_exit(a, exit, JIT_CC_E);
+}
+
+// What op reads into EDX
+static void _jit_read(struct jit_asm *a, const struct block_op *op, struct jit_exit *exit)
+{
+    if (op->mode == AM_IMM)
+    {
+        _jit_mov_imm(a, JIT_RDX, (uint8_t)op->operand);
+        return;
+    }
+
+    // Translation only let plain ones through
+    if (_jit_static(op))
+    {
+        if (op->operand >= 0x8000)
+        {
+            _jit_page(a, exit, -1, 8*((op->operand >> 12) & 7));
+            _jit_load8(a, JIT_RDX, JIT_RDX, -1, op->operand & 0xFFF);
+        }
+        else
+        {
+            _jit_load8(a, JIT_RDX, JIT_RAM, -1, op->operand);
+        }
+        return;
+    }
+
+    bool extra = _jit_addr(a, op);
+
+    _jit_alu_imm(a, 0, JIT_CMPI, JIT_RAX, 0x2000);
+    uint8_t *ram = _jit_jcc(a, JIT_CC_B);
+    _jit_alu_imm(a, 0, JIT_CMPI, JIT_RAX, 0x8000);
+    uint8_t *rom = _jit_jcc(a, JIT_CC_AE);
+    _jit_alu_imm(a, 0, JIT_CMPI, JIT_RAX, 0x4020);
+    _jit_to_exit(a, exit, JIT_CC_B);
+
+    _jit_land(a, ram);
+    _jit_load8(a, JIT_RDX, JIT_RAM, JIT_RAX, 0);
+    uint8_t *done = _jit_jmp(a);
+
+    // 8 bytes a page, (addr >> 12)*8
+    _jit_land(a, rom);
+    _jit_mov(a, JIT_RDX, JIT_RAX);
+    _jit_shr(a, JIT_RDX, 9);
+    _jit_alu_imm(a, 0, JIT_ANDI, JIT_RDX, 0x38);
+    _jit_page(a, exit, JIT_RDX, 0);
+    _jit_alu_imm(a, 0, JIT_ANDI, JIT_RAX, 0xFFF);
+    _jit_load8(a, JIT_RDX, JIT_RDX, JIT_RAX, 0);
+
+    _jit_land(a, done);
+    if (extra)
+    {
+        _jit_rr(a, JIT_W, JIT_ADD, JIT_RCX, JIT_CYCLES);
+    }
+}
+
+// Address of a write into EAX, leaves unless it's RAM. Returns the
+// displacement to use with it, all of it for the static ones.
+static int32_t _jit_write_addr(struct jit_asm *a, const struct block_op *op, struct jit_exit *exit, int *index)
+{
+    if (_jit_static(op))
+    {
+        *index = -1;
+        return op->operand;
+    }
+
+    bool extra = _jit_addr(a, op);
+    _jit_alu_imm(a, 0, JIT_CMPI, JIT_RAX, 0x2000);
+    _jit_to_exit(a, exit, JIT_CC_AE);
+    if (extra)
+    {
+        _jit_rr(a, JIT_W, JIT_ADD, JIT_RCX, JIT_CYCLES);
+    }
+    *index = JIT_RAX;
+    return 0;
+}
+
+static void _jit_add(struct jit_asm *a)
+{
+    _jit_mov(a, JIT_RAX, JIT_A);
+    _jit_alu(a, JIT_ADD, JIT_RAX, JIT_RDX);
+    _jit_alu(a, JIT_ADD, JIT_RAX, JIT_C);
+    _jit_mov(a, JIT_C, JIT_RAX);
+    _jit_shr(a, JIT_C, 8);
+    _jit_byte_of(a, JIT_RAX, JIT_RAX);
+    // V is (a ^ res) & (b ^ res)
+    _jit_mov(a, JIT_V, JIT_A);
+    _jit_alu(a, JIT_XOR, JIT_V, JIT_RAX);
+    _jit_alu(a, JIT_XOR, JIT_RDX, JIT_RAX);
+    _jit_alu(a, JIT_AND, JIT_V, JIT_RDX);
+    _jit_mov(a, JIT_A, JIT_RAX);
+    _jit_nz(a, JIT_A);
+}
+
+static void _jit_compare(struct jit_asm *a, int reg)
+{
+    _jit_alu(a, JIT_CMP, reg, JIT_RDX);
+    _jit_rr(a, JIT_B8, 0x0F90 | JIT_CC_AE, 0, JIT_RAX);
+    _jit_byte_of(a, JIT_C, JIT_RAX);
+    _jit_mov(a, JIT_RAX, reg);
+    _jit_alu(a, JIT_SUB, JIT_RAX, JIT_RDX);
+    _jit_byte_of(a, JIT_RAX, JIT_RAX);
+    _jit_nz(a, JIT_RAX);
+}
+
+// ASL to DEC on reg, ECX is free
+static void _jit_modify(struct jit_asm *a, uint8_t kind, int reg)
+{
+    switch (kind)
+    {
+        case ASL:
+            _jit_mov(a, JIT_C, reg);
+            _jit_shr(a, JIT_C, 7);
+            _jit_shl(a, reg, 1);
+            break;
+        case LSR:
+            _jit_mov(a, JIT_C, reg);
+            _jit_alu_imm(a, 0, JIT_ANDI, JIT_C, 1);
+            _jit_shr(a, reg, 1);
+            break;
+        case ROL:
+            _jit_mov(a, JIT_RCX, reg);
+            _jit_shr(a, JIT_RCX, 7);
+            _jit_shl(a, reg, 1);
+            _jit_alu(a, JIT_OR, reg, JIT_C);
+            _jit_mov(a, JIT_C, JIT_RCX);
+            break;
+        case ROR:
+            _jit_mov(a, JIT_RCX, reg);
+            _jit_alu_imm(a, 0, JIT_ANDI, JIT_RCX, 1);
+            _jit_shr(a, reg, 1);
+            _jit_shl(a, JIT_C, 7);
+            _jit_alu(a, JIT_OR, reg, JIT_C);
+            _jit_mov(a, JIT_C, JIT_RCX);
+            break;
+        case INC:
+            _jit_alu_imm(a, 0, JIT_ADDI, reg, 1);
+            break;
+        default:
+            _jit_alu_imm(a, 0, JIT_SUBI, reg, 1);
+            break;
+    }
+
+    _jit_byte_of(a, reg, reg);
+    _jit_nz(a, reg);
+}
+
+static void _jit_step(struct jit_asm *a, int reg, enum jit_alu_imm op)
+{
+    _jit_alu_imm(a, 0, op, reg, 1);
+    _jit_byte_of(a, reg, reg);
+}
+
+static void _jit_push(struct jit_asm *a, int reg)
+{
+    _jit_store8(a, reg, JIT_RAM, JIT_S, 0x100);
+    _jit_step(a, JIT_S, JIT_SUBI);
+}
+
+static int _jit_reg_of(uint8_t kind)
+{
+    switch (kind)
+    {
+        case LDX: case CPX: case STX: return JIT_X;
+        case LDY: case CPY: case STY: return JIT_Y;
+        default: return JIT_A;
+    }
+}
+
+// Taken when the host Z flag is clear for the BNE likes, cc says which way
+static void _jit_branch(struct jit_asm *a, const struct block_op *op, enum jit_cc taken_cc, uint32_t cycles, uint16_t next, uint8_t count)
+{
+    uint8_t *taken = _jit_jcc(a, taken_cc);
+    _jit_leave(a, cycles, next, count);
+    _jit_land(a, taken);
+    _jit_leave(a, cycles + 1 + (((op->target ^ next) >> 8) != 0), op->target, count);
+}
+
+static bool _jit_supported(const struct block *block)
+{
+    for (int i = 0; i < block->op_count; i++)
+    {
+        const struct block_op *op = &block->ops[i];
+        switch (op->kind)
+        {
+            case BRK: case RTI: case PLP: case PHP: case CLI: case SEI: case CLD: case SED:
+                return false;
+            case JMP:
+                if (op->mode != AM_ABS)
+                {
+                    return false;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+// The body of a block, exits go out in front of the op they're for
+static void _jit_body(struct jit_asm *a, const struct block *block)
+{
+    uint16_t pc = block->pc;
+    uint32_t cycles = 0; // of what's done, added when leaving
+    uint8_t count = 0;
+
+    for (int i = 0; i < block->op_count; i++)
+    {
+        const struct block_op *op = &block->ops[i];
+        struct jit_exit *exit = &a->exits[a->exit_count++];
+        *exit = (struct jit_exit){ .pc = pc, .cycles = cycles, .count = count };
+
+        uint16_t next = pc + op->size;
+        uint8_t ran = count + (op->kind > _ICOUNT ? 2 : 1);
+        uint32_t done = cycles + op->cycles;
+        int reg = _jit_reg_of(op->kind);
+        int index;
+        int32_t disp;
+
+        switch (op->kind)
+        {
+            case LDA:
+            case LDX:
+            case LDY:
+                _jit_read(a, op, exit);
+                _jit_mov(a, reg, JIT_RDX);
+                _jit_nz(a, reg);
+                break;
+            case AND:
+            case ORA:
+            case EOR:
+                _jit_read(a, op, exit);
+                _jit_alu(a, op->kind == AND ? JIT_AND : op->kind == ORA ? JIT_OR : JIT_XOR, JIT_A, JIT_RDX);
+                _jit_nz(a, JIT_A);
+                break;
+            case ADC:
+                _jit_read(a, op, exit);
+                _jit_add(a);
+                break;
+            case SBC:
+                _jit_read(a, op, exit);
+                _jit_alu_imm(a, 0, JIT_XORI, JIT_RDX, 0xFF);
+                _jit_add(a);
+                break;
+            case CMP:
+            case CPX:
+            case CPY:
+                _jit_read(a, op, exit);
+                _jit_compare(a, reg);
+                break;
+            case BIT:
+                _jit_read(a, op, exit);
+                _jit_mov(a, JIT_N, JIT_RDX);
+                _jit_mov(a, JIT_V, JIT_RDX);
+                _jit_shl(a, JIT_V, 1);
+                _jit_byte_of(a, JIT_V, JIT_V);
+                _jit_mov(a, JIT_Z, JIT_RDX);
+                _jit_alu(a, JIT_AND, JIT_Z, JIT_A);
+                break;
+
+            case STA:
+            case STX:
+            case STY:
+                disp = _jit_write_addr(a, op, exit, &index);
+                _jit_store8(a, reg, JIT_RAM, index, disp);
+                break;
+
+            case ASL:
+            case LSR:
+            case ROL:
+            case ROR:
+            case INC:
+            case DEC:
+                if (op->mode == AM_ACC)
+                {
+                    _jit_modify(a, op->kind, JIT_A);
+                    break;
+                }
+                disp = _jit_write_addr(a, op, exit, &index);
+                _jit_load8(a, JIT_RDX, JIT_RAM, index, disp);
+                _jit_modify(a, op->kind, JIT_RDX);
+                _jit_store8(a, JIT_RDX, JIT_RAM, index, disp);
+                break;
+
+            case CLC: _jit_mov_imm(a, JIT_C, 0); break;
+            case SEC: _jit_mov_imm(a, JIT_C, 1); break;
+            case CLV: _jit_mov_imm(a, JIT_V, 0); break;
+            case NOP: break;
+            case DEX: _jit_step(a, JIT_X, JIT_SUBI); _jit_nz(a, JIT_X); break;
+            case DEY: _jit_step(a, JIT_Y, JIT_SUBI); _jit_nz(a, JIT_Y); break;
+            case INX: _jit_step(a, JIT_X, JIT_ADDI); _jit_nz(a, JIT_X); break;
+            case INY: _jit_step(a, JIT_Y, JIT_ADDI); _jit_nz(a, JIT_Y); break;
+            case TAX: _jit_mov(a, JIT_X, JIT_A); _jit_nz(a, JIT_X); break;
+            case TAY: _jit_mov(a, JIT_Y, JIT_A); _jit_nz(a, JIT_Y); break;
+            case TXA: _jit_mov(a, JIT_A, JIT_X); _jit_nz(a, JIT_A); break;
+            case TYA: _jit_mov(a, JIT_A, JIT_Y); _jit_nz(a, JIT_A); break;
+            case TSX: _jit_mov(a, JIT_X, JIT_S); _jit_nz(a, JIT_X); break;
+            case TXS: _jit_mov(a, JIT_S, JIT_X); break;
+            case PHA: _jit_push(a, JIT_A); break;
+            case PLA:
+                _jit_step(a, JIT_S, JIT_ADDI);
+                _jit_load8(a, JIT_A, JIT_RAM, JIT_S, 0x100);
+                _jit_nz(a, JIT_A);
+                break;
+
+            case BCC: _jit_test_imm(a, JIT_C, 1); _jit_branch(a, op, JIT_CC_E, done, next, ran); return;
+            case BCS: _jit_test_imm(a, JIT_C, 1); _jit_branch(a, op, JIT_CC_NE, done, next, ran); return;
+            case BEQ: _jit_test_imm(a, JIT_Z, 0xFF); _jit_branch(a, op, JIT_CC_E, done, next, ran); return;
+            case BNE: _jit_test_imm(a, JIT_Z, 0xFF); _jit_branch(a, op, JIT_CC_NE, done, next, ran); return;
+            case BMI: _jit_test_imm(a, JIT_N, 0x80); _jit_branch(a, op, JIT_CC_NE, done, next, ran); return;
+            case BPL: _jit_test_imm(a, JIT_N, 0x80); _jit_branch(a, op, JIT_CC_E, done, next, ran); return;
+            case BVC: _jit_test_imm(a, JIT_V, 0x80); _jit_branch(a, op, JIT_CC_E, done, next, ran); return;
+            case BVS: _jit_test_imm(a, JIT_V, 0x80); _jit_branch(a, op, JIT_CC_NE, done, next, ran); return;
+
+            case JMP:
+                _jit_leave(a, done, op->operand, ran);
+                return;
+            case JSR:
+                {
+                    uint16_t ret = next - 1;
+                    _jit_mov_imm(a, JIT_RCX, ret >> 8);
+                    _jit_push(a, JIT_RCX);
+                    _jit_mov_imm(a, JIT_RCX, ret & 0xFF);
+                    _jit_push(a, JIT_RCX);
+                    _jit_leave(a, done, op->operand, ran);
+                }
+                return;
+            case RTS:
+                // Same wrap as block_run, at SP 0 the low byte comes from $00FF
+                _jit_alu_imm(a, 0, JIT_ADDI, JIT_S, 2);
+                _jit_byte_of(a, JIT_S, JIT_S);
+                _jit_load8(a, JIT_RDX, JIT_RAM, JIT_S, 0x100);
+                _jit_shl(a, JIT_RDX, 8);
+                _jit_load8(a, JIT_RCX, JIT_RAM, JIT_S, 0xFF);
+                _jit_alu(a, JIT_OR, JIT_RDX, JIT_RCX);
+                _jit_alu_imm(a, 0, JIT_ADDI, JIT_RDX, 1);
+                _jit_rr(a, 0, 0x0FB7, JIT_RDX, JIT_RDX);
+                _jit_add_cycles(a, done);
+                _jit_mov_imm(a, JIT_RAX, ran);
+                _jit_jmp_back(a, a->epilogue);
+                return;
+
+            case BLOCK_LDA_STA:
+                _jit_read(a, op, exit);
+                _jit_mov(a, JIT_A, JIT_RDX);
+                _jit_nz(a, JIT_A);
+                _jit_store8(a, JIT_A, JIT_RAM, -1, op->target);
+                break;
+            case BLOCK_DEX_BNE:
+                _jit_step(a, JIT_X, JIT_SUBI);
+                _jit_nz(a, JIT_X);
+                _jit_test_imm(a, JIT_X, 0xFF);
+                _jit_branch(a, op, JIT_CC_NE, done, next, ran);
+                return;
+            case BLOCK_DEY_BNE:
+                _jit_step(a, JIT_Y, JIT_SUBI);
+                _jit_nz(a, JIT_Y);
+                _jit_test_imm(a, JIT_Y, 0xFF);
+                _jit_branch(a, op, JIT_CC_NE, done, next, ran);
+                return;
+            case BLOCK_INC_BNE:
+                _jit_load8(a, JIT_RDX, JIT_RAM, -1, op->operand);
+                _jit_modify(a, INC, JIT_RDX);
+                _jit_store8(a, JIT_RDX, JIT_RAM, -1, op->operand);
+                _jit_test_imm(a, JIT_RDX, 0xFF);
+                _jit_branch(a, op, JIT_CC_NE, done, next, ran);
+                return;
+        }
+
+        cycles = done;
+        count = ran;
+        pc = next;
+    }
+
+    // Ran off the end, the next block starts here
+    _jit_leave(a, cycles, pc, count);
+}
+
+// Shared by every block: EAX instructions ran, EDX the pc to go on from
+static void _jit_emit_epilogue(struct jit_asm *a)
+{
+    const int cpu = (int)offsetof(struct system, cpu);
+    _jit_store8(a, JIT_A, JIT_SYS, -1, cpu + offsetof(struct ricoh_state, a));
+    _jit_store8(a, JIT_X, JIT_SYS, -1, cpu + offsetof(struct ricoh_state, x));
+    _jit_store8(a, JIT_Y, JIT_SYS, -1, cpu + offsetof(struct ricoh_state, y));
+    _jit_store8(a, JIT_S, JIT_SYS, -1, cpu + offsetof(struct ricoh_state, sp));
+    _jit_store8(a, JIT_N, JIT_SYS, -1, cpu + offsetof(struct ricoh_state, n_result));
+    _jit_store8(a, JIT_Z, JIT_SYS, -1, cpu + offsetof(struct ricoh_state, z_result));
+    _jit_store8(a, JIT_C, JIT_SYS, -1, cpu + offsetof(struct ricoh_state, carry));
+    _jit_store8(a, JIT_V, JIT_SYS, -1, cpu + offsetof(struct ricoh_state, overflow));
+    _jit_rm(a, JIT_W, 0x89, JIT_CYCLES, JIT_SYS, -1, cpu + offsetof(struct ricoh_state, cycles));
+    _jit_byte(a, 0x66);
+    _jit_rm(a, 0, 0x89, JIT_RDX, JIT_SYS, -1, cpu + offsetof(struct ricoh_state, pc));
+
+    for (int i = sizeof _jit_saved - 1; i >= 0; i--)
+    {
+        _jit_rex(a, 0, 0, 0, _jit_saved[i]);
+        _jit_byte(a, 0x58 + (_jit_saved[i] & 7));
+    }
+    _jit_byte(a, 0xC3);
+}
+
+static void _jit_emit_prologue(struct jit_asm *a)
+{
+    const int cpu = (int)offsetof(struct system, cpu);
+
+    for (int i = 0; i < (int)sizeof _jit_saved; i++)
+    {
+        _jit_rex(a, 0, 0, 0, _jit_saved[i]);
+        _jit_byte(a, 0x50 + (_jit_saved[i] & 7));
+    }
+
+    // mov rbx, <first argument>
+#if defined(_WIN32)
+    _jit_rr(a, JIT_W, 0x89, JIT_RCX, JIT_SYS);
+#else
+    _jit_rr(a, JIT_W, 0x89, JIT_RDI, JIT_SYS);
+#endif
+    _jit_rm(a, JIT_W, 0x8D, JIT_RAM, JIT_SYS, -1, (int32_t)offsetof(struct system, memory));
+
+    _jit_load8(a, JIT_A, JIT_SYS, -1, cpu + offsetof(struct ricoh_state, a));
+    _jit_load8(a, JIT_X, JIT_SYS, -1, cpu + offsetof(struct ricoh_state, x));
+    _jit_load8(a, JIT_Y, JIT_SYS, -1, cpu + offsetof(struct ricoh_state, y));
+    _jit_load8(a, JIT_S, JIT_SYS, -1, cpu + offsetof(struct ricoh_state, sp));
+    _jit_load8(a, JIT_N, JIT_SYS, -1, cpu + offsetof(struct ricoh_state, n_result));
+    _jit_load8(a, JIT_Z, JIT_SYS, -1, cpu + offsetof(struct ricoh_state, z_result));
+    _jit_load8(a, JIT_C, JIT_SYS, -1, cpu + offsetof(struct ricoh_state, carry));
+    _jit_load8(a, JIT_V, JIT_SYS, -1, cpu + offsetof(struct ricoh_state, overflow));
+    _jit_rm(a, JIT_W, 0x8B, JIT_CYCLES, JIT_SYS, -1, cpu + offsetof(struct ricoh_state, cycles));
+}
+
+static struct jit_asm _jit_asm_at(struct jit *jit)
+{
+    return (struct jit_asm){
+        .at = jit->arena + jit->used,
+        .end = jit->arena + JIT_ARENA_SIZE,
+        .epilogue = jit->arena,
+    };
+}
+
+static size_t _jit_page_down(size_t at)
+{
+    return at & ~(size_t)(JIT_PAGE - 1);
+}
+
+static size_t _jit_page_up(size_t at)
+{
+    return _jit_page_down(at + JIT_PAGE - 1);
+}
+
+// Makes everything up to end executable and hands out the pending blocks that
+// are all below it. The pages stay RX for good.
+static void _jit_seal(struct jit *jit, size_t end)
+{
+    if (end > jit->sealed && !_jit_arena_protect(jit->arena + jit->sealed, end - jit->sealed, false))
+    {
+        // Nothing runs from RW pages, they just never get used
+        printf("Can't make the JIT's code executable\n");
+        for (uint32_t i = 0; i < jit->pending_count; i++)
+        {
+            jit->pending[i].block->jit_pending = false;
+            jit->pending[i].block->jit_refused = true;
+            jit->refused++;
+        }
+        jit->pending_count = 0;
+        return;
+    }
+
+    jit->sealed = end > jit->sealed ? end : jit->sealed;
+
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < jit->pending_count; i++)
+    {
+        struct jit_pending pending = jit->pending[i];
+        if (pending.end <= jit->sealed)
+        {
+            pending.block->native = (int (*)(struct system *))(void *)(jit->arena + pending.entry);
+            pending.block->jit_pending = false;
+            jit->compiled++;
+        }
+        else
+        {
+            jit->pending[kept++] = pending;
+        }
+    }
+    jit->pending_count = kept;
+    jit->asks = kept ? jit->asks : 0;
+}
+
+struct jit *jit_new(uint32_t hot)
+{
+    uint8_t *arena = _jit_arena_alloc(JIT_ARENA_SIZE);
+    if (!arena)
+    {
+        printf("Can't get memory for the JIT\n");
+        return NULL;
+    }
+
+    struct jit *jit = calloc(1, sizeof(struct jit));
+    jit->arena = arena;
+    jit->hot = hot;
+
+    struct jit_asm a = _jit_asm_at(jit);
+    _jit_emit_epilogue(&a);
+    jit->used = a.at - arena;
+
+    if (!_jit_arena_protect(arena, _jit_page_up(jit->used), false))
+    {
+        printf("Can't make the JIT's code executable\n");
+        jit_free(jit);
+        return NULL;
+    }
+    jit->sealed = _jit_page_up(jit->used);
+    return jit;
+}
+
+void jit_free(struct jit *jit)
+{
+    if (jit)
+    {
+        _jit_arena_free(jit->arena, JIT_ARENA_SIZE);
+        free(jit);
+    }
+}
+
+// At used, which has to be in RW pages. False when the arena is full.
+static bool _jit_emit_block(struct jit *jit, struct block *block)
+{
+    struct jit_asm a = _jit_asm_at(jit);
+    uint8_t *entry = a.at;
+
+    _jit_emit_prologue(&a);
+    _jit_body(&a, block);
+
+    for (int i = 0; i < a.exit_count; i++)
+    {
+        struct jit_exit *exit = &a.exits[i];
+        if (!exit->patch_count)
+        {
+            continue;
+        }
+        for (int p = 0; p < exit->patch_count; p++)
+        {
+            _jit_land(&a, exit->patches[p]);
+        }
+        _jit_leave(&a, exit->cycles, exit->pc, exit->count);
+    }
+
+    if (a.full)
+    {
+        return false;
+    }
+
+    jit->pending[jit->pending_count++] = (struct jit_pending){ block, entry - jit->arena, a.at - jit->arena };
+    jit->used = a.at - jit->arena;
+    block->jit_pending = true;
+    return true;
+}
+
+// Other players may be running code in any executable page, so a new block
+// goes after the last one and waits until its pages can be made executable
+// as a whole. A player alone on the arena can't be running anything while
+// it's in here, it opens the last page again and gets its block right away.
+static bool _jit_write(struct jit *jit, struct block *block, bool alone)
+{
+    if (jit->pending_count == JIT_MAX_PENDING)
+    {
+        _jit_seal(jit, _jit_page_up(jit->used));
+    }
+
+    if (jit->used < jit->sealed)
+    {
+        size_t reopen = _jit_page_down(jit->used);
+        if (alone && _jit_arena_protect(jit->arena + reopen, jit->sealed - reopen, true))
+        {
+            jit->sealed = reopen;
+        }
+        else
+        {
+            jit->used = jit->sealed;
+        }
+    }
+
+    if (!_jit_emit_block(jit, block))
+    {
+        return false;
+    }
+
+    _jit_seal(jit, alone ? _jit_page_up(jit->used) : _jit_page_down(jit->used));
+    return true;
+}
+
+// block_run asks on every run of a hot block until it's native or refused.
+// Forks share the JIT and may ask from any thread, the lock covers the arena
+// and the blocks' JIT fields. A block's native pointer is set after its page
+// went executable, a player that still sees NULL just runs it in block_run
+// once more.
+bool jit_compile(struct jit *jit, struct block *block, bool alone)
+{
+    atomic32_lock(&jit->lock);
+
+    if (block->native || block->jit_refused)
+    {
+        // Another player got there first
+    }
+    else if (block->jit_pending)
+    {
+        if (alone || ++jit->asks >= JIT_SEAL_ASKS)
+        {
+            _jit_seal(jit, _jit_page_up(jit->used));
+        }
+    }
+    else if (block->in_ram || !_jit_supported(block) || !_jit_write(jit, block, alone))
+    {
+        block->jit_refused = true;
+        jit->refused++;
+    }
+
+    bool native = block->native != NULL;
+    atomic32_unlock(&jit->lock);
+    return native;
+}
+
+#else
+
+struct jit *jit_new(uint32_t hot)
+{
+    (void)hot;
+    printf("The JIT only runs on x86-64\n");
+    return NULL;
+}
+
+void jit_free(struct jit *jit)
+{
+    (void)jit;
+}
+
+bool jit_compile(struct jit *jit, struct block *block, bool alone)
+{
+    (void)jit;
+    (void)alone;
+    block->jit_refused = true;
+    return false;
+}
+
+#endif
@@ -1,13 +1,2 @@
-#include "ricoh.c"
-#include "apu.c"
-#include "ppu.c"
-#include "imap.c"
-#include "neske.c"
-#include "player.c"
-#include "system.c"
-#include "mapper/nrom.c"
-#include "mapper/mmc1.c"
-#include "mapper/unrom.c"
-#include "mapper/m228.c"
-#include "mapper/cnrom.c"
-#include "mapper/axrom.c"
\ No newline at end of file
+#include "jumbo_core.c"
+#include "neske.c"
\ No newline at end of file
@@ -0,0 +1,2 @@
+#include "jumbo_core.c"
+#include "cli.c"
\ No newline at end of file
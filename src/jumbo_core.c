@@ -0,0 +1,31 @@
+// Everything but a frontend, jumbo.c and jumbo_cli.c add theirs on top
+#include "ricoh.c"
+#include "ring.c"
+#include "thread.c"
+#include "apu.c"
+#include "ppu.c"
+#include "video.c"
+#include "pacer.c"
+#include "wavrec.c"
+#include "vidrec.c"
+#include "chrcache.c"
+#include "imap.c"
+#include "romfile.c"
+#include "romdb.c"
+#include "player.c"
+#include "savefile.c"
+#include "movie.c"
+#include "batch.c"
+#include "rtc.c"
+#include "system.c"
+#include "block.c"
+#include "jit.c"
+#include "mapper/cart.c"
+#include "mapper/nrom.c"
+#include "mapper/mmc1.c"
+#include "mapper/unrom.c"
+#include "mapper/m228.c"
+#include "mapper/cnrom.c"
+#include "mapper/axrom.c"
+#include "mapper/mmc3.c"
+#include "mapper/nsf.c"
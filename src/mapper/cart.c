@@ -0,0 +1,231 @@
+// Everything cartridges have in common. A board only describes its registers
+// and how they pick banks, this file owns the system and the bus.
+
+#include "../neske.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+
+struct mapper_vtbl cart_vtbl = {
+    .new                = cart_new,
+    .free               = cart_free,
+    .frame              = cart_frame,
+    .reset              = cart_reset,
+    .crash              = cart_crash,
+    .set_controller     = cart_set_controller,
+    .get_system         = cart_get_system,
+    .state_size         = sizeof(struct cart),
+    .load_state         = cart_load_state,
+};
+
+static const struct cart_board *_cart_boards[] = {
+    &nrom_board,
+    &mmc1_board,
+    &unrom_board,
+    &cnrom_board,
+    &axrom_board,
+    &m228_board,
+    &mmc3_board,
+};
+
+const struct cart_board *cart_find_board(uint16_t mapper_number)
+{
+    for (size_t i = 0; i < sizeof _cart_boards / sizeof *_cart_boards; i++)
+    {
+        if (_cart_boards[i]->mapper_number == mapper_number)
+        {
+            return _cart_boards[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Where a bank of size bytes starts, negative banks count from the end. Bank
+// numbers past the end wrap around, the way small ROMs show up more than once.
+static size_t _cart_bank_offset(size_t rom_size, size_t size, int bank)
+{
+    size_t banks = rom_size >= size ? rom_size/size : 1;
+    size_t index = bank < 0 ? (banks - (size_t)-bank % banks) % banks : (size_t)bank % banks;
+    return index*size;
+}
+
+// Points the size bytes at addr to a PRG bank. Only register writes land here,
+// so reads never work out a bank.
+void cart_map_prg(struct cart *cart, uint16_t addr, size_t size, int bank)
+{
+    size_t offset = _cart_bank_offset(cart->rom.prg_size, size, bank);
+    bool fits = offset + size <= cart->rom.prg_size;
+    int first = (addr - 0x8000) / CART_PRG_SLOT_LEN;
+
+    for (size_t i = 0; i < size / CART_PRG_SLOT_LEN; i++)
+    {
+        size_t at = offset + i*CART_PRG_SLOT_LEN;
+        cart->system.prg_pages[first + i] = cart->rom.prg + (fits ? at : at % cart->rom.prg_size);
+    }
+}
+
+// Same for CHR-ROM, boards with CHR-RAM just leave the PPU's slots empty
+void cart_map_chr(struct cart *cart, uint16_t addr, size_t size, int bank)
+{
+    if (!cart->rom.chr_size)
+    {
+        return;
+    }
+
+    size_t offset = _cart_bank_offset(cart->rom.chr_size, size, bank);
+    bool fits = offset + size <= cart->rom.chr_size;
+
+    for (size_t i = 0; i < size / CART_CHR_SLOT_LEN; i++)
+    {
+        size_t at = offset + i*CART_CHR_SLOT_LEN;
+        cart->system.ppu.pins.chr_rom[addr/CART_CHR_SLOT_LEN + i] = cart->rom.chr + (fits ? at : at % cart->rom.chr_size);
+    }
+}
+
+static uint8_t _cart_mem_read(void *mapper_data, uint16_t addr)
+{
+    struct cart *cart = (struct cart *)mapper_data;
+
+    // Opcode fetches land here, one index and one load whatever the board
+    if (addr >= 0x8000)
+    {
+        return cart->system.prg_pages[(addr >> 12) & 7][addr & 0xFFF];
+    }
+
+    return system_mem_read(&cart->system, addr);
+}
+
+static void _cart_mem_write(void *mapper_data, uint16_t addr, uint8_t val)
+{
+    struct cart *cart = (struct cart *)mapper_data;
+
+    if (addr >= cart->board->write_start)
+    {
+        cart->board->write(cart, addr, val);
+        return;
+    }
+
+    system_mem_write(&cart->system, addr, val);
+
+    // PPUCTRL or PPUMASK, or one of their mirrors
+    if (cart->board->ppu_changed && addr >= 0x2000 && addr < 0x4000 && (addr & 6) == 0)
+    {
+        cart->board->ppu_changed(cart);
+    }
+}
+
+static void _cart_event(void *mapper_data)
+{
+    struct cart *cart = (struct cart *)mapper_data;
+    cart->board->event(cart);
+}
+
+void* cart_new(struct mapper_data data, struct mux_api apu_mux)
+{
+    const struct cart_board *board = cart_find_board(data.mapper_number);
+    if (!board)
+    {
+        return NULL;
+    }
+
+    // The tables work in 4K and 1K slots, NES 2.0 allows odd sizes nothing uses
+    if (data.prg_size % CART_PRG_SLOT_LEN || data.chr_size % CART_CHR_SLOT_LEN)
+    {
+        printf("ROM sizes don't fill whole banks\n");
+        return NULL;
+    }
+
+    struct cart *cart = calloc(1, sizeof(struct cart));
+    assert(cart != NULL);
+
+    cart->board = board;
+    cart->rom = mapper_rom_view(&data);
+
+    if (!board->init(cart, &data))
+    {
+        printf("ROM doesn't fit %s\n", board->name);
+        free(cart);
+        return NULL;
+    }
+
+    // Banks go in before system_init, its reset reads the vector through them.
+    // Again after, the PPU starts over and the new system has no PRG pages.
+    board->sync(cart);
+    cart->system = system_init(apu_mux, (struct ricoh_mem_interface){
+        .instance = cart,
+        .get = _cart_mem_read,
+        .set = _cart_mem_write,
+    });
+    cart->system.cart_event = board->event ? _cart_event : NULL;
+    cart->system.ppu.pins.mirroring_mode = data.mirroring;
+
+    // CHR-RAM the size the header gives, the sizes are powers of two so smaller
+    // ones mirror. Under one slot nobody makes, those get the whole 8K.
+    size_t chr_ram = data.chr_nvram_size ? data.chr_nvram_size : data.chr_ram_size;
+    if (chr_ram >= CART_CHR_SLOT_LEN && chr_ram < PPU_CHR_RAM_LEN)
+    {
+        cart->system.ppu.pins.chr_ram_mask = chr_ram - 1;
+    }
+    board->sync(cart);
+
+    return cart;
+}
+
+void cart_free(void *mapper_data)
+{
+    struct cart *cart = (struct cart *)mapper_data;
+    free(cart);
+}
+
+struct system_frame_result cart_frame(void *mapper_data)
+{
+    struct cart *cart = (struct cart *)mapper_data;
+    return system_frame(&cart->system);
+}
+
+void cart_reset(void *mapper_data)
+{
+    struct cart *cart = (struct cart *)mapper_data;
+    if (cart->board->reset)
+    {
+        cart->board->reset(cart);
+        cart->board->sync(cart);
+    }
+    system_reset(&cart->system);
+
+    // The reset dropped whatever the board had scheduled
+    if (cart->board->ppu_changed)
+    {
+        cart->board->ppu_changed(cart);
+    }
+}
+
+bool cart_crash(void *mapper_data)
+{
+    struct cart *cart = (struct cart *)mapper_data;
+    return cart->system.cpu.crash;
+}
+
+void cart_set_controller(void *mapper_data, struct controller_state controller)
+{
+    struct cart *cart = (struct cart *)mapper_data;
+    system_update_controller(&cart->system, controller);
+}
+
+struct system *cart_get_system(void *mapper_data)
+{
+    struct cart *cart = (struct cart *)mapper_data;
+    return &cart->system;
+}
+
+// The tables in a state point into whatever run saved it, sync rebuilds them
+void cart_load_state(void *mapper_data, const void *state)
+{
+    struct cart *cart = (struct cart *)mapper_data;
+    const struct cart *saved = state;
+    cart->regs = saved->regs;
+    system_load_state(&cart->system, &saved->system);
+    cart->board->sync(cart);
+}
@@ -0,0 +1,226 @@
+// MMC3, TxROM boards. The scanline counter watches PPU A12 on the real thing,
+// here the rising edges are worked out from PPUCTRL and PPUMASK and scheduled
+// as system events, so the PPU doesn't have to report anything per dot.
+
+#include "../neske.h"
+
+// Dots per scanline and per frame, line 261 only lasts one dot before the
+// PPU wraps to the pre-render line (see ppu_cycle)
+#define MMC3_LINE_DOTS 341
+#define MMC3_FRAME_DOTS (262*MMC3_LINE_DOTS + 1)
+
+// Where A12 rises on lines that count. Sprites fetched from $1000 raise it
+// at dot 260, background from $1000 with sprites at $0000 when the next
+// line's first tiles are fetched at dot 324.
+#define MMC3_A12_SPRITES 260
+#define MMC3_A12_BACKGROUND 324
+
+static bool _mmc3_init(struct cart *cart, struct mapper_data *data)
+{
+    struct mmc3 *regs = &cart->regs.mmc3;
+
+    regs->four_screen = data->mirroring == PPUMIR_FOUR;
+    regs->prg_ram = 0x80;
+    regs->irq_clock_at = UINT64_MAX;
+
+    return cart->rom.prg_size >= 0x4000;
+}
+
+static void _mmc3_sync(struct cart *cart)
+{
+    struct mmc3 *regs = &cart->regs.mmc3;
+
+    // PRG mode swaps $8000 and $C000, R7 and the last bank stay put
+    bool prg_swap = regs->bank_select & 0x40;
+    cart_map_prg(cart, prg_swap ? 0xC000 : 0x8000, 0x2000, regs->banks[6] & 0x3F);
+    cart_map_prg(cart, 0xA000, 0x2000, regs->banks[7] & 0x3F);
+    cart_map_prg(cart, prg_swap ? 0x8000 : 0xC000, 0x2000, -2);
+    cart_map_prg(cart, 0xE000, 0x2000, -1);
+
+    // CHR inversion swaps the 2K and 1K halves
+    uint16_t big = (regs->bank_select & 0x80) ? 0x1000 : 0x0000;
+    uint16_t small = big ^ 0x1000;
+    cart_map_chr(cart, big, 0x800, regs->banks[0] >> 1);
+    cart_map_chr(cart, big + 0x800, 0x800, regs->banks[1] >> 1);
+    for (int i = 0; i < 4; i++)
+    {
+        cart_map_chr(cart, small + i*0x400, 0x400, regs->banks[2 + i]);
+    }
+
+    if (!regs->four_screen)
+    {
+        cart->system.ppu.pins.mirroring_mode = (regs->mirroring & 1) ? PPUMIR_HOR : PPUMIR_VER;
+    }
+}
+
+// The PPU cycle of the first counted A12 rise processed at cycle from or later
+static uint64_t _mmc3_next_clock(struct cart *cart, uint64_t from)
+{
+    struct ppu *ppu = &cart->system.ppu;
+    uint8_t mask = ppu->regs[PPUIR_MASK];
+    uint8_t ctrl = ppu->regs[PPUIR_CTRL];
+
+    // Nothing gets fetched with rendering off
+    if (!(mask & 0x18))
+    {
+        return UINT64_MAX;
+    }
+
+    // 8x16 sprites pick their table per tile, games put them at $1000
+    bool bg_high = ctrl & 0x10;
+    bool sprites_high = (ctrl & 0x08) || (ctrl & 0x20);
+    int dot;
+    if (sprites_high)
+    {
+        dot = MMC3_A12_SPRITES;
+    }
+    else if (bg_high)
+    {
+        dot = MMC3_A12_BACKGROUND;
+    }
+    else
+    {
+        return UINT64_MAX;
+    }
+
+    // Frame position of the dot the PPU processes next, 0 is the start of the pre-render line
+    int line = ppu->scanline;
+    int beam = ppu->beam;
+    if (beam >= MMC3_LINE_DOTS)
+    {
+        line++;
+        beam = 0;
+    }
+    int64_t next = (int64_t)(line + 1)*MMC3_LINE_DOTS + beam;
+
+    int64_t pos = (next + (int64_t)(from - (ppu->cycles + 1))) % MMC3_FRAME_DOTS;
+    if (pos < 0)
+    {
+        pos += MMC3_FRAME_DOTS;
+    }
+
+    // The pre-render line and the 240 visible ones count
+    int64_t row = pos / MMC3_LINE_DOTS;
+    int64_t at = row*MMC3_LINE_DOTS + dot;
+    if (at < pos)
+    {
+        row++;
+        at += MMC3_LINE_DOTS;
+    }
+    if (row > 240)
+    {
+        at = MMC3_FRAME_DOTS + dot;
+    }
+
+    return from + (at - pos);
+}
+
+static void _mmc3_schedule(struct cart *cart, uint64_t from)
+{
+    struct mmc3 *regs = &cart->regs.mmc3;
+
+    regs->irq_clock_at = _mmc3_next_clock(cart, from);
+
+    // CPU cycles are three dots, the event fires on the first one at or after the rise
+    uint64_t at = regs->irq_clock_at == UINT64_MAX ? UINT64_MAX : (regs->irq_clock_at + 2)/3;
+    system_schedule(&cart->system, SYSTEM_EVENT_CART, at);
+}
+
+static void _mmc3_event(struct cart *cart)
+{
+    struct mmc3 *regs = &cart->regs.mmc3;
+
+    if (regs->irq_counter == 0 || regs->irq_reload)
+    {
+        regs->irq_counter = regs->irq_latch;
+        regs->irq_reload = false;
+    }
+    else
+    {
+        regs->irq_counter--;
+    }
+
+    if (regs->irq_counter == 0 && regs->irq_enabled)
+    {
+        cart->system.irq |= SYSTEM_IRQ_CART;
+    }
+
+    _mmc3_schedule(cart, regs->irq_clock_at + 1);
+}
+
+static void _mmc3_ppu_changed(struct cart *cart)
+{
+    _mmc3_schedule(cart, cart->system.ppu.cycles + 1);
+}
+
+static void _mmc3_write(struct cart *cart, uint16_t addr, uint8_t val)
+{
+    struct mmc3 *regs = &cart->regs.mmc3;
+
+    // PRG-RAM, reads are always let through since plenty of games never enable it
+    if (addr < 0x8000)
+    {
+        if ((regs->prg_ram & 0xC0) == 0x80)
+        {
+            cart->system.memory[addr] = val;
+        }
+        return;
+    }
+
+    bool odd = addr & 1;
+
+    switch (addr & 0xE000)
+    {
+        case 0x8000:
+            if (odd)
+            {
+                regs->banks[regs->bank_select & 7] = val;
+            }
+            else
+            {
+                regs->bank_select = val;
+            }
+            _mmc3_sync(cart);
+            break;
+        case 0xA000:
+            if (odd)
+            {
+                regs->prg_ram = val;
+            }
+            else
+            {
+                regs->mirroring = val;
+                _mmc3_sync(cart);
+            }
+            break;
+        case 0xC000:
+            if (odd)
+            {
+                regs->irq_counter = 0;
+                regs->irq_reload = true;
+            }
+            else
+            {
+                regs->irq_latch = val;
+            }
+            break;
+        case 0xE000:
+            regs->irq_enabled = odd;
+            if (!odd)
+            {
+                cart->system.irq &= ~SYSTEM_IRQ_CART;
+            }
+            break;
+    }
+}
+
+const struct cart_board mmc3_board = {
+    .mapper_number  = 4,
+    .name           = "MMC3",
+    .write_start    = 0x6000,
+    .init           = _mmc3_init,
+    .write          = _mmc3_write,
+    .sync           = _mmc3_sync,
+    .event          = _mmc3_event,
+    .ppu_changed    = _mmc3_ppu_changed,
+};
@@ -0,0 +1,227 @@
+// NES Sound Format, a music rip with the driver's INIT and PLAY routines.
+// Nothing draws, so only the CPU and APU run.
+
+#include "../neske.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+
+struct mapper_vtbl nsf_vtbl = {
+    .new                = nsf_new,
+    .free               = nsf_free,
+    .frame              = nsf_frame,
+    .reset              = nsf_reset,
+    .crash              = nsf_crash,
+    .set_controller     = nsf_set_controller,
+    .get_system         = nsf_get_system,
+    .track_count        = nsf_track_count,
+    .select_track       = nsf_select_track,
+};
+
+// NTSC frame length in CPU cycles, same as what system_frame runs
+#define NSF_FRAME_CYCLES 29780.5
+
+static uint16_t _nsf_u16(uint8_t *at)
+{
+    return at[0] | (at[1] << 8);
+}
+
+bool nsf_check(uint8_t *data, size_t size)
+{
+    return size > NSF_HEADER_LEN && memcmp(data, "NESM\x1A", 5) == 0;
+}
+
+static uint8_t _nsf_mem_read(void *mapper_data, uint16_t addr)
+{
+    struct nsf *mapper = (struct nsf *)mapper_data;
+
+    if (addr >= 0x8000)
+    {
+        uint32_t bank = mapper->banks[(addr - 0x8000) / NSF_BANK_LEN];
+
+        if (bank >= mapper->bank_count)
+        {
+            return 0;
+        }
+
+        return mapper->rom[bank*NSF_BANK_LEN + (addr % NSF_BANK_LEN)];
+    }
+
+    return system_mem_read(&mapper->system, addr);
+}
+
+static void _nsf_mem_write(void *mapper_data, uint16_t addr, uint8_t val)
+{
+    struct nsf *mapper = (struct nsf *)mapper_data;
+
+    if (addr >= 0x5FF8 && addr <= 0x5FFF)
+    {
+        mapper->banks[addr - 0x5FF8] = val;
+    }
+    else if (addr < 0x8000)
+    {
+        system_mem_write(&mapper->system, addr, val);
+    }
+}
+
+void* nsf_new(struct mapper_data data, struct mux_api apu_mux)
+{
+    uint8_t *header = data.ines;
+
+    uint16_t load_addr = _nsf_u16(header + 0x08);
+
+    if (load_addr < 0x8000)
+    {
+        printf("NSF loads at $%04X, only $8000 and up is supported\n", load_addr);
+        return NULL;
+    }
+
+    struct nsf *mapper = calloc(1, sizeof(struct nsf));
+    assert(mapper != NULL);
+
+    mapper->track_count = header[0x06];
+    mapper->start_track = header[0x07] ? header[0x07]-1 : 0;
+    mapper->load_addr = load_addr;
+    mapper->init_addr = _nsf_u16(header + 0x0A);
+    mapper->play_addr = _nsf_u16(header + 0x0C);
+    memcpy(mapper->title, header + 0x0E, 32);
+    memcpy(mapper->artist, header + 0x2E, 32);
+    memcpy(mapper->copyright, header + 0x4E, 32);
+    memcpy(mapper->bank_init, header + 0x70, 8);
+
+    // Speed is in microseconds, 0 shows up in sloppy rips and means 60Hz
+    uint16_t speed = _nsf_u16(header + 0x6E);
+    mapper->play_period = (speed ? speed : 16639) * (APU_CPU_RATE/1000000.0);
+
+    bool is_banked = false;
+    for (int i = 0; i < 8; i++)
+    {
+        is_banked |= mapper->bank_init[i] != 0;
+    }
+
+    size_t data_len = data.size - NSF_HEADER_LEN;
+
+    // Lay the data out in 4K banks either way, unbanked files just get banks 0-7 in order
+    size_t pad = is_banked ? (load_addr % NSF_BANK_LEN) : (load_addr - 0x8000);
+
+    if (!is_banked && pad + data_len > 0x8000)
+    {
+        data_len = 0x8000 - pad;
+    }
+
+    mapper->bank_count = (pad + data_len + NSF_BANK_LEN-1) / NSF_BANK_LEN;
+    mapper->rom = calloc(mapper->bank_count, NSF_BANK_LEN);
+    assert(mapper->rom != NULL);
+    memcpy(mapper->rom + pad, header + NSF_HEADER_LEN, data_len);
+
+    if (!is_banked)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            mapper->bank_init[i] = i;
+        }
+    }
+
+    memcpy(mapper->banks, mapper->bank_init, 8);
+
+    printf("NSF: %s - %s, %d tracks\n", mapper->title, mapper->artist, mapper->track_count);
+
+    mapper->system = system_init(apu_mux, (struct ricoh_mem_interface){
+        .instance = mapper,
+        .get = _nsf_mem_read,
+        .set = _nsf_mem_write,
+    });
+
+    nsf_select_track(mapper, mapper->start_track);
+
+    return mapper;
+}
+
+void nsf_free(void *mapper_data)
+{
+    struct nsf *mapper = (struct nsf *)mapper_data;
+    free(mapper->rom);
+    free(mapper);
+}
+
+struct system_frame_result nsf_frame(void *mapper_data)
+{
+    struct nsf *mapper = (struct nsf *)mapper_data;
+    struct system *system = &mapper->system;
+
+    mapper->frame_end += NSF_FRAME_CYCLES;
+
+    // The play timer is independent of frames, there can be zero or several calls per frame
+    while (mapper->next_play < mapper->frame_end && !system->cpu.crash)
+    {
+        system_idle(system, (uint64_t)mapper->next_play);
+        system_call(system, mapper->play_addr, (uint64_t)mapper->play_period);
+        mapper->next_play += mapper->play_period;
+    }
+
+    system_idle(system, (uint64_t)mapper->frame_end);
+    system_flush_audio(system);
+
+    return (struct system_frame_result){ 0 };
+}
+
+void nsf_reset(void *mapper_data)
+{
+    struct nsf *mapper = (struct nsf *)mapper_data;
+    nsf_select_track(mapper, mapper->track);
+}
+
+bool nsf_crash(void *mapper_data)
+{
+    struct nsf *mapper = (struct nsf *)mapper_data;
+    return mapper->system.cpu.crash;
+}
+
+void nsf_set_controller(void *mapper_data, struct controller_state controller)
+{
+}
+
+struct system *nsf_get_system(void *mapper_data)
+{
+    struct nsf *mapper = (struct nsf *)mapper_data;
+    return &mapper->system;
+}
+
+int nsf_track_count(void *mapper_data)
+{
+    struct nsf *mapper = (struct nsf *)mapper_data;
+    return mapper->track_count;
+}
+
+void nsf_select_track(void *mapper_data, int track)
+{
+    struct nsf *mapper = (struct nsf *)mapper_data;
+    struct system *system = &mapper->system;
+
+    mapper->track = track;
+    memcpy(mapper->banks, mapper->bank_init, 8);
+    system_reset(system);
+
+    memset(system->memory, 0, 0x800);
+    memset(system->memory + 0x6000, 0, 0x2000);
+
+    for (uint16_t addr = 0x4000; addr <= 0x4013; addr++)
+    {
+        system_mem_write(system, addr, 0);
+    }
+    system_mem_write(system, 0x4015, 0x00);
+    system_mem_write(system, 0x4015, 0x0F);
+    system_mem_write(system, 0x4017, 0x40);
+
+    system->cpu.a = track;
+    system->cpu.x = 0; // NTSC
+
+    if (!system_call(system, mapper->init_addr, NSF_INIT_MAX_CYCLES))
+    {
+        printf("NSF: INIT for track %d didn't return\n", track+1);
+    }
+
+    mapper->next_play = system->cpu.cycles;
+    mapper->frame_end = system->cpu.cycles;
+}
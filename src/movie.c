@@ -0,0 +1,553 @@
+// Input movies. A movie is the controller state and reset flag for every frame,
+// played back from power on it reproduces the run exactly. Savestates are kept
+// every keyframe_interval frames so a seek only re-emulates from the nearest one.
+//
+// .nmv files:
+//   "NMV1" u32 frame_count u32 keyframe_interval u32 state_size u32 keyframe_count
+//   frame_count * (u8 buttons, u8 flags)
+//   keyframe_count * (u32 keyframe number, u32 packed length, packed state)
+// A packed state is XORed with the keyframe stored before it and then written as
+// runs of u16 zero count, u16 literal count, literals. Keyframes from a build with a
+// different state size are dropped on load and rebuilt while playing.
+
+#include "neske.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MOVIE_RUN_MAX 0xFFFF
+
+static uint8_t _movie_pack_buttons(struct controller_state controller)
+{
+    uint8_t buttons = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        buttons |= (controller.btns[i] != 0) << i;
+    }
+    return buttons;
+}
+
+static struct controller_state _movie_unpack_buttons(uint8_t buttons)
+{
+    struct controller_state controller = { 0 };
+    for (int i = 0; i < 8; i++)
+    {
+        controller.btns[i] = (buttons >> i) & 1;
+    }
+    return controller;
+}
+
+static void _movie_free_keyframes(struct movie *movie, uint32_t from)
+{
+    for (uint32_t i = from; i < movie->keyframe_capacity; i++)
+    {
+        free(movie->keyframes[i]);
+        movie->keyframes[i] = NULL;
+    }
+}
+
+static bool _movie_reserve_keyframes(struct movie *movie, uint32_t count)
+{
+    if (count <= movie->keyframe_capacity)
+    {
+        return true;
+    }
+
+    uint32_t capacity = movie->keyframe_capacity ? movie->keyframe_capacity : 16;
+    while (capacity < count)
+    {
+        if (capacity > UINT32_MAX/2)
+        {
+            return false;
+        }
+        capacity *= 2;
+    }
+
+    uint8_t **keyframes = realloc(movie->keyframes, capacity*sizeof *keyframes);
+    if (!keyframes)
+    {
+        return false;
+    }
+
+    memset(keyframes + movie->keyframe_capacity, 0, (capacity - movie->keyframe_capacity)*sizeof *keyframes);
+    movie->keyframes = keyframes;
+    movie->keyframe_capacity = capacity;
+    return true;
+}
+
+static bool _movie_append(struct movie *movie, struct movie_frame frame)
+{
+    if (movie->frame_count == movie->frame_capacity)
+    {
+        uint32_t capacity = movie->frame_capacity ? movie->frame_capacity*2 : 4096;
+        struct movie_frame *frames = realloc(movie->frames, capacity*sizeof *frames);
+        if (!frames)
+        {
+            return false;
+        }
+        movie->frames = frames;
+        movie->frame_capacity = capacity;
+    }
+
+    movie->frames[movie->frame_count++] = frame;
+    return true;
+}
+
+// Keyframes only make sense for the mapper they came from, the state size tells them apart
+static bool _movie_check_player(struct movie *movie, struct player *player)
+{
+    size_t state_size = player_state_size(player);
+
+    if (movie->state_size != state_size)
+    {
+        if (movie->state_size)
+        {
+            printf("Movie keyframes don't fit this ROM or build, rebuilding them\n");
+        }
+        _movie_free_keyframes(movie, 0);
+        movie->state_size = state_size;
+    }
+
+    return state_size != 0;
+}
+
+static void _movie_take_keyframe(struct movie *movie, struct player *player)
+{
+    if (movie->cursor % movie->keyframe_interval != 0 || !_movie_check_player(movie, player))
+    {
+        return;
+    }
+
+    uint32_t index = movie->cursor / movie->keyframe_interval;
+    if (!_movie_reserve_keyframes(movie, index + 1) || movie->keyframes[index])
+    {
+        return;
+    }
+
+    movie->keyframes[index] = malloc(movie->state_size);
+    if (movie->keyframes[index])
+    {
+        player_save_state(player, movie->keyframes[index]);
+    }
+}
+
+static struct system_frame_result _movie_run(struct movie *movie, struct player *player)
+{
+    _movie_take_keyframe(movie, player);
+
+    struct movie_frame frame = movie->frames[movie->cursor++];
+    if (frame.flags & MOVIE_FLAG_RESET)
+    {
+        player_reset(player);
+    }
+    player_set_controller(player, _movie_unpack_buttons(frame.buttons));
+
+    return player_frame(player);
+}
+
+struct movie *movie_new(uint32_t keyframe_interval)
+{
+    struct movie *movie = calloc(1, sizeof *movie);
+    if (!movie)
+    {
+        return NULL;
+    }
+
+    movie->keyframe_interval = keyframe_interval ? keyframe_interval : MOVIE_DEFAULT_KEYFRAME_INTERVAL;
+    return movie;
+}
+
+void movie_free(struct movie *movie)
+{
+    _movie_free_keyframes(movie, 0);
+    free(movie->keyframes);
+    free(movie->frames);
+    free(movie);
+}
+
+// Records a frame at the cursor and runs it. Anything recorded after the cursor
+// is thrown away, so recording after a seek branches the movie from there.
+struct system_frame_result movie_record_frame(struct movie *movie, struct player *player, struct controller_state controller, bool reset)
+{
+    if (movie->cursor < movie->frame_count)
+    {
+        movie->frame_count = movie->cursor;
+        _movie_free_keyframes(movie, movie->cursor / movie->keyframe_interval + 1);
+    }
+
+    struct movie_frame frame = { _movie_pack_buttons(controller), reset ? MOVIE_FLAG_RESET : 0 };
+    if (!_movie_append(movie, frame))
+    {
+        // Out of memory, keep the game going without the movie
+        if (reset)
+        {
+            player_reset(player);
+        }
+        player_set_controller(player, controller);
+        return player_frame(player);
+    }
+
+    return _movie_run(movie, player);
+}
+
+bool movie_play_frame(struct movie *movie, struct player *player, struct system_frame_result *out)
+{
+    if (movie->cursor >= movie->frame_count)
+    {
+        return false;
+    }
+
+    struct system_frame_result result = _movie_run(movie, player);
+    if (out)
+    {
+        *out = result;
+    }
+
+    return true;
+}
+
+// Afterwards the next movie_play_frame runs frame. Frames re-emulated on the way
+// still produce audio, detach the outputs first if that matters.
+bool movie_seek(struct movie *movie, struct player *player, uint32_t frame)
+{
+    if (frame > movie->frame_count)
+    {
+        return false;
+    }
+
+    int64_t index = -1;
+    if (_movie_check_player(movie, player))
+    {
+        index = frame / movie->keyframe_interval;
+        if (index >= movie->keyframe_capacity)
+        {
+            index = (int64_t)movie->keyframe_capacity - 1;
+        }
+        while (index >= 0 && !movie->keyframes[index])
+        {
+            index--;
+        }
+    }
+
+    uint32_t keyframe_at = index >= 0 ? (uint32_t)index*movie->keyframe_interval : 0;
+
+    // Going forward from where we are beats loading an older keyframe
+    if (movie->cursor > frame || movie->cursor < keyframe_at)
+    {
+        if (index < 0)
+        {
+            printf("Movie has no keyframe before frame %u\n", frame);
+            return false;
+        }
+
+        player_load_state(player, movie->keyframes[index]);
+        movie->cursor = keyframe_at;
+    }
+
+    while (movie->cursor < frame)
+    {
+        _movie_run(movie, player);
+    }
+
+    return true;
+}
+
+static void _movie_put_u32(FILE *fp, uint32_t value)
+{
+    uint8_t bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+    fwrite(bytes, 1, 4, fp);
+}
+
+static bool _movie_get_u32(FILE *fp, uint32_t *value)
+{
+    uint8_t bytes[4];
+    if (fread(bytes, 1, 4, fp) != 4)
+    {
+        return false;
+    }
+    *value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+    return true;
+}
+
+// Zero runs then literals, consecutive keyframes differ in a few KB out of ~200
+static size_t _movie_pack(uint8_t *out, const uint8_t *state, const uint8_t *prev, size_t size)
+{
+    size_t at = 0;
+    size_t i = 0;
+
+    while (i < size)
+    {
+        size_t zeros = 0;
+        while (i + zeros < size && zeros < MOVIE_RUN_MAX && (state[i + zeros] ^ prev[i + zeros]) == 0)
+        {
+            zeros++;
+        }
+        i += zeros;
+
+        // A literal run only ends at a few zeros in a row, two byte runs would cost more than they save
+        size_t literals = 0;
+        while (i + literals < size && literals < MOVIE_RUN_MAX)
+        {
+            size_t j = i + literals;
+            if (j + 4 <= size && (state[j] ^ prev[j]) == 0 && (state[j+1] ^ prev[j+1]) == 0 &&
+                (state[j+2] ^ prev[j+2]) == 0 && (state[j+3] ^ prev[j+3]) == 0)
+            {
+                break;
+            }
+            literals++;
+        }
+
+        out[at++] = zeros;
+        out[at++] = zeros >> 8;
+        out[at++] = literals;
+        out[at++] = literals >> 8;
+        for (size_t j = 0; j < literals; j++)
+        {
+            out[at++] = state[i + j] ^ prev[i + j];
+        }
+        i += literals;
+    }
+
+    return at;
+}
+
+static bool _movie_unpack(uint8_t *state, const uint8_t *prev, size_t size, const uint8_t *in, size_t len)
+{
+    size_t at = 0;
+    size_t i = 0;
+
+    while (at + 4 <= len)
+    {
+        size_t zeros = in[at] | (in[at+1] << 8);
+        size_t literals = in[at+2] | (in[at+3] << 8);
+        at += 4;
+
+        if (i + zeros + literals > size || at + literals > len)
+        {
+            return false;
+        }
+
+        memcpy(state + i, prev + i, zeros);
+        i += zeros;
+        for (size_t j = 0; j < literals; j++)
+        {
+            state[i + j] = in[at + j] ^ prev[i + j];
+        }
+        i += literals;
+        at += literals;
+    }
+
+    return i == size && at == len;
+}
+
+bool movie_save(struct movie *movie, const char *path)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+    {
+        printf("Can't write %s\n", path);
+        return false;
+    }
+
+    uint32_t keyframe_count = 0;
+    for (uint32_t i = 0; i < movie->keyframe_capacity; i++)
+    {
+        keyframe_count += movie->keyframes[i] != NULL;
+    }
+
+    fwrite("NMV1", 1, 4, fp);
+    _movie_put_u32(fp, movie->frame_count);
+    _movie_put_u32(fp, movie->keyframe_interval);
+    _movie_put_u32(fp, (uint32_t)movie->state_size);
+    _movie_put_u32(fp, keyframe_count);
+
+    for (uint32_t i = 0; i < movie->frame_count; i++)
+    {
+        fputc(movie->frames[i].buttons, fp);
+        fputc(movie->frames[i].flags, fp);
+    }
+
+    // Worst case every byte is a literal plus a run header per 64K
+    uint8_t *prev = calloc(1, movie->state_size + 1);
+    uint8_t *packed = malloc(movie->state_size + movie->state_size/MOVIE_RUN_MAX*4 + 8);
+    bool ok = prev && packed;
+
+    for (uint32_t i = 0; ok && i < movie->keyframe_capacity; i++)
+    {
+        if (!movie->keyframes[i])
+        {
+            continue;
+        }
+
+        size_t len = _movie_pack(packed, movie->keyframes[i], prev, movie->state_size);
+        _movie_put_u32(fp, i);
+        _movie_put_u32(fp, (uint32_t)len);
+        fwrite(packed, 1, len, fp);
+        memcpy(prev, movie->keyframes[i], movie->state_size);
+    }
+
+    free(prev);
+    free(packed);
+    ok = ok && !ferror(fp);
+    fclose(fp);
+
+    return ok;
+}
+
+struct movie *movie_load(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+    {
+        printf("Can't open %s\n", path);
+        return NULL;
+    }
+
+    char magic[4];
+    uint32_t frame_count, keyframe_interval, state_size, keyframe_count;
+
+    if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, "NMV1", 4) != 0 ||
+        !_movie_get_u32(fp, &frame_count) || !_movie_get_u32(fp, &keyframe_interval) ||
+        !_movie_get_u32(fp, &state_size) || !_movie_get_u32(fp, &keyframe_count) ||
+        keyframe_interval == 0)
+    {
+        printf("%s isn't a movie\n", path);
+        fclose(fp);
+        return NULL;
+    }
+
+    struct movie *movie = movie_new(keyframe_interval);
+    if (!movie)
+    {
+        fclose(fp);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < frame_count; i++)
+    {
+        uint8_t bytes[2];
+        if (fread(bytes, 1, 2, fp) != 2 || !_movie_append(movie, (struct movie_frame){ bytes[0], bytes[1] }))
+        {
+            printf("%s is truncated\n", path);
+            movie_free(movie);
+            fclose(fp);
+            return NULL;
+        }
+    }
+
+    movie->state_size = state_size;
+    uint8_t *prev = calloc(1, state_size + 1);
+    uint8_t *packed = malloc(state_size + state_size/MOVIE_RUN_MAX*4 + 8);
+    bool ok = prev && packed;
+    // Keyframe i is the state before frame i*keyframe_interval, one past the
+    // last frame at most. The index comes from the file, so it gets checked
+    // before anything is sized by it.
+    uint32_t keyframe_limit = frame_count/keyframe_interval + 1;
+
+    for (uint32_t i = 0; ok && i < keyframe_count; i++)
+    {
+        uint32_t index, len;
+        ok = _movie_get_u32(fp, &index) && _movie_get_u32(fp, &len) && index < keyframe_limit &&
+            len <= state_size + state_size/MOVIE_RUN_MAX*4 + 8 && fread(packed, 1, len, fp) == len &&
+            _movie_reserve_keyframes(movie, index + 1) && !movie->keyframes[index];
+
+        if (ok)
+        {
+            movie->keyframes[index] = malloc(state_size);
+            ok = movie->keyframes[index] && _movie_unpack(movie->keyframes[index], prev, state_size, packed, len);
+        }
+
+        if (ok)
+        {
+            memcpy(prev, movie->keyframes[index], state_size);
+        }
+    }
+
+    if (!ok)
+    {
+        // The inputs are what matters, keyframes come back while playing
+        printf("%s has broken keyframes, ignoring them\n", path);
+        _movie_free_keyframes(movie, 0);
+    }
+
+    free(prev);
+    free(packed);
+    fclose(fp);
+
+    return movie;
+}
+
+// FCEUX text movies, only a standard controller in port 0 and starting from power on
+struct movie *movie_import_fm2(const char *path, uint32_t keyframe_interval)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+    {
+        printf("Can't open %s\n", path);
+        return NULL;
+    }
+
+    struct movie *movie = movie_new(keyframe_interval);
+    if (!movie)
+    {
+        fclose(fp);
+        return NULL;
+    }
+
+    // RLDUTSBA in the file, our buttons are in enum controller_btn order
+    const enum controller_btn fm2_order[8] = { BTN_RIGHT, BTN_LEFT, BTN_DOWN, BTN_UP, BTN_START, BTN_SELECT, BTN_B, BTN_A };
+    bool has_gamepad = true;
+    bool warned_power = false;
+    char line[256];
+
+    while (fgets(line, sizeof line, fp))
+    {
+        if (line[0] != '|')
+        {
+            if (strncmp(line, "binary 1", 8) == 0 || (strncmp(line, "savestate ", 10) == 0 && line[10] > ' '))
+            {
+                printf("%s is a binary or savestate anchored fm2, not supported\n", path);
+                movie_free(movie);
+                fclose(fp);
+                return NULL;
+            }
+            if (strncmp(line, "port0 ", 6) == 0)
+            {
+                has_gamepad = atoi(line + 6) == 1;
+            }
+            continue;
+        }
+
+        // |commands|RLDUTSBA|port1|port2|
+        char *at = line + 1;
+        int commands = strtol(at, &at, 10);
+        struct controller_state controller = { 0 };
+
+        if (*at == '|' && has_gamepad)
+        {
+            at++;
+            for (int i = 0; i < 8 && at[i] && at[i] != '|'; i++)
+            {
+                controller.btns[fm2_order[i]] = at[i] != '.' && at[i] != ' ';
+            }
+        }
+
+        // 1 is a soft reset, 2 power cycles which is a reset here, except on the first frame where it's a no-op
+        bool reset = (commands & 1) || ((commands & 2) && movie->frame_count > 0);
+        if ((commands & 2) && movie->frame_count > 0 && !warned_power)
+        {
+            printf("%s power cycles, replaying that as a reset\n", path);
+            warned_power = true;
+        }
+
+        if (!_movie_append(movie, (struct movie_frame){ _movie_pack_buttons(controller), reset ? MOVIE_FLAG_RESET : 0 }))
+        {
+            movie_free(movie);
+            fclose(fp);
+            return NULL;
+        }
+    }
+
+    fclose(fp);
+    return movie;
+}
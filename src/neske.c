@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include "SDL3/SDL_audio.h"
 #include "SDL3/SDL_dialog.h"
@@ -21,25 +22,6 @@
 #include "SDL3/SDL_main.h"
 #include "neske.h"
 
-uint32_t pallete[] = {
-    0x626262ff, 0x001fb2ff, 0x2404c8ff, 0x5200b2ff,
-    0x730076ff, 0x800024ff, 0x730b00ff, 0x522800ff,
-    0x244400ff, 0x005700ff, 0x005c00ff, 0x005324ff,
-    0x003c76ff, 0x000000ff, 0x000000ff, 0x000000ff,
-    0xabababff, 0x0d57ffff, 0x4b30ffff, 0x8a13ffff,
-    0xbc08d6ff, 0xd21269ff, 0xc72e00ff, 0x9d5400ff,
-    0x607b00ff, 0x209800ff, 0x00a300ff, 0x009942ff,
-    0x007db4ff, 0x000000ff, 0x000000ff, 0x000000ff,
-    0xffffffff, 0x53aeffff, 0x9085ffff, 0xd365ffff,
-    0xff57ffff, 0xff5dcfff, 0xff7757ff, 0xfa9e00ff,
-    0xbdc700ff, 0x7ae700ff, 0x43f611ff, 0x26ef7eff,
-    0x2cd5f6ff, 0x4e4e4eff, 0x000000ff, 0x000000ff,
-    0xffffffff, 0xb6e1ffff, 0xced1ffff, 0xe9c3ffff,
-    0xffbcffff, 0xffbdf4ff, 0xffc6c3ff, 0xffd59aff,
-    0xe9e681ff, 0xcef481ff, 0xb6fb9aff, 0xa9fac3ff,
-    0xa9f0f4ff, 0xb8b8b8ff, 0x000000ff, 0x000000ff,
-};
-
 void sdl_mux_lock( void *mux )
 {
     SDL_LockMutex(mux);
@@ -81,31 +63,27 @@ void show_error(const char *title, const char *mesg, bool fatal)
     }
 }
 
-struct player load_rom_from_file(const char *path, struct mux_api apu_mux)
+struct player load_rom_from_file(const char *path, struct mux_api apu_mux, struct rom_file *rom)
 {
-    FILE *fp = fopen(path, "rb");
-    if (!fp)
+    // Mapped, not read, the mappers use it in place for as long as the player lives
+    if (!rom_file_open(path, rom))
     {
         show_error("Error loading ROM:", "Can't open the file", false);
         return (struct player){ 0 };
     }
-    fseek(fp, 0, SEEK_END);
-    size_t fsize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    uint8_t *rom = malloc(fsize);
-    fread(rom, 1, fsize, fp);
-    fclose(fp);
 
-    if (fsize < 16)
+    if (rom->size < 16)
     {
+        rom_file_close(rom);
         return (struct player){ 0 };
     }
 
-    struct player player = player_init(rom, apu_mux);
+    struct player player = player_init(rom->data, rom->size, apu_mux);
 
     if (!player.is_valid)
     {
         show_error("Error loading ROM:", "Invalid ROM or I don't support that mapper oops", false);
+        rom_file_close(rom);
         return (struct player){ 0 };
     }
 
@@ -125,16 +103,14 @@ enum ui_window
     WIN_FUN,
 };
 
-struct rtc_state
-{
-    int level;
-    int frames_since_last_pulse;
-};  
+// Samples copied out of the ring per SDL_PutAudioStreamData call
+#define AUDIO_CALLBACK_LEN 4096
 
 struct neske_ui
 {
     int scale;
     struct player player;
+    struct rom_file rom_file;
     struct mux_api apu_mux;
     SDL_Renderer *renderer;
     SDL_Window *window;
@@ -154,6 +130,24 @@ struct neske_ui
     struct controls_spec controls;
     enum controller_btn btn_selected;
     SDL_Texture *tex_backbuffer;
+    struct video_lut video_lut;
+    uint32_t sample_rate;
+    volatile uint32_t audio_active;
+    struct sample_ring audio_ring;
+    int16_t audio_buf[AUDIO_CALLBACK_LEN];
+    uint64_t backbuffer_hash;
+    struct system_frame_result frame;
+    struct wav_recorder *recorder;
+    bool record_stems;
+    struct video_recorder *video_recorder;
+    bool capture_y4m;
+    struct movie *movie;
+    char movie_path[64];
+    bool movie_reset; // reset pressed while recording, goes into the next frame
+    uint8_t *power_state; // right after loading, movies start from here
+    struct save_file *save; // battery RAM, NULL without a battery or with --no-sav
+    bool no_sav;
+    bool jit; // --jit or F8, kept across loaded games
 
     SDL_Cursor *cursor;
     SDL_Texture *tex_menu;
@@ -226,40 +220,10 @@ static void set_default_controls(struct controls_spec *controls)
     controls->keys[BTN_RIGHT] = SDLK_RIGHT;
 }
 
-void rtc_iter(struct rtc_state *rtc, struct system *sys)
-{
-    if (rtc->level == 0) return;
-    rtc->frames_since_last_pulse++;
-    int frames = 20;
-    if (rtc->level == 1) frames = 10;
-    if (rtc->frames_since_last_pulse < frames) return;
-    rtc->frames_since_last_pulse = 0;
-
-    uint16_t addr = rand()%0x2000;
-    while (addr >= 0x100 && addr < 0x200)
-    {
-        addr = rand()%0x2000;
-    }
-
-    uint8_t val = sys->memory[addr];
-    if (rtc->level == 2)
-    {
-        val = rand()%0x100;
-    }
-    else
-    {
-        int delta = rand()%2 ? 1 : -1;
-        if (val == 0) delta = 1;
-        if (val == 0xFF) delta = -1;
-        val += delta;
-    }
-
-    sys->memory[addr] = val;
-}
-
 struct neske_ui neske_ui_init(SDL_Renderer *renderer, SDL_Window *window, int ui_scale)
 {
     struct neske_ui ui = { 0 };
+    ui.rtc_state = rtc_make(RTC_OFF, RTC_TARGET_RAM, (uint64_t)time(NULL));
 
     int count = 1;
     SDL_JoystickID *ids = SDL_GetJoysticks(&count);
@@ -272,6 +236,7 @@ struct neske_ui neske_ui_init(SDL_Renderer *renderer, SDL_Window *window, int ui
 
 
     ui.apu_mux = sdl_mux_make();
+    sample_ring_init(&ui.audio_ring);
     ui.btn_selected = -1;
     ui.mutex = SDL_CreateMutex();
     ui.emulating = false;
@@ -290,7 +255,7 @@ struct neske_ui neske_ui_init(SDL_Renderer *renderer, SDL_Window *window, int ui
     ui.tex_about = load_ui_texture(renderer, "img/about.png");
     ui.tex_fun = load_ui_texture(renderer, "img/fun.png");
     ui.tex_userfont = load_ui_texture(renderer, "img/userfont.png");
-    ui.tex_backbuffer = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, 256, 240);
+    ui.tex_backbuffer = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, 256, 240);
     SDL_SetTextureScaleMode(ui.tex_backbuffer, SDL_SCALEMODE_NEAREST);
 
     SDL_Surface *cursor_surface = IMG_Load("img/cursor.png");
@@ -312,16 +277,24 @@ struct neske_ui neske_ui_init(SDL_Renderer *renderer, SDL_Window *window, int ui
     return ui;
 }
 
-void draw_nes_emu(SDL_Renderer *renderer, SDL_Texture *sdltexture, struct system_frame_result result)
+void draw_nes_emu(SDL_Renderer *renderer, SDL_Texture *sdltexture, struct video_lut *lut, uint64_t *last_hash, struct system_frame_result result)
 {
-    uint32_t texture[240*256];
+    bool lut_changed = video_lut_update(lut, video_palette);
+    uint64_t hash = video_frame_hash(&result);
 
-    for (int i = 0; i < 240*256; i++)
+    // Static screens and pause menus don't need to be uploaded again
+    if (lut_changed || hash != *last_hash)
     {
-        texture[i] = pallete[result.screen[i]];
-    }
+        void *pixels;
+        int pitch;
 
-    SDL_UpdateTexture(sdltexture, NULL, texture, 256*4);
+        if (SDL_LockTexture(sdltexture, NULL, &pixels, &pitch))
+        {
+            video_convert_frame(lut, pixels, pitch, &result);
+            SDL_UnlockTexture(sdltexture);
+            *last_hash = hash;
+        }
+    }
 
     SDL_FRect srcf = {0, 0, 128*8, 8};
     SDL_FRect src = {0, 0, 256, 240};
@@ -354,6 +327,142 @@ bool draw_widget(struct neske_ui *ui, const char *name, int x, int y, int w, int
     return intersect && ui->mouse_released;
 }
 
+static void neske_ui_stop_recording(struct neske_ui *ui)
+{
+    if (!ui->recorder)
+    {
+        return;
+    }
+
+    player_set_audio_writer(&ui->player, (struct apu_writer){ 0 }, false);
+    wav_recorder_stop(ui->recorder);
+    ui->recorder = NULL;
+    printf("Audio recording stopped\n");
+}
+
+static void neske_ui_toggle_recording(struct neske_ui *ui)
+{
+    if (ui->recorder)
+    {
+        neske_ui_stop_recording(ui);
+        return;
+    }
+
+    if (!ui->emulating)
+    {
+        return;
+    }
+
+    char path[64];
+    time_t now = time(NULL);
+    strftime(path, sizeof path, "neske_%Y%m%d_%H%M%S.wav", localtime(&now));
+
+    ui->recorder = wav_recorder_start(path, ui->sample_rate, ui->record_stems);
+    if (ui->recorder)
+    {
+        player_set_audio_writer(&ui->player, wav_recorder_writer(ui->recorder), ui->record_stems);
+        printf("Recording audio to %s\n", path);
+    }
+}
+
+static void neske_ui_stop_capture(struct neske_ui *ui)
+{
+    if (!ui->video_recorder)
+    {
+        return;
+    }
+
+    video_recorder_stop(ui->video_recorder);
+    ui->video_recorder = NULL;
+}
+
+static void neske_ui_toggle_capture(struct neske_ui *ui)
+{
+    if (ui->video_recorder)
+    {
+        neske_ui_stop_capture(ui);
+        return;
+    }
+
+    if (!ui->emulating)
+    {
+        return;
+    }
+
+    char path[64];
+    time_t now = time(NULL);
+    strftime(path, sizeof path, ui->capture_y4m ? "neske_%Y%m%d_%H%M%S.y4m" : "neske_%Y%m%d_%H%M%S.nesv", localtime(&now));
+
+    // Playing live, a slow disk loses frames instead of stuttering the game
+    ui->video_recorder = video_recorder_start(path, ui->capture_y4m ? VIDREC_Y4M : VIDREC_INDEXED, false);
+    if (ui->video_recorder)
+    {
+        printf("Capturing video to %s\n", path);
+    }
+}
+
+static void neske_ui_stop_movie(struct neske_ui *ui)
+{
+    if (!ui->movie)
+    {
+        return;
+    }
+
+    if (movie_save(ui->movie, ui->movie_path))
+    {
+        printf("Saved %u frames of input to %s\n", ui->movie->frame_count, ui->movie_path);
+    }
+    movie_free(ui->movie);
+    ui->movie = NULL;
+}
+
+static void neske_ui_toggle_movie(struct neske_ui *ui)
+{
+    if (ui->movie)
+    {
+        neske_ui_stop_movie(ui);
+        return;
+    }
+
+    if (!ui->emulating)
+    {
+        return;
+    }
+
+    if (!ui->power_state)
+    {
+        printf("Can't record input for this ROM, it has no savestates\n");
+        return;
+    }
+
+    // Movies play back from power on, so recording restarts the game. The power
+    // on state has blank RAM, the .sav is let go first so that doesn't end up in it.
+    if (ui->save)
+    {
+        save_file_close(ui->save);
+        ui->save = NULL;
+        printf("Stopped saving the game's battery RAM until it's loaded again\n");
+    }
+    player_load_state(&ui->player, ui->power_state);
+    ui->crash = false;
+
+    time_t now = time(NULL);
+    strftime(ui->movie_path, sizeof ui->movie_path, "neske_%Y%m%d_%H%M%S.nmv", localtime(&now));
+    ui->movie = movie_new(MOVIE_DEFAULT_KEYFRAME_INTERVAL);
+    ui->movie_reset = false;
+}
+
+static void neske_ui_toggle_jit(struct neske_ui *ui)
+{
+    ui->jit = !ui->jit;
+    if (ui->emulating && !player_set_jit(&ui->player, ui->jit))
+    {
+        ui->jit = false;
+        return;
+    }
+    printf("JIT %s\n", ui->jit ? "on" : "off");
+}
+
 bool neske_ui_event(struct neske_ui *ui, SDL_Event *event)
 {
     SDL_LockMutex(ui->mutex);
@@ -403,7 +512,23 @@ bool neske_ui_event(struct neske_ui *ui, SDL_Event *event)
             break;
         case SDL_EVENT_KEY_DOWN:
         case SDL_EVENT_KEY_UP:
-            if (ui->show_window == WIN_NONE)
+            if (event->type == SDL_EVENT_KEY_DOWN && event->key.key == SDLK_F8 && !event->key.repeat)
+            {
+                neske_ui_toggle_jit(ui);
+            }
+            else if (event->type == SDL_EVENT_KEY_DOWN && event->key.key == SDLK_F9 && !event->key.repeat)
+            {
+                neske_ui_toggle_recording(ui);
+            }
+            else if (event->type == SDL_EVENT_KEY_DOWN && event->key.key == SDLK_F10 && !event->key.repeat)
+            {
+                neske_ui_toggle_capture(ui);
+            }
+            else if (event->type == SDL_EVENT_KEY_DOWN && event->key.key == SDLK_F11 && !event->key.repeat)
+            {
+                neske_ui_toggle_movie(ui);
+            }
+            else if (ui->show_window == WIN_NONE)
             {
                 const enum controller_btn buttons[] = { BTN_A, BTN_B, BTN_START, BTN_SELECT, BTN_UP, BTN_DOWN, BTN_LEFT, BTN_RIGHT };
 
@@ -451,35 +576,54 @@ static void SDLCALL on_rom_open(void *userdata, const char *const *filelist, int
     struct neske_ui *ui = userdata;
     
     SDL_LockMutex(ui->mutex);
+    neske_ui_stop_recording(ui);
+    neske_ui_stop_capture(ui);
+    neske_ui_stop_movie(ui);
+    save_file_close(ui->save);
+    ui->save = NULL;
+    free(ui->power_state);
+    ui->power_state = NULL;
     ui->emulating = false;
     ui->error = false;
     ui->crash = false;
+    atomic32_store(&ui->audio_active, 0);
     if (ui->player.is_valid)
     {
         player_free(&ui->player);
     }
-    ui->player = load_rom_from_file(*filelist, ui->apu_mux);
+    rom_file_close(&ui->rom_file);
+    ui->player = load_rom_from_file(*filelist, ui->apu_mux, &ui->rom_file);
     if (!ui->player.is_valid)
     {
         ui->error = true;
     }
     else
     {
+        player_set_sample_rate(&ui->player, ui->sample_rate);
+        player_set_audio_ring(&ui->player, &ui->audio_ring, true);
+        ui->power_state = player_state_size(&ui->player) ? malloc(player_state_size(&ui->player)) : NULL;
+        if (ui->power_state)
+        {
+            player_save_state(&ui->player, ui->power_state);
+        }
+        if (!ui->no_sav)
+        {
+            ui->save = save_file_open(&ui->player, *filelist);
+        }
+        if (ui->jit && !player_set_jit(&ui->player, true))
+        {
+            ui->jit = false;
+        }
         ui->emulating = true;
+        atomic32_store(&ui->audio_active, 1);
     }
     SDL_UnlockMutex(ui->mutex);
 }
 
-void neske_ui_update(struct neske_ui *ui)
+void neske_ui_update(struct neske_ui *ui, int frames_due)
 {
     SDL_LockMutex(ui->mutex);
 
-    if (ui->player.is_valid)
-    {
-        struct system *sys = player_get_system(&ui->player);
-        rtc_iter(&ui->rtc_state, sys);
-    }
-
     if (ui->crash)
     {
         SDL_RenderTexture(ui->renderer, ui->tex_crash, NULL, &(SDL_FRect){1, 13, 256, 240});
@@ -494,11 +638,34 @@ void neske_ui_update(struct neske_ui *ui)
     }
     else if (ui->emulating)
     {
-        draw_nes_emu(ui->renderer, ui->tex_backbuffer, player_frame(&ui->player));
-        if (player_crash(&ui->player))
+        // Emulation runs at NTSC rate no matter the refresh rate, only the latest frame gets shown
+        for (int i = 0; i < frames_due && !ui->crash; i++)
         {
-            ui->crash = true;
+            rtc_iter(&ui->rtc_state, player_get_system(&ui->player));
+            if (ui->movie)
+            {
+                ui->frame = movie_record_frame(ui->movie, &ui->player, ui->controller, ui->movie_reset);
+                ui->movie_reset = false;
+            }
+            else
+            {
+                ui->frame = player_frame(&ui->player);
+            }
+            if (ui->video_recorder)
+            {
+                video_recorder_push(ui->video_recorder, &ui->frame);
+            }
+            if (ui->save)
+            {
+                save_file_sync(ui->save);
+            }
+            if (player_crash(&ui->player))
+            {
+                ui->crash = true;
+            }
         }
+
+        draw_nes_emu(ui->renderer, ui->tex_backbuffer, &ui->video_lut, &ui->backbuffer_hash, ui->frame);
     }
     else
     {
@@ -630,25 +797,25 @@ void neske_ui_update(struct neske_ui *ui)
 
                 if (draw_widget(ui, "FUN_BTN_OFF", fun_btn_off.x, fun_btn_off.y, fun_btn_off.w, fun_btn_off.h))
                 {
-                    ui->rtc_state.level = 0;
+                    ui->rtc_state.level = RTC_OFF;
                 }
 
                 if (draw_widget(ui, "FUN_BTN_LOW", fun_btn_low.x, fun_btn_low.y, fun_btn_low.w, fun_btn_low.h))
                 {
-                    ui->rtc_state.level = 1;
+                    ui->rtc_state.level = RTC_LOW;
                 }
 
                 if (draw_widget(ui, "FUN_BTN_HI", fun_btn_hi.x, fun_btn_hi.y, fun_btn_hi.w, fun_btn_hi.h))
                 {
-                    ui->rtc_state.level = 2;
+                    ui->rtc_state.level = RTC_HIGH;
                 }
 
                 SDL_SetRenderDrawColor(ui->renderer, 0xFF, 0xFF, 0x0, 0xFF); 
                 switch (ui->rtc_state.level)
                 {
-                    case 0: SDL_RenderRect(ui->renderer, &fun_btn_off); break;
-                    case 1: SDL_RenderRect(ui->renderer, &fun_btn_low); break;
-                    case 2: SDL_RenderRect(ui->renderer, &fun_btn_hi); break;
+                    case RTC_OFF: SDL_RenderRect(ui->renderer, &fun_btn_off); break;
+                    case RTC_LOW: SDL_RenderRect(ui->renderer, &fun_btn_low); break;
+                    case RTC_HIGH: SDL_RenderRect(ui->renderer, &fun_btn_hi); break;
                 }
             }
             break;
@@ -665,23 +832,37 @@ void neske_ui_update(struct neske_ui *ui)
         {
             const SDL_DialogFileFilter filters[] = {
                 { "iNES (.nes)",  "nes" },
+                { "NSF (.nsf)",   "nsf" },
                 { "All files",   "*" }
             };
 
-            SDL_ShowOpenFileDialog(on_rom_open, ui, ui->window, filters, 2, NULL, false);
+            SDL_ShowOpenFileDialog(on_rom_open, ui, ui->window, filters, 3, NULL, false);
         }
 
         if (draw_widget(ui, "Unload ROM", 1, 25, 47, 11))
         {
+            neske_ui_stop_recording(ui);
+            neske_ui_stop_capture(ui);
+            neske_ui_stop_movie(ui);
+            save_file_close(ui->save);
+            ui->save = NULL;
             player_reset(&ui->player);
             ui->emulating = false;
+            atomic32_store(&ui->audio_active, 0);
         }
 
         if (draw_widget(ui, "Reset", 1, 37, 47, 11))
         {
             printf("Reset\n");
             ui->crash = false;
-            player_reset(&ui->player);
+            if (ui->movie)
+            {
+                ui->movie_reset = true;
+            }
+            else
+            {
+                player_reset(&ui->player);
+            }
         }
     }
 
@@ -713,6 +894,13 @@ void neske_ui_update(struct neske_ui *ui)
 
     if (draw_widget(ui, "X", 246, 1, 11, 11))
     {
+        // Recording's WAV header only gets its final size on stop, and the
+        // .sav only gets its last pages on close
+        neske_ui_stop_recording(ui);
+        neske_ui_stop_capture(ui);
+        neske_ui_stop_movie(ui);
+        save_file_close(ui->save);
+        ui->save = NULL;
         exit(0);
     }
 
@@ -730,15 +918,25 @@ void audio_callback(void *userdata, SDL_AudioStream *stream, int additional_amou
 {
     struct neske_ui *ui = userdata;
 
-    uint16_t buf[16384] = { 0 };
+    // Only ever touches the ring, never the player, so ROM loading can't pull it out from under us
+    int samples = additional_amount/2;
 
-    if (ui->player.is_valid)
+    while (samples > 0)
     {
-        // TODO: Maybe i should lock the apu mux here?
-        player_generate_samples(&ui->player, buf, additional_amount/2);
-    }
+        int count = samples < AUDIO_CALLBACK_LEN ? samples : AUDIO_CALLBACK_LEN;
 
-    SDL_PutAudioStreamData(stream, buf, additional_amount);
+        if (atomic32_load(&ui->audio_active))
+        {
+            sample_ring_read(&ui->audio_ring, ui->audio_buf, count);
+        }
+        else
+        {
+            memset(ui->audio_buf, 0, count*sizeof *ui->audio_buf);
+        }
+
+        SDL_PutAudioStreamData(stream, ui->audio_buf, count*sizeof *ui->audio_buf);
+        samples -= count;
+    }
 }
 
 int _get_ui_scale()
@@ -752,13 +950,68 @@ int _get_ui_scale()
     return v;
 }
 
-int main(int argc, char* argv[])
+static void print_pacer_stats(struct pacer_stats *stats, struct sample_ring *ring)
 {
-    srand(time(NULL));
+    printf(
+        "pacer: %llu emulated, %llu dropped, %llu repeated, %llu skipped | "
+        "interval %.2f..%.2f ms | jitter mean %.3f ms, stddev %.3f ms, max %.3f ms\n",
+        (unsigned long long)stats->frames_emulated,
+        (unsigned long long)stats->frames_dropped,
+        (unsigned long long)stats->frames_repeated,
+        (unsigned long long)stats->frames_skipped,
+        stats->intervals ? stats->interval_min*1000.0 : 0.0,
+        stats->interval_max*1000.0,
+        stats->jitter_mean*1000.0,
+        stats->jitter_stddev*1000.0,
+        stats->jitter_max*1000.0
+    );
+    printf(
+        "audio: %u buffered, %u underrun, %u overrun\n",
+        sample_ring_fill(ring),
+        atomic32_load(&ring->underruns),
+        atomic32_load(&ring->overruns)
+    );
+}
 
+int main(int argc, char* argv[])
+{
     SDL_Window *window;
     SDL_Renderer *renderer;
     bool done = false;
+    bool vrr = false;
+    bool show_pacer_stats = false;
+    bool record_stems = false;
+    bool capture_y4m = false;
+    bool no_sav = false;
+    bool jit = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--vrr") == 0)
+        {
+            vrr = true;
+        }
+        else if (strcmp(argv[i], "--pacer-stats") == 0)
+        {
+            show_pacer_stats = true;
+        }
+        else if (strcmp(argv[i], "--stems") == 0)
+        {
+            record_stems = true;
+        }
+        else if (strcmp(argv[i], "--y4m") == 0)
+        {
+            capture_y4m = true;
+        }
+        else if (strcmp(argv[i], "--no-sav") == 0)
+        {
+            no_sav = true;
+        }
+        else if (strcmp(argv[i], "--jit") == 0)
+        {
+            jit = true;
+        }
+    }
 
     SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_GAMEPAD);
     
@@ -793,15 +1046,33 @@ int main(int argc, char* argv[])
 
     audio_in.channels = 1;
     audio_in.format = SDL_AUDIO_S16;
-    audio_in.freq = 44100;
+    audio_in.freq = APU_DEFAULT_SAMPLE_RATE;
 
     SDL_AudioDeviceID audio_device = SDL_OpenAudioDevice(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK, NULL);
 
+    // Resample straight to the device rate so SDL doesn't resample a second time
+    SDL_AudioSpec audio_device_spec;
+    if (SDL_GetAudioDeviceFormat(audio_device, &audio_device_spec, NULL) && audio_device_spec.freq >= 8000)
+    {
+        audio_in.freq = audio_device_spec.freq;
+    }
+
     SDL_SetRenderScale(renderer, ui_scale, ui_scale);
 
     struct neske_ui neske_ui = neske_ui_init(renderer, window, ui_scale);
+    neske_ui.sample_rate = audio_in.freq;
+    neske_ui.record_stems = record_stems;
+    neske_ui.capture_y4m = capture_y4m;
+    neske_ui.no_sav = no_sav;
+    neske_ui.jit = jit;
     SDL_AudioStream *audio_device_stream = SDL_OpenAudioDeviceStream(audio_device, &audio_in, audio_callback, &neske_ui);
     SDL_ResumeAudioStreamDevice(audio_device_stream);
+
+    uint64_t tick_freq = SDL_GetPerformanceFrequency();
+    struct pacer pacer;
+    pacer_init(&pacer, PACER_NTSC_HZ, tick_freq, SDL_GetPerformanceCounter());
+    uint64_t stats_since = SDL_GetPerformanceCounter();
+
     while (!done) {
         SDL_Event event;
 
@@ -819,11 +1090,41 @@ int main(int argc, char* argv[])
             }
         }
 
-        neske_ui_update(&neske_ui);
+        if (vrr)
+        {
+            // With a variable refresh display we present exactly when a frame is due and the display follows
+            double wait = pacer_time_until_due(&pacer, SDL_GetPerformanceCounter());
+            if (wait > 0)
+            {
+                SDL_DelayPrecise((uint64_t)(wait*1e9));
+            }
+        }
+
+        int frames_due = pacer_frames_due(&pacer, SDL_GetPerformanceCounter());
+
+        neske_ui_update(&neske_ui, frames_due);
 
         SDL_RenderPresent(renderer);
+
+        uint64_t presented_at = SDL_GetPerformanceCounter();
+        pacer_frame_presented(&pacer, presented_at, frames_due);
+
+        if (show_pacer_stats && presented_at - stats_since > 5*tick_freq)
+        {
+            print_pacer_stats(&pacer.stats, &neske_ui.audio_ring);
+            pacer_reset_stats(&pacer);
+            stats_since = presented_at;
+        }
     }
 
+    SDL_LockMutex(neske_ui.mutex);
+    neske_ui_stop_recording(&neske_ui);
+    neske_ui_stop_capture(&neske_ui);
+    neske_ui_stop_movie(&neske_ui);
+    save_file_close(neske_ui.save);
+    neske_ui.save = NULL;
+    SDL_UnlockMutex(neske_ui.mutex);
+
     // Close and destroy the window
     SDL_DestroyWindow(window);
 
@@ -1,8 +1,10 @@
 #ifndef INCLUDED_NESKE_H
 #define INCLUDED_NESKE_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 // RICOH.H
 
@@ -53,7 +55,13 @@ struct ricoh_decoder
 struct ricoh_state
 {
     uint16_t pc;
-    uint8_t a, x, y, sp, flags;
+    uint8_t a, x, y, sp;
+    uint8_t flags; // N, Z, C and V aren't kept up to date here, use ricoh_get_flags
+    // What N, Z, C and V come from
+    uint8_t n_result; // bit 7
+    uint8_t z_result; // Z is it being 0
+    uint8_t carry; // 0 or 1
+    uint8_t overflow; // bit 7
     uint64_t cycles;
 
     uint8_t crash;
@@ -80,6 +88,10 @@ void ricoh_run_instr(
     struct instr_decoded instr,
     struct ricoh_mem_interface *mem
 );
+uint8_t ricoh_get_flags(const struct ricoh_state *cpu);
+void ricoh_set_flags(struct ricoh_state *cpu, uint8_t flags);
+
+extern const uint8_t ricoh_cycle_tbl[];
 
 // PPU.H
 
@@ -116,6 +128,7 @@ enum ppu_mir
     PPUMIR_ONE_ALT,
     PPUMIR_VER,
     PPUMIR_HOR,
+    PPUMIR_FOUR, // cart brings the other 2K
 };
 
 struct ppu_object
@@ -126,9 +139,13 @@ struct ppu_object
     uint8_t x;
 };
 
+#define PPU_CHR_RAM_LEN 0x2000
+
 struct ppu_pins
 {
-    uint8_t chr[8192];
+    uint8_t chr[PPU_CHR_RAM_LEN]; // CHR-RAM
+    uint16_t chr_ram_mask; // smaller RAM from the header shows up mirrored
+    const uint8_t *chr_rom[8]; // 1K slots, NULL where chr is used instead
     enum ppu_mir mirroring_mode;
 };
 
@@ -140,7 +157,8 @@ struct ppu
     // Internal memorky
     struct ppu_object oam[64];
     uint8_t pallete[32];
-    uint8_t vram[2048];
+    uint8_t vram[4096]; // upper half only with four screen
+    uint64_t chr_dirty[8]; // CHR-RAM tiles written, see ppu_take_chr_dirty
     uint8_t regs[PPUIR_COUNT];
 
     // Internal Registers   
@@ -155,6 +173,7 @@ struct ppu
 
     // Rendering & Timing
     uint8_t screen[256*240];
+    uint8_t line_mask[240]; // PPUMASK latched at the start of each visible scanline
     uint16_t beam;
     int16_t scanline;
     uint64_t cycles;
@@ -172,6 +191,63 @@ uint8_t ppu_read(struct ppu *ppu, enum ppu_io io);
 bool ppu_nmi_enabled(struct ppu *ppu);
 void ppu_write_oam(struct ppu *ppu, uint8_t *oamsrc);
 bool ppu_cycle(struct ppu *ppu, struct ricoh_mem_interface *mem);
+uint32_t ppu_cycles_to_vblank(const struct ppu *ppu);
+void ppu_take_chr_dirty(struct ppu *ppu, uint64_t out[8]);
+void ppu_mark_chr_dirty(struct ppu *ppu);
+
+// RING.H
+
+// Power of two, indices run freely and wrap on their own
+#define SAMPLE_RING_LEN (16384)
+
+uint32_t atomic32_load(volatile uint32_t *value);
+void atomic32_store(volatile uint32_t *value, uint32_t new_value);
+uint32_t atomic32_add(volatile uint32_t *value, uint32_t delta);
+uint32_t atomic32_or(volatile uint32_t *value, uint32_t bits); // returns the new value
+uint32_t atomic32_exchange(volatile uint32_t *value, uint32_t new_value); // returns the old value
+// Spin lock on a word that starts 0, for the few places threads share something briefly
+void atomic32_lock(volatile uint32_t *lock);
+void atomic32_unlock(volatile uint32_t *lock);
+
+// Single producer (emulation), single consumer (audio callback)
+struct sample_ring
+{
+    volatile uint32_t write_at;
+    volatile uint32_t read_at;
+    volatile uint32_t underruns; // samples the consumer had to pad
+    volatile uint32_t overruns;  // samples the producer had to drop
+    int16_t last;
+    int16_t samples[SAMPLE_RING_LEN];
+};
+
+void sample_ring_init(struct sample_ring *ring);
+uint32_t sample_ring_fill(struct sample_ring *ring);
+uint32_t sample_ring_write(struct sample_ring *ring, const int16_t *src, uint32_t count);
+uint32_t sample_ring_read(struct sample_ring *ring, int16_t *dest, uint32_t count);
+
+// THREAD.H
+
+typedef int (*thread_fn)(void *arg);
+
+struct thread;
+struct thread_signal;
+
+struct thread *thread_start(thread_fn fn, void *arg);
+void thread_join(struct thread *thread);
+struct thread_signal *thread_signal_new();
+void thread_signal_free(struct thread_signal *signal);
+void thread_signal_raise(struct thread_signal *signal);
+void thread_signal_wait(struct thread_signal *signal);
+bool thread_signal_wait_ms(struct thread_signal *signal, uint32_t ms); // false on timeout
+int thread_cpu_count();
+
+typedef void (*thread_pool_fn)(void *userdata, int index);
+
+struct thread_pool;
+
+struct thread_pool *thread_pool_new(int thread_count);
+void thread_pool_free(struct thread_pool *pool);
+void thread_pool_run(struct thread_pool *pool, int count, thread_pool_fn fn, void *userdata);
 
 // APU.H
 
@@ -195,6 +271,11 @@ enum apu_reg
     APU_NOISER_MXXX_PPPP,
     APU_NOISER_LLLL_LXXX,
 
+    APU_DMCCHN_ILXX_RRRR,
+    APU_DMCCHN_XDDD_DDDD,
+    APU_DMCCHN_AAAA_AAAA,
+    APU_DMCCHN_LLLL_LLLL,
+
     APU_STATUS_IFXD_NT21,
     APU_STATUS_MIXX_XXXX,
 };
@@ -235,6 +316,27 @@ struct apu_noise_chan
     uint8_t enabled;
 };
 
+struct apu_dmc_chan
+{
+    uint8_t flag_irq_enable;
+    uint8_t flag_loop;
+    uint16_t rate;
+    uint16_t sample_addr;
+    uint16_t sample_len;
+
+    // internal
+    uint8_t flag_irq;
+    uint8_t level;
+    uint16_t timer;
+    uint8_t shift;
+    uint8_t bits_remaining;
+    uint8_t silence;
+    uint8_t buffer;
+    uint8_t buffer_full;
+    uint16_t address;
+    uint16_t bytes_remaining;
+};
+
 struct apu_pulse_chan
 {
     uint8_t sweep_enable;
@@ -263,13 +365,49 @@ struct apu_pulse_chan
     uint8_t enabled;
 };
 
+// The mix plus what every channel sounds like on its own
+enum apu_stream
+{
+    APU_STREAM_MIX,
+    APU_STREAM_PULSE1,
+    APU_STREAM_PULSE2,
+    APU_STREAM_TRI,
+    APU_STREAM_NOISE,
+    APU_STREAM_DMC,
+    APU_STREAM_COUNT
+};
+
+// Gets every output block on the emulation thread, with the apu mux held
 struct apu_writer
 {
     void *userdata;
-    void (*write)(void *userdata, uint8_t *samples, uint32_t count);
+    void (*write)(void *userdata, int16_t *const *streams, int stream_count, uint32_t count);
 };
 
-#define APU_SAMPLE_RING_LEN (16384)
+#define APU_DEFAULT_SAMPLE_RATE 44100
+// Samples handed to the output ring at once
+#define APU_BLOCK_LEN 256
+// About two frames worth of samples buffered
+#define APU_RING_TARGET(rate) ((rate)/30)
+
+#define APU_CPU_RATE 1789773.0
+// Frame counter period in CPU cycles
+#define APU_FRAME_CYCLES (1789773 / 240)
+// CPU cycles averaged together before the sinc resampler
+#define APU_DECIMATION 8
+// Zero crossings on each side of the kernel
+#define APU_SINC_ZEROS 6
+#define APU_SINC_PHASES 64
+// Passband edge relative to the output rate
+#define APU_SINC_CUTOFF 0.45
+// Enough taps for the full kernel at 22050 Hz output and up
+#define APU_SINC_MAX_TAPS 144
+#define APU_HISTORY_LEN 256
+// Partial sums in the resampler dot product
+#define APU_DOT_LANES 8
+// Dynamic rate control, at most +-0.5% off the nominal ratio
+#define APU_RATE_MAX_ADJUST 0.005
+#define APU_RATE_GAIN 0.02
 
 struct apu_pass
 {
@@ -277,6 +415,33 @@ struct apu_pass
     float last_out;
 };
 
+// Output rates that can have a kernel at once
+#define APU_SINC_RATES 8
+
+// Filter for one output rate, built once and shared by every APU at that rate
+struct apu_sinc
+{
+    uint32_t rate;
+    int taps;
+    float kernel[APU_SINC_PHASES+1][APU_SINC_MAX_TAPS];
+};
+
+struct apu_resampler
+{
+    uint32_t rate;
+    const struct apu_sinc *sinc; // not this state's, load_state keeps the current one
+    double step_nominal; // intermediate samples per output sample
+    double step;
+    double time;
+    double fill_avg;
+
+    float box_sum[APU_STREAM_COUNT];
+    int32_t box_count;
+
+    uint32_t history_at;
+    float history[APU_STREAM_COUNT][APU_HISTORY_LEN*2];
+};
+
 struct apu
 {
     uint8_t flag_enable_interrupt;
@@ -286,31 +451,64 @@ struct apu
     uint32_t frame_counter;
     uint8_t status;
     uint64_t last_cpf; // last cycle of frame clock
-    uint64_t last_cps; // last cycle of sample output
     uint64_t cycles;
 
-    int16_t sample_ring[APU_SAMPLE_RING_LEN];
-    uint32_t sample_ring_write_at;
-    uint32_t sample_ring_read_at;
-    uint32_t samples_written;
-    uint32_t samples_read;
+    struct sample_ring *ring;
+    bool rate_control; // follow the ring fill, off when nothing consumes in realtime
+    struct apu_writer writer;
+    int stream_count; // only the mix unless the writer wants stems
+    float block[APU_STREAM_COUNT][APU_BLOCK_LEN]; // resampled, before the DC blocker
+    uint32_t block_len;
 
     struct apu_pulse_chan pulse1;
     struct apu_pulse_chan pulse2;
     struct apu_tri_chan tri;
     struct apu_noise_chan noise;
+    struct apu_dmc_chan dmc;
 
-    struct apu_pass high_pass;
+    struct apu_pass high_pass[APU_STREAM_COUNT];
+    struct apu_resampler resampler;
 };
 
-void apu_init(struct apu *apu);
+void apu_init(struct apu *apu, uint32_t sample_rate);
+void apu_set_sample_rate(struct apu *apu, uint32_t sample_rate);
 void apu_reg_write(struct apu *apu, enum apu_reg reg, uint8_t value);
 uint8_t apu_reg_read(struct apu *apu, enum apu_reg reg);
-void apu_flush(struct apu *apu, void *dest, int count);
+void apu_flush(struct apu *apu);
 void apu_cycle(struct apu *apu);
-void apu_ring_read(struct apu *apu, uint16_t *dest, uint32_t count);
 void apu_catchup_cycles(struct apu *apu, uint64_t cycles);
-void apu_catchup_samples(struct apu *apu, uint32_t samples_added);
+void apu_sync_rate(struct apu *apu, uint32_t fill, uint32_t target);
+void apu_set_writer(struct apu *apu, struct apu_writer writer, bool stems);
+uint64_t apu_dmc_next_fetch(struct apu *apu);
+void apu_dmc_fill(struct apu *apu, uint8_t byte);
+
+// WAVREC.H
+
+// Samples per stream in each of the two blocks, about 0.75s at 44.1kHz
+#define WAVREC_BLOCK_LEN 32768
+
+struct wav_recorder
+{
+    FILE *files[APU_STREAM_COUNT];
+    int stream_count;
+    uint32_t rate;
+    uint64_t samples_written; // writer thread only
+
+    // Emulation thread fills blocks[active], the writer owns a block while its pending count is set
+    int16_t *blocks[2];
+    int active;
+    uint32_t block_fill;
+    volatile uint32_t pending[2];
+    volatile uint32_t dropped;
+    volatile uint32_t stop;
+
+    struct thread *thread;
+    struct thread_signal *signal;
+};
+
+struct wav_recorder *wav_recorder_start(const char *path, uint32_t rate, bool stems);
+struct apu_writer wav_recorder_writer(struct wav_recorder *recorder);
+void wav_recorder_stop(struct wav_recorder *recorder);
 
 // IMAP.H
 
@@ -365,6 +563,31 @@ struct controller_state
     uint8_t btns[8];
 };
 
+// Things that happen at a known CPU cycle, checked between instructions
+enum system_event
+{
+    SYSTEM_EVENT_DMC_FETCH,
+    SYSTEM_EVENT_CART, // whatever the cartridge scheduled, goes to cart_event
+    SYSTEM_EVENT_OAM_DMA, // the CPU stalls for the copy before its next instruction
+    SYSTEM_EVENT_COUNT
+};
+
+enum system_irq
+{
+    SYSTEM_IRQ_DMC = 1 << 0,
+    SYSTEM_IRQ_CART = 1 << 1,
+};
+
+// APU writes waiting for the APU to catch up, see system.c
+#define SYSTEM_APU_QUEUE_LEN 64
+
+struct system_apu_write
+{
+    uint64_t cycle;
+    uint8_t reg; // enum apu_reg
+    uint8_t value;
+};
+
 struct system
 {
     struct ricoh_decoder decoder;
@@ -377,62 +600,382 @@ struct system
     uint8_t controller_sr;
     uint8_t controller_strobe;
 
+    uint64_t events[SYSTEM_EVENT_COUNT]; // UINT64_MAX when not scheduled
+    uint64_t next_event;
+    uint8_t irq; // enum system_irq lines currently held low
+    uint8_t oam_dma_page;
+
+    struct system_apu_write apu_queue[SYSTEM_APU_QUEUE_LEN];
+    uint32_t apu_queue_len;
+
     uint8_t memory[1<<16];
     struct ricoh_mem_interface mem;
+    void (*cart_event)(void *instance); // gets mem.instance, NULL for boards without events
+
+    // $8000-$FFFF in 4K pages when reads there are plain ROM, boards keep these
+    // up to date. NULL for anything else, blocks only run with them.
+    const uint8_t *prg_pages[8];
+    struct block_cache *blocks; // host side like mem, NULL runs everything interpreted
 };
 
 struct system_frame_result
 {
     uint8_t screen[240*256];
+    uint8_t line_mask[240];
 };
 
 struct system system_init(struct mux_api apu_mux, struct ricoh_mem_interface mem);
 uint16_t system_get_vector(struct system *system, enum vector vec);
 void system_update_controller(struct system *system, struct controller_state cs);
-void system_generate_samples(struct system *system, uint16_t *samples, uint32_t count);
+void system_set_sample_rate(struct system *system, uint32_t rate);
+void system_set_audio_ring(struct system *system, struct sample_ring *ring, bool rate_control);
+void system_set_audio_writer(struct system *system, struct apu_writer writer, bool stems);
+void system_schedule(struct system *system, enum system_event event, uint64_t at);
+bool system_call(struct system *system, uint16_t addr, uint64_t max_cycles);
+void system_idle(struct system *system, uint64_t until);
+void system_flush_audio(struct system *system);
 uint8_t system_mem_read(struct system *system, uint16_t addr);
 void system_mem_write(struct system *system, uint16_t addr, uint8_t val);
 uint8_t system_load(uint8_t *ines, struct system *out);
 struct ricoh_mem_interface system_get_memory_interface(struct system *system);
 struct system_frame_result system_frame(struct system *system);
 void system_reset(struct system *system);
+void system_load_state(struct system *system, const struct system *state);
+
+// BLOCK.H
+
+// Straight line runs of 6502 code translated once and run without decoding,
+// see block.c
+#define BLOCK_CACHE_BITS 12
+#define BLOCK_CACHE_LEN (1 << BLOCK_CACHE_BITS)
+// Code in RAM is rare, every player keeps a few of its own
+#define BLOCK_RAM_BITS 8
+#define BLOCK_RAM_LEN (1 << BLOCK_RAM_BITS)
+// ROM blocks a player shares with its forks, the table never gets more than 3/4 full
+#define BLOCK_SHARED_BITS 15
+#define BLOCK_SHARED_MAX (3 << (BLOCK_SHARED_BITS - 2))
+#define BLOCK_CHUNK_LEN 1024
+#define BLOCK_MAX_OPS 16
+#define BLOCK_MAX_BYTES 64
+
+// Pairs that get one op, the rest are enum instr
+enum block_fused
+{
+    BLOCK_LDA_STA = _ICOUNT + 1,
+    BLOCK_DEX_BNE,
+    BLOCK_DEY_BNE,
+    BLOCK_INC_BNE,
+};
+
+struct block_op
+{
+    uint8_t kind; // enum instr or enum block_fused
+    uint8_t mode; // enum addr_mode, of the load for BLOCK_LDA_STA
+    uint8_t cycles; // without page crossings or taken branches, both for pairs
+    uint8_t size; // bytes, both for pairs
+    uint16_t operand; // immediate, zero page or absolute address
+    uint16_t target; // where a branch goes or a pair stores
+};
+
+struct block
+{
+    const uint8_t *code; // host memory the block came from, NULL when the slot is empty
+    uint16_t pc;
+    uint8_t op_count; // 0 when the first instruction has to be interpreted
+    uint8_t len; // bytes of code
+    uint16_t budget; // most cycles all but the last op can take
+    bool in_ram; // checked against bytes before every run
+    bool jit_refused; // has ops the JIT doesn't do, or is in RAM
+    bool jit_pending; // compiled, waiting for its page to turn executable
+    uint32_t runs; // only counted while the JIT might still take it
+    int (*native)(struct system *system); // compiled by jit.c once hot, NULL before
+    uint8_t bytes[BLOCK_MAX_BYTES];
+    struct block_op ops[BLOCK_MAX_OPS];
+};
+
+// ROM blocks of a player and all its forks. They're found by where the code
+// is in the ROM the forks share, so one translation and one compile do for all.
+struct block_shared
+{
+    volatile uint32_t refs;
+    volatile uint32_t lock; // taken to add a block, lookups go without
+    volatile uint32_t slots[1 << BLOCK_SHARED_BITS]; // index of the block + 1, 0 is empty
+    struct block *chunks[BLOCK_SHARED_MAX / BLOCK_CHUNK_LEN];
+    uint32_t count;
+    struct jit *jit; // made by the first player that turns it on
+};
+
+struct block_cache
+{
+    struct block_shared *shared;
+    struct block *rom[BLOCK_CACHE_LEN]; // shared blocks this player ran lately
+    struct block *ram; // BLOCK_RAM_LEN of them, and ROM ones once the shared table is full. Made when first needed
+    uint64_t translated;
+    uint64_t evicted;
+    struct jit *jit; // shared->jit while this player uses it, NULL keeps every block in block_run
+};
+
+struct block_cache *block_cache_new();
+struct block_cache *block_cache_fork(struct block_cache *cache);
+void block_cache_free(struct block_cache *cache);
+bool block_cache_set_jit(struct block_cache *cache, bool enabled);
+int block_run(struct block_cache *cache, struct system *system, uint64_t horizon);
+
+// JIT.H
+
+// Hot ROM blocks compiled to x86-64, see jit.c. Anywhere else jit_new fails
+// and blocks run as they are.
+#define JIT_ARENA_SIZE (1 << 20)
+#define JIT_HOT_RUNS 16
+// Compiled blocks that can wait for their page, and how many runs of them
+// before a part filled page gets made executable anyway
+#define JIT_MAX_PENDING 64
+#define JIT_SEAL_ASKS 256
+
+struct jit_pending
+{
+    struct block *block;
+    size_t entry;
+    size_t end;
+};
+
+struct jit
+{
+    uint8_t *arena; // starts with the epilogue all blocks share
+    size_t sealed; // RX up to here, RW after
+    size_t used;
+    volatile uint32_t lock;
+    uint32_t hot; // runs before a block gets compiled
+    uint32_t asks; // runs of pending blocks since the last seal
+    uint32_t pending_count;
+    struct jit_pending pending[JIT_MAX_PENDING];
+    uint64_t compiled;
+    uint64_t refused;
+};
+
+struct jit *jit_new(uint32_t hot);
+void jit_free(struct jit *jit);
+bool jit_compile(struct jit *jit, struct block *block, bool alone);
+
+// VIDEO.H
+
+// 64 colors for each of the 8 PPUMASK emphasis combinations
+#define VIDEO_LUT_LEN (64*8)
+
+struct video_lut
+{
+    bool is_valid;
+    uint32_t source[64];
+    uint32_t rgba[VIDEO_LUT_LEN];
+#if defined(__x86_64__) || defined(_M_X64)
+    bool avx2; // cpuid said so when the LUT was built
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    // Same colors split into byte planes for tbl lookups
+    uint8_t planes[8][4][64];
+#endif
+};
+
+extern const uint32_t video_palette[64];
+
+bool video_lut_update(struct video_lut *lut, const uint32_t *source);
+const char *video_convert_simd(const struct video_lut *lut); // "avx2", "neon" or "none"
+void video_convert_line(const struct video_lut *lut, uint32_t *dest, const uint8_t *line, uint8_t mask);
+void video_convert_line_scalar(const struct video_lut *lut, uint32_t *dest, const uint8_t *line, uint8_t mask);
+void video_convert_frame(const struct video_lut *lut, uint32_t *dest, int pitch, struct system_frame_result *result);
+uint64_t video_frame_hash(struct system_frame_result *result);
+
+// VIDREC.H
+
+// Frames the writer can fall behind by, about 130ms of video
+#define VIDREC_QUEUE_LEN 8
+
+enum vidrec_format
+{
+    VIDREC_INDEXED, // palette indices + PPUMASK per line, the .nesv format
+    VIDREC_Y4M,
+};
+
+struct vidrec_slot
+{
+    bool repeat; // same as the frame before, nothing copied
+    uint8_t line_mask[240];
+    uint8_t screen[240*256];
+};
+
+struct video_recorder
+{
+    FILE *fp;
+    enum vidrec_format format;
+    bool lossless;
+
+    // Y4M only, writer thread only
+    uint8_t yuv_lut[VIDEO_LUT_LEN][3];
+    uint8_t *planes;
+
+    // Single producer single consumer, the writer owns slots between read_at and write_at
+    struct vidrec_slot *slots;
+    volatile uint32_t write_at;
+    volatile uint32_t read_at;
+    volatile uint32_t stop;
+
+    uint64_t last_hash;
+    struct vidrec_slot last; // the frame last queued with pixels, what repeats get checked against
+    uint64_t frames;
+    uint64_t repeats;
+    uint32_t dropped;
+
+    struct thread *thread;
+    struct thread_signal *ready;
+    struct thread_signal *space;
+};
+
+struct video_recorder *video_recorder_start(const char *path, enum vidrec_format format, bool lossless);
+void video_recorder_push(struct video_recorder *recorder, struct system_frame_result *frame);
+void video_recorder_stop(struct video_recorder *recorder);
+bool video_capture_to_y4m(const char *in_path, const char *out_path);
+
+// CHRCACHE.H
+
+// Both pattern tables, 256 tiles each
+#define CHR_CACHE_TILES 512
+
+struct chr_cache
+{
+    uint8_t pixels[CHR_CACHE_TILES][64]; // 2 bit color per pixel
+    const uint8_t *slots[8]; // what each 1K slot was decoded from
+    bool valid;
+    uint32_t decoded; // tiles the last update decoded
+};
+
+void chr_cache_update(struct chr_cache *cache, struct ppu *ppu);
+void chr_cache_draw(struct chr_cache *cache, struct ppu *ppu, uint8_t palette, struct system_frame_result *out);
+
+// PACER.H
+
+#define PACER_NTSC_HZ (1789773.0/29780.5)
+
+// Frames we are willing to run back to back before dropping the backlog
+#define PACER_MAX_CATCHUP 4
+
+struct pacer_stats
+{
+    uint64_t frames_emulated;
+    uint64_t frames_dropped;  // emulated but never presented
+    uint64_t frames_repeated; // presented without a new frame
+    uint64_t frames_skipped;  // never emulated, backlog was dropped
+    uint64_t intervals;
+    double interval_min;
+    double interval_max;
+    double jitter_mean;
+    double jitter_stddev;
+    double jitter_max;
+};
+
+struct pacer
+{
+    double frame_period;
+    double accumulator;
+    uint64_t tick_freq;
+    uint64_t last_tick;
+    uint64_t last_present;
+    bool has_presented;
+    double jitter_m2;
+    struct pacer_stats stats;
+};
+
+void pacer_init(struct pacer *pacer, double rate_hz, uint64_t tick_freq, uint64_t now);
+int pacer_frames_due(struct pacer *pacer, uint64_t now);
+double pacer_time_until_due(struct pacer *pacer, uint64_t now);
+void pacer_frame_presented(struct pacer *pacer, uint64_t now, int frames_emulated);
+void pacer_reset_stats(struct pacer *pacer);
+
+// ROMFILE.H
+
+struct rom_file
+{
+    uint8_t *data; // read only
+    size_t size;
+};
+
+bool rom_file_open(const char *path, struct rom_file *out);
+void rom_file_close(struct rom_file *file);
+
+// ROMDB.H
+
+// Known dumps with bad or missing headers, keyed by the CRC32 of everything after the header
+struct romdb_entry
+{
+    uint32_t crc;
+    uint8_t header[16]; // what the header should have been, NES 2.0
+    const char *name;
+};
+
+uint32_t romdb_crc32(const uint8_t *data, size_t size);
+const struct romdb_entry *romdb_lookup(uint32_t crc);
 
 // PLAYER.H
 
+// Slices of the ROM image, never copied
 struct mapper_rom
 {
     size_t prg_size;
     size_t chr_size;
-    uint8_t *prg;
-    uint8_t *chr;
+    const uint8_t *prg;
+    const uint8_t *chr;
+};
+
+enum rom_timing
+{
+    ROM_TIMING_NTSC,
+    ROM_TIMING_PAL,
+    ROM_TIMING_MULTI,
+    ROM_TIMING_DENDY,
 };
 
 struct mapper_data
 {
     bool is_valid;
+    bool is_nes2;
+    bool from_db; // header came from the ROM database
     uint8_t *ines;
-    uint8_t prg_banks;
-    uint8_t chr_banks;
-    uint8_t mapper_number;
+    size_t size;
+    uint32_t crc; // everything after the header
+    uint16_t prg_banks;
+    uint16_t chr_banks;
+    uint16_t mapper_number;
+    uint8_t submapper;
+    size_t prg_offset; // past the header and trainer
     size_t prg_size;
     size_t chr_size;
+    // RAM the board has, iNES 1.0 files get 8K PRG-RAM and 8K CHR-RAM without CHR-ROM
+    size_t prg_ram_size;
+    size_t prg_nvram_size;
+    size_t chr_ram_size;
+    size_t chr_nvram_size;
+    bool has_battery;
+    bool has_trainer;
     enum ppu_mir mirroring;
+    enum rom_timing timing;
 };
 
-struct mapper_data mapper_get_data(uint8_t *ines);
-struct mapper_rom mapper_rom_copy(struct mapper_data *data);
-void mapper_rom_free(struct mapper_rom *rom);
+struct mapper_data mapper_get_data(uint8_t *ines, size_t size);
+struct mapper_rom mapper_rom_view(struct mapper_data *data);
 
 struct mapper_vtbl
 {
     void* (*new)(struct mapper_data data, struct mux_api apu_mux);
     void (*free)(void *mapper_data);
     struct system_frame_result (*frame)(void *mapper_data);
-    void (*generate_samples)(void *mapper_data, uint16_t *samples, uint32_t count);
     void (*reset)(void *mapper_data);
     bool (*crash)(void *mapper_data);
     void (*set_controller)(void *mapper_data, struct controller_state controller);
     struct system *(*get_system)(void *mapper_data);
+    // Optional, only for things with more than one song
+    int (*track_count)(void *mapper_data);
+    void (*select_track)(void *mapper_data, int track);
+    // Optional, a state is the whole mapper struct, loading keeps the ROM and host side
+    size_t state_size;
+    void (*load_state)(void *mapper_data, const void *state);
 };
 
 struct player
@@ -440,35 +983,203 @@ struct player
     bool is_valid;
     void *mapper_data;
     struct mapper_vtbl *vtbl;
+    volatile uint32_t *rom_refs; // forks of one player, the last one frees what the mapper owns. NULL until the first fork
+    size_t save_size; // battery backed PRG-RAM at $6000, 0 without a battery
 };
 
-struct player player_init(uint8_t *ines, struct mux_api apu_mux);
+struct player player_init(uint8_t *ines, size_t size, struct mux_api apu_mux);
 void player_free(struct player *player);
 void player_reset(struct player *player);
 void player_set_controller(struct player *player, struct controller_state controller);
 struct system_frame_result player_frame(struct player *player);
-void player_generate_samples(struct player *player, uint16_t *samples, uint32_t count);
+void player_set_sample_rate(struct player *player, uint32_t rate);
+void player_set_audio_ring(struct player *player, struct sample_ring *ring, bool rate_control);
+void player_set_audio_writer(struct player *player, struct apu_writer writer, bool stems);
 bool player_crash(struct player *player);
 struct system *player_get_system(struct player *player);
+int player_track_count(struct player *player);
+void player_select_track(struct player *player, int track);
+size_t player_state_size(struct player *player);
+bool player_save_state(struct player *player, void *out);
+bool player_load_state(struct player *player, const void *state);
+struct player player_fork(struct player *player);
+void player_set_blocks(struct player *player, bool enabled);
+bool player_set_jit(struct player *player, bool enabled);
+
+// SAVEFILE.H
+
+// A crash or power cut loses at most this much play
+#define SAVE_FILE_FLUSH_MS 2000
+#define SAVE_FILE_PAGE_LEN 0x1000
+
+struct save_file
+{
+    uint8_t *data; // the mapped .sav
+    size_t size;
+    uint8_t *ram; // where the game sees it, system memory from $6000
+    void *file; // Windows only, flushing the view needs the handle too
+    volatile uint32_t dirty; // pages copied into data that aren't on disk yet
+    volatile uint32_t stop;
+    struct thread *thread;
+    struct thread_signal *wake;
+};
 
-// NROM.H
+struct save_file *save_file_open(struct player *player, const char *rom_path);
+void save_file_sync(struct save_file *save);
+void save_file_close(struct save_file *save);
 
-struct nrom
+// MOVIE.H
+
+// Ten seconds, a seek re-emulates at most this many frames
+#define MOVIE_DEFAULT_KEYFRAME_INTERVAL 600
+
+#define MOVIE_FLAG_RESET (1 << 0)
+
+struct movie_frame
 {
-    bool is_mirrored;
-    uint8_t *rom;
-    struct system system;
+    uint8_t buttons; // bit n is enum controller_btn n
+    uint8_t flags;
+};
+
+struct movie
+{
+    struct movie_frame *frames;
+    uint32_t frame_count;
+    uint32_t frame_capacity;
+    uint32_t cursor; // next frame to run
+
+    // keyframes[i] is the state before frame i*keyframe_interval, NULL until that frame ran
+    uint32_t keyframe_interval;
+    size_t state_size;
+    uint8_t **keyframes;
+    uint32_t keyframe_capacity;
+};
+
+struct movie *movie_new(uint32_t keyframe_interval);
+void movie_free(struct movie *movie);
+struct system_frame_result movie_record_frame(struct movie *movie, struct player *player, struct controller_state controller, bool reset);
+bool movie_play_frame(struct movie *movie, struct player *player, struct system_frame_result *out);
+bool movie_seek(struct movie *movie, struct player *player, uint32_t frame);
+bool movie_save(struct movie *movie, const char *path);
+struct movie *movie_load(const char *path);
+struct movie *movie_import_fm2(const char *path, uint32_t keyframe_interval);
+
+// BATCH.H
+
+struct player_batch
+{
+    int count;
+    struct player *players;
+    struct thread_pool *pool;
+    uint8_t *start_state;
+    const struct controller_state *inputs; // only during a step
+
+    int obs_scale;
+    int obs_width;
+    int obs_height;
+    uint8_t luma[VIDEO_LUT_LEN];
+    int probe_count;
+    uint16_t *probes; // CPU addresses sampled after every step
+
+    // One row per instance
+    uint8_t *observations; // obs_width*obs_height grayscale
+    uint8_t *probe_values; // probe_count bytes
+    uint8_t *crashed;
+};
+
+struct player_batch *player_batch_new(struct player *source, int count, int obs_scale, const uint16_t *probes, int probe_count, struct thread_pool *pool);
+void player_batch_free(struct player_batch *batch);
+void players_step(struct player_batch *batch, const struct controller_state *inputs);
+void player_batch_restart(struct player_batch *batch, int index);
+
+// RTC.H
+
+enum rtc_level
+{
+    RTC_OFF,
+    RTC_LOW,  // nudges a byte by one
+    RTC_HIGH, // replaces a byte
 };
 
-extern struct mapper_vtbl nrom_vtbl;
-void* nrom_new(struct mapper_data data, struct mux_api apu_mux);
-void nrom_free(void *mapper_data);
-struct system_frame_result nrom_frame(void *mapper_data);
-void nrom_generate_samples(void *mapper_data, uint16_t *samples, uint32_t count);
-void nrom_reset(void *mapper_data);
-bool nrom_crash(void *mapper_data);
-void nrom_set_controller(void *mapper_data, struct controller_state controller);
-struct system *nrom_get_system(void *mapper_data);
+enum rtc_target
+{
+    RTC_TARGET_RAM     = 1 << 0, // $0000-$1FFF without the stack page
+    RTC_TARGET_PRG_RAM = 1 << 1, // $6000-$7FFF
+    RTC_TARGET_VRAM    = 1 << 2,
+    RTC_TARGET_OAM     = 1 << 3,
+};
+
+struct rtc_state
+{
+    enum rtc_level level;
+    int frames_since_last_pulse;
+    uint32_t targets;
+    uint64_t rng;
+};
+
+enum rtc_rank
+{
+    RTC_RANK_DIFF,  // most different from the uncorrupted run first
+    RTC_RANK_CRASH, // earliest crash first, then by difference
+};
+
+struct rtc_explore_options
+{
+    enum rtc_level level;
+    uint32_t targets;
+    uint64_t first_seed; // seeds are first_seed, first_seed+1, ...
+    uint32_t seeds;
+    uint32_t frames;
+    enum rtc_rank rank;
+};
+
+struct rtc_result
+{
+    uint64_t seed;
+    uint32_t frames_run;
+    bool crashed;
+    double difference; // share of sampled pixels unlike the uncorrupted run, 0..1
+    double rank_key;
+};
+
+struct rtc_state rtc_make(enum rtc_level level, uint32_t targets, uint64_t seed);
+void rtc_iter(struct rtc_state *rtc, struct system *sys);
+struct rtc_result rtc_run_seed(struct player *source, struct rtc_explore_options *options, uint64_t seed, const uint8_t *reference, struct video_recorder *capture);
+bool rtc_explore(struct player *source, struct rtc_explore_options *options, struct rtc_result *results, struct thread_pool *pool);
+
+// CART.H
+
+// Cartridges on a shared bus: $8000-$FFFF reads go straight through the PRG
+// table and the PPU reads CHR-ROM through its own table, the board's code
+// only runs when something writes to its registers
+#define CART_PRG_SLOTS 8 // 4K each from $8000
+#define CART_PRG_SLOT_LEN 0x1000
+#define CART_CHR_SLOT_LEN 0x400
+
+struct cart;
+
+struct cart_board
+{
+    uint16_t mapper_number;
+    const char *name;
+    uint16_t write_start; // writes from here up go to write, below to the system
+    // Checks the ROM fits the board and sets the power on registers
+    bool (*init)(struct cart *cart, struct mapper_data *data);
+    void (*write)(struct cart *cart, uint16_t addr, uint8_t val);
+    // Bank tables and mirroring from the registers, after writes and state loads
+    void (*sync)(struct cart *cart);
+    // Optional, for boards that do something on reset
+    void (*reset)(struct cart *cart);
+    // Optional, SYSTEM_EVENT_CART fired
+    void (*event)(struct cart *cart);
+    // Optional, after writes to PPUCTRL and PPUMASK and after resets, for boards
+    // that predict what the PPU will do
+    void (*ppu_changed)(struct cart *cart);
+};
+
+// NROM.H
+
+extern const struct cart_board nrom_board;
 
 // MMC1.H
 
@@ -482,8 +1193,6 @@ struct shift_register_result
 
 struct mmc1
 {
-    struct mapper_rom rom;
-    struct system system;
     shift_register shift_register;
     uint8_t reg_ctrl;
     uint8_t reg_prg_bank;
@@ -491,93 +1200,139 @@ struct mmc1
     uint8_t reg_chr_bank_2;
 };
 
-extern struct mapper_vtbl mmc1_vtbl;
-void* mmc1_new(struct mapper_data data, struct mux_api apu_mux);
-void mmc1_free(void *mapper_data);
-struct system_frame_result mmc1_frame(void *mapper_data);
-void mmc1_generate_samples(void *mapper_data, uint16_t *samples, uint32_t count);
-void mmc1_reset(void *mapper_data);
-bool mmc1_crash(void *mapper_data);
-void mmc1_set_controller(void *mapper_data, struct controller_state controller);
-struct system *mmc1_get_system(void *mapper_data);
+extern const struct cart_board mmc1_board;
 
 // UNROM.H
 
 struct unrom
 {
-    struct mapper_rom rom;
-    struct system system;
     uint8_t prg_select;
 };
 
-extern struct mapper_vtbl unrom_vtbl;
-void* unrom_new(struct mapper_data data, struct mux_api apu_mux);
-void unrom_free(void *mapper_data);
-struct system_frame_result unrom_frame(void *mapper_data);
-void unrom_generate_samples(void *mapper_data, uint16_t *samples, uint32_t count);
-void unrom_reset(void *mapper_data);
-bool unrom_crash(void *mapper_data);
-void unrom_set_controller(void *mapper_data, struct controller_state controller);
-struct system *unrom_get_system(void *mapper_data);
+extern const struct cart_board unrom_board;
 
 // M228.H -- MAKE YOUR SELECTION, NOW!
 
 struct m228
 {
-    struct mapper_rom rom;
-    struct system system;
     uint8_t reg_data;
     uint16_t reg_addr;
     uint8_t serial_id;
 };
 
-extern struct mapper_vtbl m228_vtbl;
-void* m228_new(struct mapper_data data, struct mux_api apu_mux);
-void m228_free(void *mapper_data);
-struct system_frame_result m228_frame(void *mapper_data);
-void m228_generate_samples(void *mapper_data, uint16_t *samples, uint32_t count);
-void m228_reset(void *mapper_data);
-bool m228_crash(void *mapper_data);
-void m228_set_controller(void *mapper_data, struct controller_state controller);
-struct system *m228_get_system(void *mapper_data);
+extern const struct cart_board m228_board;
 
 // CNROM.H
 
 struct cnrom
 {
-    struct mapper_rom rom;
-    struct system system;
     uint8_t chr_bank;
 };
 
-extern struct mapper_vtbl cnrom_vtbl;
-void* cnrom_new(struct mapper_data data, struct mux_api apu_mux);
-void cnrom_free(void *mapper_data);
-struct system_frame_result cnrom_frame(void *mapper_data);
-void cnrom_generate_samples(void *mapper_data, uint16_t *samples, uint32_t count);
-void cnrom_reset(void *mapper_data);
-bool cnrom_crash(void *mapper_data);
-void cnrom_set_controller(void *mapper_data, struct controller_state controller);
-struct system *cnrom_get_system(void *mapper_data);
+extern const struct cart_board cnrom_board;
 
 // AXROM.H
 
 struct axrom
 {
+    uint8_t prg_bank;
+    bool second_screen;
+};
+
+extern const struct cart_board axrom_board;
+
+// MMC3.H
+
+struct mmc3
+{
+    uint8_t bank_select;
+    uint8_t banks[8]; // R0-R7
+    uint8_t mirroring;
+    uint8_t prg_ram; // $A001, bit 7 enables, bit 6 protects
+    bool four_screen;
+
+    uint8_t irq_latch;
+    uint8_t irq_counter;
+    bool irq_reload;
+    bool irq_enabled;
+    uint64_t irq_clock_at; // PPU cycle of the next A12 rise, UINT64_MAX when rendering is off
+};
+
+extern const struct cart_board mmc3_board;
+
+// CART.H, the part that needs the boards
+
+struct cart
+{
+    struct system system; // system.prg_pages are the PRG slots, never NULL, into rom.prg
     struct mapper_rom rom;
+    const struct cart_board *board;
+    union
+    {
+        struct mmc1 mmc1;
+        struct unrom unrom;
+        struct m228 m228;
+        struct cnrom cnrom;
+        struct axrom axrom;
+        struct mmc3 mmc3;
+    } regs;
+};
+
+extern struct mapper_vtbl cart_vtbl;
+const struct cart_board *cart_find_board(uint16_t mapper_number);
+void cart_map_prg(struct cart *cart, uint16_t addr, size_t size, int bank);
+void cart_map_chr(struct cart *cart, uint16_t addr, size_t size, int bank);
+void* cart_new(struct mapper_data data, struct mux_api apu_mux);
+void cart_free(void *mapper_data);
+struct system_frame_result cart_frame(void *mapper_data);
+void cart_reset(void *mapper_data);
+bool cart_crash(void *mapper_data);
+void cart_set_controller(void *mapper_data, struct controller_state controller);
+struct system *cart_get_system(void *mapper_data);
+void cart_load_state(void *mapper_data, const void *state);
+
+// NSF.H
+
+#define NSF_HEADER_LEN 0x80
+#define NSF_BANK_LEN 0x1000
+// INIT gets a couple of seconds, some drivers decompress everything up front
+#define NSF_INIT_MAX_CYCLES (1789773*2)
+
+struct nsf
+{
+    uint8_t track_count;
+    uint8_t start_track;
+    uint8_t track;
+    uint16_t load_addr;
+    uint16_t init_addr;
+    uint16_t play_addr;
+    char title[33];
+    char artist[33];
+    char copyright[33];
+
+    double play_period; // CPU cycles between PLAY calls
+    double next_play;
+    double frame_end;
+
+    uint8_t bank_init[8];
+    uint8_t banks[8]; // 4K bank at $8000 + i*$1000
+    uint32_t bank_count;
+    uint8_t *rom;
+
     struct system system;
-    uint8_t prg_bank;
 };
 
-extern struct mapper_vtbl axrom_vtbl;
-void* axrom_new(struct mapper_data data, struct mux_api apu_mux);
-void axrom_free(void *mapper_data);
-struct system_frame_result axrom_frame(void *mapper_data);
-void axrom_generate_samples(void *mapper_data, uint16_t *samples, uint32_t count);
-void axrom_reset(void *mapper_data);
-bool axrom_crash(void *mapper_data);
-void axrom_set_controller(void *mapper_data, struct controller_state controller);
-struct system *axrom_get_system(void *mapper_data);
+extern struct mapper_vtbl nsf_vtbl;
+bool nsf_check(uint8_t *data, size_t size);
+void* nsf_new(struct mapper_data data, struct mux_api apu_mux);
+void nsf_free(void *mapper_data);
+struct system_frame_result nsf_frame(void *mapper_data);
+void nsf_reset(void *mapper_data);
+bool nsf_crash(void *mapper_data);
+void nsf_set_controller(void *mapper_data, struct controller_state controller);
+struct system *nsf_get_system(void *mapper_data);
+int nsf_track_count(void *mapper_data);
+void nsf_select_track(void *mapper_data, int track);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,91 @@
+#include "neske.h"
+#include <math.h>
+
+void pacer_init(struct pacer *pacer, double rate_hz, uint64_t tick_freq, uint64_t now)
+{
+    *pacer = (struct pacer){ 0 };
+    pacer->frame_period = 1.0/rate_hz;
+    pacer->tick_freq = tick_freq;
+    pacer->last_tick = now;
+    pacer_reset_stats(pacer);
+}
+
+int pacer_frames_due(struct pacer *pacer, uint64_t now)
+{
+    double elapsed = (double)(now - pacer->last_tick)/pacer->tick_freq;
+    pacer->last_tick = now;
+    pacer->accumulator += elapsed;
+
+    double period = pacer->frame_period;
+
+    // After a stall (window drag, file dialog) don't try to catch up, just drop the backlog
+    if (pacer->accumulator > period*PACER_MAX_CATCHUP)
+    {
+        pacer->stats.frames_skipped += (uint64_t)(pacer->accumulator/period) - PACER_MAX_CATCHUP;
+        pacer->accumulator = period*PACER_MAX_CATCHUP;
+    }
+
+    int frames = 0;
+
+    while (pacer->accumulator >= period)
+    {
+        pacer->accumulator -= period;
+        frames++;
+    }
+
+    return frames;
+}
+
+double pacer_time_until_due(struct pacer *pacer, uint64_t now)
+{
+    double elapsed = (double)(now - pacer->last_tick)/pacer->tick_freq;
+    double remaining = pacer->frame_period - pacer->accumulator - elapsed;
+    return remaining > 0 ? remaining : 0;
+}
+
+void pacer_frame_presented(struct pacer *pacer, uint64_t now, int frames_emulated)
+{
+    struct pacer_stats *stats = &pacer->stats;
+
+    stats->frames_emulated += frames_emulated;
+
+    if (frames_emulated == 0)
+    {
+        stats->frames_repeated++;
+        return;
+    }
+
+    if (frames_emulated > 1)
+    {
+        stats->frames_dropped += frames_emulated-1;
+    }
+
+    if (pacer->has_presented)
+    {
+        // Jitter is how far each new frame landed from where the ideal NTSC frame would be
+        double interval = (double)(now - pacer->last_present)/pacer->tick_freq;
+        double deviation = interval - frames_emulated*pacer->frame_period;
+
+        stats->intervals++;
+        if (interval < stats->interval_min) stats->interval_min = interval;
+        if (interval > stats->interval_max) stats->interval_max = interval;
+
+        // Welford's running variance
+        double delta = deviation - stats->jitter_mean;
+        stats->jitter_mean += delta/stats->intervals;
+        pacer->jitter_m2 += delta*(deviation - stats->jitter_mean);
+        stats->jitter_stddev = stats->intervals > 1 ? sqrt(pacer->jitter_m2/(stats->intervals-1)) : 0;
+
+        if (fabs(deviation) > stats->jitter_max) stats->jitter_max = fabs(deviation);
+    }
+
+    pacer->last_present = now;
+    pacer->has_presented = true;
+}
+
+void pacer_reset_stats(struct pacer *pacer)
+{
+    pacer->stats = (struct pacer_stats){ 0 };
+    pacer->stats.interval_min = INFINITY;
+    pacer->jitter_m2 = 0;
+}
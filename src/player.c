@@ -4,71 +4,151 @@
 #include <string.h>
 #include <assert.h>
 
-struct mapper_data mapper_get_data(uint8_t *ines)
+// NES 2.0 sizes are either a bank count or, with the high nibble all ones, 2^E*(M*2+1)
+static size_t _mapper_rom_size(uint8_t lsb, uint8_t msb, size_t unit)
 {
-    struct mapper_data data = { 0 };
+    if (msb == 0xF)
+    {
+        int exponent = lsb >> 2;
+        return exponent > 30 ? SIZE_MAX : ((size_t)1 << exponent)*((lsb & 3)*2 + 1);
+    }
+
+    return (((size_t)msb << 8) | lsb)*unit;
+}
 
-    if (!(ines[0] == 'N' && ines[1] == 'E' && ines[2] == 'S' && ines[3] == 0x1A))
+static size_t _mapper_ram_size(uint8_t shift)
+{
+    return shift ? (size_t)64 << shift : 0;
+}
+
+static void _mapper_parse_header(const uint8_t *header, struct mapper_data *data)
+{
+    data->is_nes2 = (header[7] & 0x0C) == 0x08;
+    data->has_battery = header[6] & 2;
+    data->has_trainer = header[6] & 4;
+    data->prg_offset = 16 + (data->has_trainer ? 512 : 0);
+
+    if (header[6] & 8)
     {
-        return data;
+        data->mirroring = PPUMIR_FOUR;
+    }
+    else
+    {
+        data->mirroring = (header[6] & 1) ? PPUMIR_VER : PPUMIR_HOR;
     }
-    
-    data.is_valid = true;
-    data.ines = ines;
 
-    data.prg_banks = ines[4];
-    data.chr_banks = ines[5];
-    data.prg_size = data.prg_banks*0x4000;
-    data.chr_size = data.chr_banks*0x2000;
-    data.mapper_number = (ines[6] >> 4) | (ines[7] & 0xF0);
-    data.mirroring = (ines[6] & 1) ? PPUMIR_VER : PPUMIR_HOR;
+    if (data->is_nes2)
+    {
+        data->mapper_number = (header[6] >> 4) | (header[7] & 0xF0) | ((header[8] & 0x0F) << 8);
+        data->submapper = header[8] >> 4;
+        data->prg_size = _mapper_rom_size(header[4], header[9] & 0x0F, 0x4000);
+        data->chr_size = _mapper_rom_size(header[5], header[9] >> 4, 0x2000);
+        data->prg_ram_size = _mapper_ram_size(header[10] & 0x0F);
+        data->prg_nvram_size = _mapper_ram_size(header[10] >> 4);
+        data->chr_ram_size = _mapper_ram_size(header[11] & 0x0F);
+        data->chr_nvram_size = _mapper_ram_size(header[11] >> 4);
+        data->timing = header[12] & 3;
+    }
+    else
+    {
+        // Old dumping tools left their name in bytes 7-15, the high nibble is junk then
+        bool has_junk = header[12] || header[13] || header[14] || header[15];
 
-    printf("Mapper number: %d\n", data.mapper_number);
+        data->mapper_number = (header[6] >> 4) | (has_junk ? 0 : header[7] & 0xF0);
+        data->prg_size = header[4]*0x4000;
+        data->chr_size = header[5]*0x2000;
+        data->prg_ram_size = 0x2000;
+        data->chr_ram_size = data->chr_size ? 0 : 0x2000;
+        data->timing = !has_junk && (header[9] & 1) ? ROM_TIMING_PAL : ROM_TIMING_NTSC;
 
-    assert(data.prg_size != 0);
+        if (data->has_battery)
+        {
+            data->prg_nvram_size = data->prg_ram_size;
+            data->prg_ram_size = 0;
+        }
+    }
 
-    return data;
+    data->prg_banks = data->prg_size/0x4000;
+    data->chr_banks = data->chr_size/0x2000;
 }
 
-struct mapper_rom mapper_rom_copy(struct mapper_data *data)
+struct mapper_data mapper_get_data(uint8_t *ines, size_t size)
 {
-    uint8_t *data_copy = malloc(data->prg_size+data->chr_size);
-    if (!data_copy)
+    struct mapper_data data = { 0 };
+
+    if (size < 16 || !(ines[0] == 'N' && ines[1] == 'E' && ines[2] == 'S' && ines[3] == 0x1A))
     {
-        return (struct mapper_rom){ 0 };
+        return data;
     }
+    
+    data.is_valid = true;
+    data.ines = ines;
+    data.size = size;
+    data.crc = romdb_crc32(ines+16, size-16);
+
+    // Known dumps get the header they should have had
+    const struct romdb_entry *known = romdb_lookup(data.crc);
+    data.from_db = known != NULL;
+    _mapper_parse_header(known ? known->header : ines, &data);
 
-    memcpy(data_copy, data->ines+16, data->prg_size+data->chr_size);
+    printf("Mapper number: %d.%d%s, CRC32 %08X%s\n", data.mapper_number, data.submapper,
+        data.is_nes2 ? " (NES 2.0)" : "", data.crc, known ? ", header from the database" : "");
+
+    if (data.prg_size == 0 || data.prg_size == SIZE_MAX || data.chr_size == SIZE_MAX)
+    {
+        printf("ROM header has no usable PRG size\n");
+        data.is_valid = false;
+    }
+    else if (data.prg_offset + data.prg_size + data.chr_size > size)
+    {
+        printf("ROM is truncated, header wants %zu bytes but file has %zu\n", data.prg_offset + data.prg_size + data.chr_size, size);
+        data.is_valid = false;
+    }
 
-    return (struct mapper_rom){ data->prg_size, data->chr_size, data_copy, data_copy+data->prg_size };
+    return data;
 }
 
-void mapper_rom_free(struct mapper_rom *rom)
+// Mappers read PRG and CHR in place, the image has to outlive the player
+struct mapper_rom mapper_rom_view(struct mapper_data *data)
 {
-    free(rom->prg);
+    return (struct mapper_rom){ data->prg_size, data->chr_size, data->ines+data->prg_offset, data->ines+data->prg_offset+data->prg_size };
 }
 
-struct player player_init(uint8_t *ines, struct mux_api apu_mux)
+// ines has to stay around until the player is freed, see mapper_rom_view
+struct player player_init(uint8_t *ines, size_t size, struct mux_api apu_mux)
 {
     printf("player_init\n");
     struct player player = { 0 };
 
-    struct mapper_data data = mapper_get_data(ines);
+    struct mapper_data data = mapper_get_data(ines, size);
 
-    if (!data.is_valid)
+    if (nsf_check(ines, size))
+    {
+        data = (struct mapper_data){ .is_valid = true, .ines = ines, .size = size };
+        player.vtbl = &nsf_vtbl;
+    }
+    else if (!data.is_valid)
     {
         return player;
     }
+    else if (cart_find_board(data.mapper_number))
+    {
+        player.vtbl = &cart_vtbl;
+    }
+    else
+    {
+        printf("Mapper %d isn't supported\n", data.mapper_number);
+        return player;
+    }
 
-    switch (data.mapper_number)
+    if (data.timing == ROM_TIMING_PAL || data.timing == ROM_TIMING_DENDY)
     {
-        case 0: player.vtbl = &nrom_vtbl; break;
-        case 1: player.vtbl = &mmc1_vtbl; break;
-        case 2: player.vtbl = &unrom_vtbl; break;
-        case 3: player.vtbl = &cnrom_vtbl; break;
-        case 7: player.vtbl = &axrom_vtbl; break;
-        case 228: player.vtbl = &m228_vtbl; break;
-        default: return player;
+        printf("ROM is for PAL machines, it will run at NTSC speed\n");
+    }
+
+    if (data.prg_ram_size + data.prg_nvram_size > 0x2000 || data.chr_ram_size + data.chr_nvram_size > 0x2000)
+    {
+        printf("Board has more RAM than the 8K windows, the rest isn't there\n");
     }
 
     player.mapper_data = player.vtbl->new(data, apu_mux);
@@ -79,6 +159,19 @@ struct player player_init(uint8_t *ines, struct mux_api apu_mux)
     }
 
     player.is_valid = true;
+    player_set_blocks(&player, true);
+
+    // Only the 8K at $6000 is there to keep, see above
+    if (data.has_battery)
+    {
+        player.save_size = data.prg_nvram_size && data.prg_nvram_size < 0x2000 ? data.prg_nvram_size : 0x2000;
+    }
+
+    // Trainers get loaded to $7000 before the game starts
+    if (data.has_trainer)
+    {
+        memcpy(player_get_system(&player)->memory + 0x7000, ines+16, 512);
+    }
 
     printf("player_init done\n");
 
@@ -95,11 +188,46 @@ struct system_frame_result player_frame(struct player *player)
     return (struct system_frame_result){ 0 };
 }
 
-void player_generate_samples(struct player *player, uint16_t *samples, uint32_t count)
+void player_set_sample_rate(struct player *player, uint32_t rate)
 {
     if (player->is_valid)
     {
-        player->vtbl->generate_samples(player->mapper_data, samples, count);
+        system_set_sample_rate(player->vtbl->get_system(player->mapper_data), rate);
+    }
+}
+
+void player_set_audio_ring(struct player *player, struct sample_ring *ring, bool rate_control)
+{
+    if (player->is_valid)
+    {
+        system_set_audio_ring(player->vtbl->get_system(player->mapper_data), ring, rate_control);
+    }
+}
+
+void player_set_audio_writer(struct player *player, struct apu_writer writer, bool stems)
+{
+    if (player->is_valid)
+    {
+        system_set_audio_writer(player->vtbl->get_system(player->mapper_data), writer, stems);
+    }
+}
+
+// Cartridges have one "track", NSF files have however many songs are in them
+int player_track_count(struct player *player)
+{
+    if (player->is_valid && player->vtbl->track_count)
+    {
+        return player->vtbl->track_count(player->mapper_data);
+    }
+
+    return 1;
+}
+
+void player_select_track(struct player *player, int track)
+{
+    if (player->is_valid && player->vtbl->select_track)
+    {
+        player->vtbl->select_track(player->mapper_data, track);
     }
 }
 
@@ -125,7 +253,17 @@ void player_free(struct player *player)
 {
     if (player->is_valid)
     {
+        player_set_blocks(player, false);
         player->is_valid = false;
+
+        // Forks only own their mapper struct, the last one out frees the rest
+        if (player->rom_refs && atomic32_add(player->rom_refs, (uint32_t)-1) != 0)
+        {
+            free(player->mapper_data);
+            return;
+        }
+
+        free((void *)player->rom_refs);
         player->vtbl->free(player->mapper_data);
     }
 }
@@ -149,3 +287,140 @@ struct system *player_get_system(struct player *player)
 
     return NULL;
 }
+
+size_t player_state_size(struct player *player)
+{
+    if (player->is_valid && player->vtbl->load_state)
+    {
+        return player->vtbl->state_size;
+    }
+
+    return 0;
+}
+
+// out needs player_state_size bytes, the pointers in it mean nothing outside this run
+bool player_save_state(struct player *player, void *out)
+{
+    if (!player_state_size(player))
+    {
+        return false;
+    }
+
+    memcpy(out, player->mapper_data, player->vtbl->state_size);
+    return true;
+}
+
+bool player_load_state(struct player *player, const void *state)
+{
+    if (!player_state_size(player))
+    {
+        return false;
+    }
+
+    player->vtbl->load_state(player->mapper_data, state);
+    return true;
+}
+
+// A new player in the same state, sharing the ROM. Runs on its own from here,
+// without the parent's audio outputs. Any thread can step it, the players just
+// can't be forked and freed concurrently. A search that throws children away can
+// reset old ones with player_load_state(child, parent.mapper_data) instead, that
+// skips the allocation and is several times faster.
+struct player player_fork(struct player *player)
+{
+    size_t size = player_state_size(player);
+    if (!size)
+    {
+        return (struct player){ 0 };
+    }
+
+    if (!player->rom_refs)
+    {
+        player->rom_refs = malloc(sizeof *player->rom_refs);
+        if (!player->rom_refs)
+        {
+            return (struct player){ 0 };
+        }
+        *player->rom_refs = 1;
+    }
+
+    void *copy = malloc(size);
+    if (!copy)
+    {
+        return (struct player){ 0 };
+    }
+
+    // Mapper structs are one allocation plus ROM that never changes, so a copy is a full clone
+    memcpy(copy, player->mapper_data, size);
+    atomic32_add(player->rom_refs, 1);
+
+    struct player fork = *player;
+    fork.mapper_data = copy;
+
+    // Every mapper hands itself to the CPU as the memory instance
+    struct system *system = player->vtbl->get_system(copy);
+    system->mem.instance = copy;
+    system->apu.ring = NULL;
+    system->apu.rate_control = false;
+    system->apu.writer = (struct apu_writer){ 0 };
+    system->apu.stream_count = 1;
+
+    // ROM blocks and the JIT's code are shared from here on, only the RAM
+    // blocks stay with the parent since they point at its memory
+    struct block_cache *blocks = system->blocks;
+    system->blocks = NULL;
+    if (blocks)
+    {
+        system->blocks = block_cache_fork(blocks);
+    }
+    else
+    {
+        player_set_blocks(&fork, true);
+    }
+
+    return fork;
+}
+
+// Runs the CPU from translated blocks or one instruction at a time, the
+// results are the same either way
+void player_set_blocks(struct player *player, bool enabled)
+{
+    struct system *system = player_get_system(player);
+    if (!system || enabled == (system->blocks != NULL))
+    {
+        return;
+    }
+
+    if (enabled)
+    {
+        system->blocks = block_cache_new();
+    }
+    else
+    {
+        block_cache_free(system->blocks);
+        system->blocks = NULL;
+    }
+}
+
+// Compiles hot blocks to native code on top, turning blocks on with it.
+// False when there's no JIT here, blocks keep running without one.
+bool player_set_jit(struct player *player, bool enabled)
+{
+    struct system *system = player_get_system(player);
+    if (!system)
+    {
+        return false;
+    }
+
+    player_set_blocks(player, true);
+    if (!system->blocks)
+    {
+        return false;
+    }
+    if (enabled == (system->blocks->jit != NULL))
+    {
+        return true;
+    }
+
+    return block_cache_set_jit(system->blocks, enabled);
+}
@@ -2,13 +2,9 @@
 #include <assert.h>
 #include <string.h>
 
+// Nametables and palettes, CHR goes through the slots in ppu_vram_read/write
 uint8_t *ppu_vram_get_ptr(struct ppu *ppu, uint16_t addr)
 {
-    if (addr >= 0x0000 && addr < 0x2000)
-    {
-        return ppu->pins.chr + addr;
-    }
-
     if (addr >= 0x2000 && addr < 0x3000)
     {
         switch (ppu->pins.mirroring_mode)
@@ -39,6 +35,8 @@ uint8_t *ppu_vram_get_ptr(struct ppu *ppu, uint16_t addr)
             case PPUMIR_ONE:
                 addr = addr % 0x400 + 0x2000;
                 break;
+            case PPUMIR_FOUR:
+                break;
         }
 
         return ppu->vram + (addr-0x2000);
@@ -60,8 +58,20 @@ uint8_t *ppu_vram_get_ptr(struct ppu *ppu, uint16_t addr)
     return NULL;
 }
 
+// A tile's two planes are 8 bytes apart in the same slot, one lookup covers both
+static inline const uint8_t *_ppu_chr_ptr(struct ppu *ppu, uint16_t addr)
+{
+    const uint8_t *rom = ppu->pins.chr_rom[addr >> 10];
+    return rom ? rom + (addr & 0x3FF) : ppu->pins.chr + (addr & ppu->pins.chr_ram_mask);
+}
+
 uint8_t ppu_vram_read(struct ppu *ppu, uint16_t addr)
 {
+    if (addr < 0x2000)
+    {
+        return *_ppu_chr_ptr(ppu, addr);
+    }
+
     uint8_t *ptr = ppu_vram_get_ptr(ppu, addr);
     if (ptr == NULL)
     {
@@ -73,6 +83,17 @@ uint8_t ppu_vram_read(struct ppu *ppu, uint16_t addr)
 
 void ppu_vram_write(struct ppu *ppu, uint16_t addr, uint8_t val)
 {
+    if (addr < 0x2000)
+    {
+        if (!ppu->pins.chr_rom[addr >> 10])
+        {
+            addr &= ppu->pins.chr_ram_mask;
+            ppu->pins.chr[addr] = val;
+            ppu->chr_dirty[addr >> 10] |= 1ull << ((addr >> 4) & 63);
+        }
+        return;
+    }
+
     uint8_t *ptr = ppu_vram_get_ptr(ppu, addr);
     if (ptr == NULL)
     {
@@ -85,9 +106,25 @@ void ppu_vram_write(struct ppu *ppu, uint16_t addr, uint8_t val)
 struct ppu ppu_mk()
 {
     struct ppu ppu = { 0 };
+    ppu.pins.chr_ram_mask = PPU_CHR_RAM_LEN-1;
+    ppu_mark_chr_dirty(&ppu);
     return ppu;
 }
 
+// Hands over the CHR-RAM tiles written since the last call, one bit per tile,
+// 64 tiles per word. Whoever caches decoded tiles calls this, there's one taker.
+void ppu_take_chr_dirty(struct ppu *ppu, uint64_t out[8])
+{
+    memcpy(out, ppu->chr_dirty, sizeof ppu->chr_dirty);
+    memset(ppu->chr_dirty, 0, sizeof ppu->chr_dirty);
+}
+
+// Everything changed as far as caches know, after a state load for one
+void ppu_mark_chr_dirty(struct ppu *ppu)
+{
+    memset(ppu->chr_dirty, 0xFF, sizeof ppu->chr_dirty);
+}
+
 uint16_t ppu_get_addr(struct ppu *ppu)
 {
     return ppu->v & 0x3FFF;
@@ -228,7 +265,7 @@ struct ppu_nametable_result ppu_read_nametable(struct ppu *ppu, uint8_t x, uint8
     {
         y %= 30;
     }
-    else
+    else if (ppu->pins.mirroring_mode != PPUMIR_FOUR)
     {
         x %= 32;
         y %= 30;
@@ -306,8 +343,9 @@ uint8_t ppu_get_pixel(struct ppu *ppu, int x, int y)
         int tx = sx%8;
         int ty = sy%8;
 
-        uint8_t lo = (ppu_vram_read(ppu, (uint16_t)tile*16+ty)>>(7-tx))&1;
-        uint8_t hi = (ppu_vram_read(ppu, (uint16_t)tile*16+8+ty)>>(7-tx))&1;
+        const uint8_t *planes = _ppu_chr_ptr(ppu, (uint16_t)tile*16+ty);
+        uint8_t lo = (planes[0]>>(7-tx))&1;
+        uint8_t hi = (planes[8]>>(7-tx))&1;
         uint8_t palcoloridx = lo | (hi << 1);
         uint8_t palcolor = ppu_vram_read(ppu, 0x3F00+palidx*4+palcoloridx);
         if (palcoloridx == 0)
@@ -348,8 +386,9 @@ uint8_t ppu_get_pixel(struct ppu *ppu, int x, int y)
                 uint8_t palidx = obj.attr&3;
                 ty %= 8;
 
-                uint8_t lo = (ppu_vram_read(ppu, tile*16+ty)>>(7-tx))&1;
-                uint8_t hi = (ppu_vram_read(ppu, tile*16+8+ty)>>(7-tx))&1;
+                const uint8_t *planes = _ppu_chr_ptr(ppu, tile*16+ty);
+                uint8_t lo = (planes[0]>>(7-tx))&1;
+                uint8_t hi = (planes[8]>>(7-tx))&1;
                 uint8_t palcoloridx = lo | (hi << 1);
                 uint8_t palcolor = ppu_vram_read(ppu, 0x3F10+palidx*4+palcoloridx);
              
@@ -391,8 +430,9 @@ uint8_t ppu_get_pixel(struct ppu *ppu, int x, int y)
                 if (ppu->regs[PPUIR_CTRL] & (1<<3)) tile += 0x100;
                 uint8_t palidx = obj.attr&3;
 
-                uint8_t lo = (ppu_vram_read(ppu, tile*16+ty)>>(7-tx))&1;
-                uint8_t hi = (ppu_vram_read(ppu, tile*16+8+ty)>>(7-tx))&1;
+                const uint8_t *planes = _ppu_chr_ptr(ppu, tile*16+ty);
+                uint8_t lo = (planes[0]>>(7-tx))&1;
+                uint8_t hi = (planes[8]>>(7-tx))&1;
                 uint8_t palcoloridx = lo | (hi << 1);
                 uint8_t palcolor = ppu_vram_read(ppu, 0x3F10+palidx*4+palcoloridx);
              
@@ -417,6 +457,20 @@ uint8_t ppu_get_pixel(struct ppu *ppu, int x, int y)
     return pixel;
 }
 
+// ppu_cycle calls until the one that starts vblank, counting that one. Whatever
+// runs the CPU ahead of the PPU has to stop there or the NMI comes late.
+uint32_t ppu_cycles_to_vblank(const struct ppu *ppu)
+{
+    uint32_t to_line_end = 341 - ppu->beam;
+    if (ppu->scanline <= 240)
+    {
+        return to_line_end + (240 - ppu->scanline)*341 + 1;
+    }
+
+    // The rest of vblank, then the pre-render line which is one longer
+    return to_line_end + (260 - ppu->scanline)*341 + 1 + 342 + 241*341;
+}
+
 bool ppu_cycle(struct ppu *ppu, struct ricoh_mem_interface *mem)
 {
     bool nmi_occured = false;
@@ -473,6 +527,11 @@ bool ppu_cycle(struct ppu *ppu, struct ricoh_mem_interface *mem)
     }
     else if (ppu->scanline < 240) 
     {
+        if (ppu->beam == 0)
+        {
+            ppu->line_mask[ppu->scanline] = ppu->regs[PPUIR_MASK];
+        }
+
         if (ppu->beam < 256)
         {
             int x = ppu->beam;
@@ -308,14 +308,33 @@ uint16_t do_readjmp(
     return 0; 
 }
 
+// Only I, D and the two stack bits live in flags, see ricoh_get_flags
 static void setflag(struct ricoh_state *cpu, enum flags flag, bool state)
 {
     cpu->flags = (cpu->flags & ~(1<<flag)) | (state<<flag);
 }
 
-static bool getflag(struct ricoh_state *cpu, enum flags flag)
+#define RICOH_LAZY_FLAGS ((1 << FLAG_NEG) | (1 << FLAG_ZER) | (1 << FLAG_CAR) | (1 << FLAG_OFW))
+
+// N, Z, C and V are rarely read before the next instruction overwrites them,
+// so instructions only store what they're made from and PHP, BRK and
+// interrupts put the byte together
+uint8_t ricoh_get_flags(const struct ricoh_state *cpu)
 {
-    return (cpu->flags & (1<<flag)) > 0;
+    return (cpu->flags & ~RICOH_LAZY_FLAGS)
+        | (cpu->n_result & 0x80)
+        | (cpu->overflow & 0x80) >> 1
+        | (cpu->z_result == 0) << FLAG_ZER
+        | cpu->carry;
+}
+
+void ricoh_set_flags(struct ricoh_state *cpu, uint8_t flags)
+{
+    cpu->flags = flags & ~RICOH_LAZY_FLAGS;
+    cpu->n_result = flags;
+    cpu->z_result = !(flags & (1 << FLAG_ZER));
+    cpu->carry = flags & 1;
+    cpu->overflow = flags << 1;
 }
 
 static void push8(struct ricoh_state *cpu, struct ricoh_mem_interface *mem, uint8_t val)
@@ -348,15 +367,15 @@ static uint16_t pull16(struct ricoh_state *cpu, struct ricoh_mem_interface *mem)
 #define REG_X 1
 #define REG_Y 2
 
-static int8_t updateflags(struct ricoh_state *cpu, int8_t value)
+static uint8_t updateflags(struct ricoh_state *cpu, uint8_t value)
 {
-    setflag(cpu, FLAG_NEG, value < 0);
-    setflag(cpu, FLAG_ZER, value == 0);
+    cpu->n_result = value;
+    cpu->z_result = value;
 
     return value;
 }
 
-static void setreg(struct ricoh_state *cpu, int reg, int8_t value)
+static void setreg(struct ricoh_state *cpu, int reg, uint8_t value)
 {
     switch (reg)
     {
@@ -451,40 +470,18 @@ static void do_write(struct ricoh_state *cpu, struct ricoh_address addr, struct
     }
 }
 
-int8_t do_add_carry(
+// SBC is ADC of the inverted operand. V ends up in bit 7 of overflow: set
+// when both operands had the same sign and the result doesn't.
+uint8_t do_add_carry(
     struct ricoh_state *cpu,
     uint8_t a, uint8_t b
 )
 {
-    uint8_t car = getflag(cpu, FLAG_CAR);
-    int8_t res = (int8_t)a + (int8_t)b + (int8_t)car;
-    uint16_t carrybits = (uint16_t)a + (uint16_t)b + (uint16_t)car;
-    setflag(cpu, FLAG_NEG, res < 0);
-    setflag(cpu, FLAG_ZER, res == 0);
-    setflag(cpu, FLAG_CAR, (carrybits&0xFF00) > 0);
-    int16_t ovfw = (int16_t)(int8_t)a + (int16_t)(int8_t)b + (int16_t)car;
-    setflag(cpu, FLAG_OFW, ovfw < -128 || ovfw > 127);
-    return res;
-}
-
-int8_t do_sub_carry(
-    struct ricoh_state *cpu,
-    uint8_t a, uint8_t b,
-    bool overflow,
-    bool carry
-)
-{
-    uint8_t car = (!getflag(cpu, FLAG_CAR)) && carry;
-    int8_t res = (int8_t)a - (int8_t)b - (int8_t)car;
-    uint16_t carrybits = (uint16_t)a - (uint16_t)b - (uint16_t)car;
-    setflag(cpu, FLAG_NEG, res < 0);
-    setflag(cpu, FLAG_ZER, res == 0);
-    setflag(cpu, FLAG_CAR, (carrybits&0xFF00) == 0);
-    if (overflow) {
-        int16_t ovfw = (int16_t)(int8_t)a - (int16_t)(int8_t)b - (int16_t)car;
-        setflag(cpu, FLAG_OFW, ovfw < -128 || ovfw > 127);
-    }
-    return res;
+    uint16_t sum = (uint16_t)a + b + cpu->carry;
+    uint8_t res = (uint8_t)sum;
+    cpu->carry = sum >> 8;
+    cpu->overflow = (a ^ res) & (b ^ res);
+    return updateflags(cpu, res);
 }
 
 static void do_reljump(struct ricoh_state *cpu, struct instr_decoded instr, bool is)
@@ -494,9 +491,10 @@ static void do_reljump(struct ricoh_state *cpu, struct instr_decoded instr, bool
     }
 }
 
-static void do_cmp(struct ricoh_state *cpu, int8_t reg, int8_t operand)
+static void do_cmp(struct ricoh_state *cpu, uint8_t reg, uint8_t operand)
 {
-    do_sub_carry(cpu, reg, operand, false, false);
+    cpu->carry = reg >= operand;
+    updateflags(cpu, reg - operand);
 }
 
 void ricoh_do_interrupt(
@@ -505,8 +503,10 @@ void ricoh_do_interrupt(
     uint16_t newpc
 )
 {
+    // Hardware interrupts push B clear, and mask further IRQs until RTI
     push16(cpu, mem, cpu->pc);
-    push8(cpu, mem, cpu->flags | (1 << FLAG_BRK) | (1 << FLAG_BI5));
+    push8(cpu, mem, (ricoh_get_flags(cpu) & ~(1 << FLAG_BRK)) | (1 << FLAG_BI5));
+    setflag(cpu, FLAG_INT, true);
     cpu->pc = newpc;
     cpu->cycles += 7;
 }
@@ -540,33 +540,33 @@ void ricoh_run_instr(
             rmw_temp = do_read(cpu, addr, mem);
             do_write(cpu, addr, mem, rmw_temp);
             do_write(cpu, addr, mem, updateflags(cpu, rmw_temp<<1));
-            setflag(cpu, FLAG_CAR, (rmw_temp&0x80) > 0);
+            cpu->carry = rmw_temp >> 7;
             break;
         case BCC:
-            do_reljump(cpu, instr, getflag(cpu, FLAG_CAR) == false);
+            do_reljump(cpu, instr, !cpu->carry);
             break;
         case BCS:
-            do_reljump(cpu, instr, getflag(cpu, FLAG_CAR) == true);
+            do_reljump(cpu, instr, cpu->carry);
             break;
         case BEQ:
-            do_reljump(cpu, instr, getflag(cpu, FLAG_ZER) == true);
+            do_reljump(cpu, instr, cpu->z_result == 0);
             break;
         case BIT:
             {
                 uint8_t byte = do_read(cpu, addr, mem);
-                setflag(cpu, FLAG_NEG, byte>>7&1);
-                setflag(cpu, FLAG_OFW, byte>>6&1);
-                setflag(cpu, FLAG_ZER, (byte & cpu->a) == 0);
+                cpu->n_result = byte;
+                cpu->overflow = byte << 1;
+                cpu->z_result = byte & cpu->a;
             }
             break;
         case BMI:
-            do_reljump(cpu, instr, getflag(cpu, FLAG_NEG) == true);
+            do_reljump(cpu, instr, (cpu->n_result & 0x80) != 0);
             break;
         case BNE:
-            do_reljump(cpu, instr, getflag(cpu, FLAG_ZER) == false);
+            do_reljump(cpu, instr, cpu->z_result != 0);
             break;
         case BPL:
-            do_reljump(cpu, instr, getflag(cpu, FLAG_NEG) == false);
+            do_reljump(cpu, instr, (cpu->n_result & 0x80) == 0);
             break;
         case BRK:
             {
@@ -575,18 +575,18 @@ void ricoh_run_instr(
                 fflush(stdout);
                 uint16_t pc = read_16(cpu, mem, 0xFFFE);
                 push16(cpu, mem, cpu->pc);
-                push8(cpu, mem, cpu->flags | (1 << FLAG_BRK));
+                push8(cpu, mem, ricoh_get_flags(cpu) | (1 << FLAG_BRK));
                 cpu->pc = pc;
             }
             break;
         case BVC:
-            do_reljump(cpu, instr, getflag(cpu, FLAG_OFW) == false);
+            do_reljump(cpu, instr, (cpu->overflow & 0x80) == 0);
             break;
         case BVS:
-            do_reljump(cpu, instr, getflag(cpu, FLAG_OFW) == true);
+            do_reljump(cpu, instr, (cpu->overflow & 0x80) != 0);
             break;
         case CLC:
-            setflag(cpu, FLAG_CAR, false);
+            cpu->carry = 0;
             break;
         case CLD:
             setflag(cpu, FLAG_DEC, false);
@@ -595,7 +595,7 @@ void ricoh_run_instr(
             setflag(cpu, FLAG_INT, false);
             break;
         case CLV:
-            setflag(cpu, FLAG_OFW, false);
+            cpu->overflow = 0;
             break;
         case CMP:
             do_cmp(cpu, cpu->a, do_read(cpu, addr, mem));
@@ -651,7 +651,7 @@ void ricoh_run_instr(
             rmw_temp = do_read(cpu, addr, mem);
             do_write(cpu, addr, mem, rmw_temp);
             do_write(cpu, addr, mem, updateflags(cpu, rmw_temp>>1));
-            setflag(cpu, FLAG_CAR, (rmw_temp&1) > 0);
+            cpu->carry = rmw_temp & 1;
             break;
         case NOP:
             break;
@@ -662,38 +662,38 @@ void ricoh_run_instr(
             push8(cpu, mem, cpu->a);
             break;
         case PHP:
-            push8(cpu, mem, cpu->flags | (1 << FLAG_BRK) | (1 << FLAG_BI5));
+            push8(cpu, mem, ricoh_get_flags(cpu) | (1 << FLAG_BRK) | (1 << FLAG_BI5));
             break;
         case PLA:
             setreg(cpu, REG_A, pull8(cpu, mem));
             break;
         case PLP:
-            cpu->flags = (cpu->flags & ((1 << FLAG_BRK) | (1 << FLAG_BI5))) | (pull8(cpu, mem) & (((1 << FLAG_BRK) | (1 << FLAG_BI5)) ^ 0xFF));
+            ricoh_set_flags(cpu, (cpu->flags & ((1 << FLAG_BRK) | (1 << FLAG_BI5))) | (pull8(cpu, mem) & (((1 << FLAG_BRK) | (1 << FLAG_BI5)) ^ 0xFF)));
             break;
         case ROL:
             rmw_temp = do_read(cpu, addr, mem);
             do_write(cpu, addr, mem, rmw_temp);
-            do_write(cpu, addr, mem, updateflags(cpu, (rmw_temp<<1)|getflag(cpu, FLAG_CAR)));
-            setflag(cpu, FLAG_CAR, (rmw_temp&0x80) > 0);
+            do_write(cpu, addr, mem, updateflags(cpu, (rmw_temp<<1)|cpu->carry));
+            cpu->carry = rmw_temp >> 7;
             break;
         case ROR:
             rmw_temp = do_read(cpu, addr, mem);
             do_write(cpu, addr, mem, rmw_temp);
-            do_write(cpu, addr, mem, updateflags(cpu, (rmw_temp>>1)|(getflag(cpu, FLAG_CAR)<<7)));
-            setflag(cpu, FLAG_CAR, (rmw_temp&0x1) > 0);
+            do_write(cpu, addr, mem, updateflags(cpu, (rmw_temp>>1)|(cpu->carry<<7)));
+            cpu->carry = rmw_temp & 1;
             break;
         case RTI:
-            cpu->flags = (cpu->flags & ((1 << FLAG_BRK) | (1 << FLAG_BI5))) | (pull8(cpu, mem) & (((1 << FLAG_BRK) | (1 << FLAG_BI5)) ^ 0xFF));
+            ricoh_set_flags(cpu, (cpu->flags & ((1 << FLAG_BRK) | (1 << FLAG_BI5))) | (pull8(cpu, mem) & (((1 << FLAG_BRK) | (1 << FLAG_BI5)) ^ 0xFF)));
             cpu->pc = pull16(cpu, mem);
             break;
         case RTS:
             cpu->pc = pull16(cpu, mem)+1;
             break;
         case SBC:
-            setreg(cpu, REG_A, do_sub_carry(cpu, cpu->a, do_read(cpu, addr, mem), true, true));
+            setreg(cpu, REG_A, do_add_carry(cpu, cpu->a, ~do_read(cpu, addr, mem)));
             break;
         case SEC:
-            setflag(cpu, FLAG_CAR, 1);
+            cpu->carry = 1;
             break;
         case SED:
             setflag(cpu, FLAG_DEC, 1);
@@ -0,0 +1,134 @@
+#include "neske.h"
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+
+uint32_t atomic32_load(volatile uint32_t *value)
+{
+    return (uint32_t)_InterlockedOr((volatile long *)value, 0);
+}
+
+void atomic32_store(volatile uint32_t *value, uint32_t new_value)
+{
+    _InterlockedExchange((volatile long *)value, (long)new_value);
+}
+
+uint32_t atomic32_add(volatile uint32_t *value, uint32_t delta)
+{
+    return (uint32_t)_InterlockedExchangeAdd((volatile long *)value, (long)delta) + delta;
+}
+
+uint32_t atomic32_or(volatile uint32_t *value, uint32_t bits)
+{
+    return (uint32_t)_InterlockedOr((volatile long *)value, (long)bits) | bits;
+}
+
+uint32_t atomic32_exchange(volatile uint32_t *value, uint32_t new_value)
+{
+    return (uint32_t)_InterlockedExchange((volatile long *)value, (long)new_value);
+}
+#else
+uint32_t atomic32_load(volatile uint32_t *value)
+{
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+void atomic32_store(volatile uint32_t *value, uint32_t new_value)
+{
+    __atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+}
+
+uint32_t atomic32_add(volatile uint32_t *value, uint32_t delta)
+{
+    return __atomic_add_fetch(value, delta, __ATOMIC_ACQ_REL);
+}
+
+uint32_t atomic32_or(volatile uint32_t *value, uint32_t bits)
+{
+    return __atomic_or_fetch(value, bits, __ATOMIC_ACQ_REL);
+}
+
+uint32_t atomic32_exchange(volatile uint32_t *value, uint32_t new_value)
+{
+    return __atomic_exchange_n(value, new_value, __ATOMIC_ACQ_REL);
+}
+#endif
+
+void atomic32_lock(volatile uint32_t *lock)
+{
+    while (atomic32_exchange(lock, 1))
+    {
+    }
+}
+
+void atomic32_unlock(volatile uint32_t *lock)
+{
+    atomic32_store(lock, 0);
+}
+
+void sample_ring_init(struct sample_ring *ring)
+{
+    memset(ring, 0, sizeof *ring);
+}
+
+uint32_t sample_ring_fill(struct sample_ring *ring)
+{
+    return atomic32_load(&ring->write_at) - atomic32_load(&ring->read_at);
+}
+
+uint32_t sample_ring_write(struct sample_ring *ring, const int16_t *src, uint32_t count)
+{
+    // Only the producer moves write_at, so it can be read plainly
+    uint32_t write_at = ring->write_at;
+    uint32_t space = SAMPLE_RING_LEN - (write_at - atomic32_load(&ring->read_at));
+
+    if (count > space)
+    {
+        atomic32_add(&ring->overruns, count - space);
+        count = space;
+    }
+
+    uint32_t at = write_at % SAMPLE_RING_LEN;
+    uint32_t first = count < SAMPLE_RING_LEN - at ? count : SAMPLE_RING_LEN - at;
+
+    memcpy(ring->samples + at, src, first*sizeof *src);
+    memcpy(ring->samples, src + first, (count - first)*sizeof *src);
+
+    atomic32_store(&ring->write_at, write_at + count);
+
+    return count;
+}
+
+uint32_t sample_ring_read(struct sample_ring *ring, int16_t *dest, uint32_t count)
+{
+    uint32_t read_at = ring->read_at;
+    uint32_t available = atomic32_load(&ring->write_at) - read_at;
+    uint32_t copied = count < available ? count : available;
+
+    uint32_t at = read_at % SAMPLE_RING_LEN;
+    uint32_t first = copied < SAMPLE_RING_LEN - at ? copied : SAMPLE_RING_LEN - at;
+
+    memcpy(dest, ring->samples + at, first*sizeof *dest);
+    memcpy(dest + first, ring->samples, (copied - first)*sizeof *dest);
+
+    atomic32_store(&ring->read_at, read_at + copied);
+
+    if (copied > 0)
+    {
+        ring->last = dest[copied-1];
+    }
+
+    // Holding the last sample instead of dropping to zero avoids a click on underrun
+    if (copied < count)
+    {
+        atomic32_add(&ring->underruns, count - copied);
+
+        for (uint32_t i = copied; i < count; i++)
+        {
+            dest[i] = ring->last;
+        }
+    }
+
+    return copied;
+}
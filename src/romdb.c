@@ -0,0 +1,160 @@
+// Dumps whose headers can't be trusted, looked up by CRC32 when a ROM is loaded.
+// A hit replaces the file's header, so everything downstream sees a correct one.
+// `neske_cli info` prints the line to add here for a dump.
+//
+// The key is the CRC32 alone, no SHA-1. It's already computed for every
+// load, and a wrong hit needs an unknown dump to collide with one of these
+// few entries, one in four billion each. Hashing every ROM a second time
+// to rule that out isn't worth it.
+
+#include "neske.h"
+#include <stdio.h>
+
+static const struct romdb_entry _romdb_entries[] = {
+    { 0x158B0388, { 'N','E','S',0x1A, 0x01,0x01,0x00,0x08, 0x00,0x00,0x07,0x00, 0x00,0x00,0x00,0x01 }, "nestest" },
+};
+
+#define ROMDB_COUNT (sizeof _romdb_entries / sizeof *_romdb_entries)
+// Half full, so a bucket finds free slots for its entries within a few tries
+#define ROMDB_SLOTS (2*ROMDB_COUNT)
+#define ROMDB_MAX_DISPLACE 0x10000
+
+static uint32_t _romdb_crc_table[256];
+static const struct romdb_entry *_romdb_slots[ROMDB_SLOTS];
+static uint16_t _romdb_displace[ROMDB_COUNT]; // one per bucket, moves where its entries land
+static bool _romdb_ready;
+static bool _romdb_hashed;
+
+static uint32_t _romdb_slot(uint32_t crc, uint32_t displace)
+{
+    uint32_t x = (crc ^ displace*0x9E3779B9)*0x85EBCA6B;
+    return (x ^ (x >> 16)) % ROMDB_SLOTS;
+}
+
+// Hash and displace. Entries go into buckets by CRC, then the fullest buckets
+// go first and each looks for a displacement that puts all its entries in
+// free slots. A lookup is then one bucket and one slot, however big the
+// table gets.
+static bool _romdb_hash()
+{
+    static uint32_t bucket_start[ROMDB_COUNT + 1];
+    static uint32_t bucket_fill[ROMDB_COUNT];
+    static uint32_t order[ROMDB_COUNT];
+    static uint32_t taken[ROMDB_COUNT];
+
+    // Counting sort of the entries by bucket
+    for (size_t i = 0; i < ROMDB_COUNT; i++)
+    {
+        bucket_start[_romdb_entries[i].crc % ROMDB_COUNT + 1]++;
+    }
+    uint32_t biggest = 0;
+    for (size_t b = 0; b < ROMDB_COUNT; b++)
+    {
+        biggest = bucket_start[b + 1] > biggest ? bucket_start[b + 1] : biggest;
+        bucket_start[b + 1] += bucket_start[b];
+    }
+    for (size_t i = 0; i < ROMDB_COUNT; i++)
+    {
+        uint32_t b = _romdb_entries[i].crc % ROMDB_COUNT;
+        order[bucket_start[b] + bucket_fill[b]++] = (uint32_t)i;
+    }
+
+    for (uint32_t size = biggest; size > 0; size--)
+    {
+        for (size_t b = 0; b < ROMDB_COUNT; b++)
+        {
+            if (bucket_start[b + 1] - bucket_start[b] != size)
+            {
+                continue;
+            }
+
+            bool done = false;
+            for (uint32_t displace = 0; displace < ROMDB_MAX_DISPLACE && !done; displace++)
+            {
+                uint32_t placed = 0;
+                for (; placed < size; placed++)
+                {
+                    const struct romdb_entry *entry = &_romdb_entries[order[bucket_start[b] + placed]];
+                    uint32_t slot = _romdb_slot(entry->crc, displace);
+                    if (_romdb_slots[slot])
+                    {
+                        // Same CRC lands on the same slot whatever the displacement
+                        if (_romdb_slots[slot]->crc == entry->crc)
+                        {
+                            printf("%s is in the ROM database twice as %08X\n", entry->name, entry->crc);
+                            return false;
+                        }
+                        break;
+                    }
+                    _romdb_slots[slot] = entry;
+                    taken[placed] = slot;
+                }
+
+                done = placed == size;
+                if (done)
+                {
+                    _romdb_displace[b] = (uint16_t)displace;
+                }
+                while (!done && placed > 0)
+                {
+                    _romdb_slots[taken[--placed]] = NULL;
+                }
+            }
+
+            if (!done)
+            {
+                printf("Can't hash the ROM database, known dumps won't be fixed\n");
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Runs on the first lookup, ROMs get loaded from one thread so there's no lock
+static void _romdb_init()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+        }
+        _romdb_crc_table[i] = c;
+    }
+
+    _romdb_hashed = _romdb_hash();
+    _romdb_ready = true;
+}
+
+uint32_t romdb_crc32(const uint8_t *data, size_t size)
+{
+    if (!_romdb_ready)
+    {
+        _romdb_init();
+    }
+
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = (crc >> 8) ^ _romdb_crc_table[(crc ^ data[i]) & 0xFF];
+    }
+    return ~crc;
+}
+
+const struct romdb_entry *romdb_lookup(uint32_t crc)
+{
+    if (!_romdb_ready)
+    {
+        _romdb_init();
+    }
+    if (!_romdb_hashed)
+    {
+        return NULL;
+    }
+
+    const struct romdb_entry *entry = _romdb_slots[_romdb_slot(crc, _romdb_displace[crc % ROMDB_COUNT])];
+    return entry && entry->crc == crc ? entry : NULL;
+}
@@ -0,0 +1,107 @@
+// ROM images mapped read only, every player of the same file shares the same
+// pages and nothing gets read before a mapper touches it
+
+#include "neske.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+bool rom_file_open(const char *path, struct rom_file *out)
+{
+    *out = (struct rom_file){ 0 };
+
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        printf("Can't open %s\n", path);
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+    {
+        printf("%s is empty\n", path);
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping)
+    {
+        printf("Can't map %s\n", path);
+        return false;
+    }
+
+    out->data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!out->data)
+    {
+        printf("Can't map %s\n", path);
+        return false;
+    }
+
+    out->size = (size_t)size.QuadPart;
+    return true;
+}
+
+void rom_file_close(struct rom_file *file)
+{
+    if (file->data)
+    {
+        UnmapViewOfFile(file->data);
+    }
+    *file = (struct rom_file){ 0 };
+}
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool rom_file_open(const char *path, struct rom_file *out)
+{
+    *out = (struct rom_file){ 0 };
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Can't open %s\n", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        printf("%s is empty\n", path);
+        close(fd);
+        return false;
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        printf("Can't map %s\n", path);
+        return false;
+    }
+
+    out->data = data;
+    out->size = st.st_size;
+    return true;
+}
+
+void rom_file_close(struct rom_file *file)
+{
+    if (file->data)
+    {
+        munmap(file->data, file->size);
+    }
+    *file = (struct rom_file){ 0 };
+}
+#endif
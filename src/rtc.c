@@ -0,0 +1,241 @@
+// Real time corruptor, pokes random bytes every so often to see what breaks.
+// Everything comes from a seeded generator so a run can be reproduced from its seed,
+// and the explorer runs lots of seeds from one state to find the interesting ones.
+
+#include "neske.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Reference and runs are compared on every RTC_SAMPLE_STEP'th pixel both ways
+#define RTC_SAMPLE_STEP 4
+#define RTC_SAMPLE_LEN ((256/RTC_SAMPLE_STEP)*(240/RTC_SAMPLE_STEP))
+
+// splitmix64, small and good enough, and the same everywhere unlike rand()
+static uint32_t _rtc_next(struct rtc_state *rtc)
+{
+    uint64_t z = (rtc->rng += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return (uint32_t)((z ^ (z >> 31)) >> 32);
+}
+
+struct rtc_state rtc_make(enum rtc_level level, uint32_t targets, uint64_t seed)
+{
+    return (struct rtc_state){ .level = level, .targets = targets ? targets : RTC_TARGET_RAM, .rng = seed };
+}
+
+static uint8_t *_rtc_pick(struct rtc_state *rtc, struct system *sys)
+{
+    enum rtc_target picked[4];
+    int count = 0;
+    for (int bit = 0; bit < 4; bit++)
+    {
+        if (rtc->targets & (1 << bit))
+        {
+            picked[count++] = 1 << bit;
+        }
+    }
+
+    switch (picked[_rtc_next(rtc) % count])
+    {
+        case RTC_TARGET_RAM:
+        {
+            // The stack page is left alone, hitting a return address just crashes
+            uint16_t addr = _rtc_next(rtc) % 0x2000;
+            while (addr >= 0x100 && addr < 0x200)
+            {
+                addr = _rtc_next(rtc) % 0x2000;
+            }
+            return &sys->memory[addr];
+        }
+        case RTC_TARGET_PRG_RAM:
+            return &sys->memory[0x6000 + _rtc_next(rtc) % 0x2000];
+        case RTC_TARGET_VRAM:
+        {
+            // The upper half of vram only exists on four screen carts
+            uint32_t size = sys->ppu.pins.mirroring_mode == PPUMIR_FOUR ? 0x1000 : 0x800;
+            return &sys->ppu.vram[_rtc_next(rtc) % size];
+        }
+        case RTC_TARGET_OAM:
+            return (uint8_t *)sys->ppu.oam + _rtc_next(rtc) % sizeof sys->ppu.oam;
+    }
+
+    return &sys->memory[0];
+}
+
+// Once per frame, low nudges a byte by one every 10 frames, high replaces one every 20
+void rtc_iter(struct rtc_state *rtc, struct system *sys)
+{
+    if (rtc->level == RTC_OFF) return;
+    rtc->frames_since_last_pulse++;
+    int frames = 20;
+    if (rtc->level == RTC_LOW) frames = 10;
+    if (rtc->frames_since_last_pulse < frames) return;
+    rtc->frames_since_last_pulse = 0;
+
+    uint8_t *at = _rtc_pick(rtc, sys);
+    uint8_t val = *at;
+    if (rtc->level == RTC_HIGH)
+    {
+        val = _rtc_next(rtc) % 0x100;
+    }
+    else
+    {
+        int delta = _rtc_next(rtc) % 2 ? 1 : -1;
+        if (val == 0) delta = 1;
+        if (val == 0xFF) delta = -1;
+        val += delta;
+    }
+
+    *at = val;
+}
+
+static void _rtc_sample(uint8_t *out, struct system_frame_result *frame)
+{
+    for (int y = 0; y < 240; y += RTC_SAMPLE_STEP)
+    {
+        for (int x = 0; x < 256; x += RTC_SAMPLE_STEP)
+        {
+            *out++ = frame->screen[y*256 + x];
+        }
+    }
+}
+
+struct rtc_explorer
+{
+    struct player *source;
+    struct rtc_explore_options *options;
+    struct rtc_result *results;
+    uint8_t *reference; // options->frames samples
+};
+
+// One seed, runs the schedule on a fork of the source. Also how a result gets replayed.
+struct rtc_result rtc_run_seed(struct player *source, struct rtc_explore_options *options, uint64_t seed, const uint8_t *reference, struct video_recorder *capture)
+{
+    struct rtc_result result = { .seed = seed };
+    struct player player = player_fork(source);
+    if (!player.is_valid)
+    {
+        return result;
+    }
+
+    struct rtc_state rtc = rtc_make(options->level, options->targets, seed);
+    struct system *sys = player_get_system(&player);
+    uint8_t sample[RTC_SAMPLE_LEN];
+    uint64_t differing = 0;
+
+    for (uint32_t frame = 0; frame < options->frames; frame++)
+    {
+        rtc_iter(&rtc, sys);
+        struct system_frame_result screen = player_frame(&player);
+        result.frames_run++;
+
+        if (capture)
+        {
+            video_recorder_push(capture, &screen);
+        }
+
+        if (reference)
+        {
+            _rtc_sample(sample, &screen);
+            const uint8_t *expected = reference + (size_t)frame*RTC_SAMPLE_LEN;
+            for (int i = 0; i < RTC_SAMPLE_LEN; i++)
+            {
+                differing += sample[i] != expected[i];
+            }
+        }
+
+        if (player_crash(&player))
+        {
+            result.crashed = true;
+            break;
+        }
+    }
+
+    // Frames after a crash count as fully different, a dead game is as far off as it gets
+    result.difference = (differing + (uint64_t)(options->frames - result.frames_run)*RTC_SAMPLE_LEN) /
+        ((double)options->frames*RTC_SAMPLE_LEN);
+
+    player_free(&player);
+    return result;
+}
+
+static void _rtc_explore_one(void *userdata, int index)
+{
+    struct rtc_explorer *explorer = userdata;
+    explorer->results[index] = rtc_run_seed(explorer->source, explorer->options,
+        explorer->options->first_seed + index, explorer->reference, NULL);
+}
+
+static int _rtc_compare(const void *a, const void *b)
+{
+    const struct rtc_result *ra = a;
+    const struct rtc_result *rb = b;
+
+    if (ra->rank_key != rb->rank_key)
+    {
+        return ra->rank_key < rb->rank_key ? 1 : -1;
+    }
+    return ra->seed < rb->seed ? -1 : ra->seed > rb->seed;
+}
+
+// Runs options->seeds schedules from the source's current state, results come back
+// sorted with the most interesting first. pool can be NULL.
+bool rtc_explore(struct player *source, struct rtc_explore_options *options, struct rtc_result *results, struct thread_pool *pool)
+{
+    if (!player_state_size(source) || options->frames == 0)
+    {
+        return false;
+    }
+
+    struct rtc_explorer explorer = { source, options, results, NULL };
+    explorer.reference = malloc((size_t)options->frames*RTC_SAMPLE_LEN);
+    if (!explorer.reference)
+    {
+        return false;
+    }
+
+    // The uncorrupted run everything is compared against. It forks the source
+    // first, so the forks made from worker threads only touch the refcount.
+    struct player reference = player_fork(source);
+    if (!reference.is_valid)
+    {
+        free(explorer.reference);
+        return false;
+    }
+
+    for (uint32_t frame = 0; frame < options->frames; frame++)
+    {
+        struct system_frame_result screen = player_frame(&reference);
+        _rtc_sample(explorer.reference + (size_t)frame*RTC_SAMPLE_LEN, &screen);
+    }
+    player_free(&reference);
+
+    if (pool)
+    {
+        thread_pool_run(pool, options->seeds, _rtc_explore_one, &explorer);
+    }
+    else
+    {
+        for (uint32_t i = 0; i < options->seeds; i++)
+        {
+            _rtc_explore_one(&explorer, i);
+        }
+    }
+
+    for (uint32_t i = 0; i < options->seeds; i++)
+    {
+        struct rtc_result *result = &results[i];
+
+        // Crash ranking puts early crashes first and then the biggest differences
+        result->rank_key = options->rank == RTC_RANK_CRASH && result->crashed
+            ? 2.0 - (double)result->frames_run/options->frames
+            : result->difference;
+    }
+
+    qsort(results, options->seeds, sizeof *results, _rtc_compare);
+    free(explorer.reference);
+
+    return true;
+}
@@ -0,0 +1,262 @@
+// Battery backed PRG-RAM kept in a .sav next to the ROM. The game keeps
+// writing system memory as always, once a frame the pages that changed get
+// copied into the mapped file, and a thread puts them on disk every couple of
+// seconds and on close. The emulation thread never waits on the disk.
+
+#include "neske.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+static bool _save_file_map(struct save_file *save, const char *path, bool *existed)
+{
+    HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        printf("Can't open %s, the game won't be saved\n", path);
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    *existed = GetFileSizeEx(file, &size) && size.QuadPart > 0;
+
+    // A short file grows with zeros, anything past the RAM is left alone
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, (DWORD)save->size, NULL);
+
+    save->data = mapping ? MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, save->size) : NULL;
+    if (mapping)
+    {
+        CloseHandle(mapping);
+    }
+    if (!save->data)
+    {
+        printf("Can't map %s, the game won't be saved\n", path);
+        CloseHandle(file);
+        return false;
+    }
+
+    save->file = file;
+    return true;
+}
+
+static void _save_file_flush_pages(struct save_file *save, uint32_t pages)
+{
+    for (size_t page = 0; page*SAVE_FILE_PAGE_LEN < save->size; page++)
+    {
+        if (pages & (1u << page))
+        {
+            size_t at = page*SAVE_FILE_PAGE_LEN;
+            size_t len = save->size - at < SAVE_FILE_PAGE_LEN ? save->size - at : SAVE_FILE_PAGE_LEN;
+            FlushViewOfFile(save->data + at, len);
+        }
+    }
+    FlushFileBuffers(save->file);
+}
+
+static void _save_file_unmap(struct save_file *save)
+{
+    UnmapViewOfFile(save->data);
+    CloseHandle(save->file);
+}
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool _save_file_map(struct save_file *save, const char *path, bool *existed)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        printf("Can't open %s, the game won't be saved\n", path);
+        return false;
+    }
+
+    struct stat st;
+    *existed = fstat(fd, &st) == 0 && st.st_size > 0;
+
+    // A short file grows with zeros, anything past the RAM is left alone
+    bool sized = *existed && st.st_size >= (off_t)save->size;
+    if (!sized)
+    {
+        sized = lseek(fd, save->size - 1, SEEK_SET) >= 0 && write(fd, "", 1) == 1;
+    }
+    void *data = sized ? mmap(NULL, save->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        printf("Can't map %s, the game won't be saved\n", path);
+        return false;
+    }
+
+    save->data = data;
+    return true;
+}
+
+static void _save_file_flush_pages(struct save_file *save, uint32_t pages)
+{
+    for (size_t page = 0; page*SAVE_FILE_PAGE_LEN < save->size; page++)
+    {
+        if (pages & (1u << page))
+        {
+            // msync wants the system's page alignment, which can be bigger than ours
+            size_t at = page*SAVE_FILE_PAGE_LEN;
+            size_t end = at + SAVE_FILE_PAGE_LEN < save->size ? at + SAVE_FILE_PAGE_LEN : save->size;
+            at &= ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+            msync(save->data + at, end - at, MS_SYNC);
+        }
+    }
+}
+
+static void _save_file_unmap(struct save_file *save)
+{
+    munmap(save->data, save->size);
+}
+#endif
+
+// game.nes becomes game.sav, names without an extension just get one
+static char *_save_file_path(const char *rom_path)
+{
+    size_t len = strlen(rom_path);
+    const char *dot = strrchr(rom_path, '.');
+    const char *slash = strrchr(rom_path, '/');
+    const char *backslash = strrchr(rom_path, '\\');
+    if (dot && dot > rom_path && (!slash || dot > slash) && (!backslash || dot > backslash))
+    {
+        len = dot - rom_path;
+    }
+
+    char *path = malloc(len + 5);
+    if (path)
+    {
+        memcpy(path, rom_path, len);
+        memcpy(path + len, ".sav", 5);
+    }
+    return path;
+}
+
+static void _save_file_flush(struct save_file *save)
+{
+    uint32_t pages = atomic32_exchange(&save->dirty, 0);
+    if (pages)
+    {
+        _save_file_flush_pages(save, pages);
+    }
+}
+
+static int _save_file_thread(void *arg)
+{
+    struct save_file *save = arg;
+
+    for (;;)
+    {
+        bool woken = thread_signal_wait_ms(save->wake, SAVE_FILE_FLUSH_MS);
+        _save_file_flush(save);
+
+        if (woken && atomic32_load(&save->stop))
+        {
+            return 0;
+        }
+    }
+}
+
+// NULL when the cart has no battery or the file can't be made, the game
+// still runs then, it just forgets
+struct save_file *save_file_open(struct player *player, const char *rom_path)
+{
+    if (!player->is_valid || !player->save_size)
+    {
+        return NULL;
+    }
+
+    struct save_file *save = calloc(1, sizeof *save);
+    char *path = _save_file_path(rom_path);
+    if (!save || !path)
+    {
+        free(save);
+        free(path);
+        return NULL;
+    }
+
+    save->size = player->save_size;
+    save->ram = player_get_system(player)->memory + 0x6000;
+
+    bool existed = false;
+    if (!_save_file_map(save, path, &existed))
+    {
+        free(path);
+        free(save);
+        return NULL;
+    }
+
+    // An old save is what the game finds at power on, a new file starts as the RAM
+    if (existed)
+    {
+        memcpy(save->ram, save->data, save->size);
+        printf("Loaded %s\n", path);
+    }
+    else
+    {
+        memcpy(save->data, save->ram, save->size);
+        atomic32_store(&save->dirty, (1u << (save->size + SAVE_FILE_PAGE_LEN - 1)/SAVE_FILE_PAGE_LEN) - 1);
+    }
+    free(path);
+
+    save->wake = thread_signal_new();
+    save->thread = thread_start(_save_file_thread, save);
+    return save;
+}
+
+// After every frame, on the emulation thread. A compare and maybe a copy
+// into the page cache, never a syscall.
+void save_file_sync(struct save_file *save)
+{
+    uint32_t pages = 0;
+
+    for (size_t at = 0, page = 0; at < save->size; at += SAVE_FILE_PAGE_LEN, page++)
+    {
+        size_t len = save->size - at < SAVE_FILE_PAGE_LEN ? save->size - at : SAVE_FILE_PAGE_LEN;
+        if (memcmp(save->data + at, save->ram + at, len) != 0)
+        {
+            memcpy(save->data + at, save->ram + at, len);
+            pages |= 1u << page;
+        }
+    }
+
+    if (pages)
+    {
+        atomic32_or(&save->dirty, pages);
+    }
+}
+
+// Takes the last frame along, the thread writes it out before it quits
+void save_file_close(struct save_file *save)
+{
+    if (!save)
+    {
+        return;
+    }
+
+    save_file_sync(save);
+
+    if (save->thread)
+    {
+        atomic32_store(&save->stop, 1);
+        thread_signal_raise(save->wake);
+        thread_join(save->thread);
+    }
+    else
+    {
+        _save_file_flush(save);
+    }
+
+    thread_signal_free(save->wake);
+    _save_file_unmap(save);
+    free(save);
+}
@@ -14,121 +14,306 @@ struct system system_init(struct mux_api apu_mux, struct ricoh_mem_interface mem
     return system;
 }
 
-static void apu_write_safe(struct system *system, enum apu_reg reg, uint8_t val)
+void system_set_audio_writer(struct system *system, struct apu_writer writer, bool stems)
 {
     system->apu_mux.lock(system->apu_mux.mux);
-    apu_reg_write(&system->apu, reg, val);
+    apu_set_writer(&system->apu, writer, stems);
     system->apu_mux.unlock(system->apu_mux.mux);
 }
 
-void system_mem_write(struct system *system, uint16_t addr, uint8_t data)
+void system_schedule(struct system *system, enum system_event event, uint64_t at)
 {
-    if (addr >= 0x2000 && addr < 0x4000)
-    {
-        addr = 0x2000 + addr % 8;
-    }
-
-    switch (addr)
-    {
-        case 0x2000: ppu_write(&system->ppu, PPUIO_CTRL, data); break;
-        case 0x2001: ppu_write(&system->ppu, PPUIO_MASK, data); break;
-        case 0x2003: ppu_write(&system->ppu, PPUIO_OAMADDR, data); break;
-        case 0x2004: ppu_write(&system->ppu, PPUIO_OAMDATA, data); break;
-        case 0x2005: ppu_write(&system->ppu, PPUIO_SCROLL, data); break;
-        case 0x2006: ppu_write(&system->ppu, PPUIO_ADDR, data); break;
-        case 0x2007: ppu_write(&system->ppu, PPUIO_DATA, data); break;
-
-        case 0x4000: apu_write_safe(system, APU_PULSE1_DDLC_NNNN, data); break; // pulse 1
-        case 0x4001: apu_write_safe(system, APU_PULSE1_EPPP_NSSS, data); break;
-        case 0x4002: apu_write_safe(system, APU_PULSE1_LLLL_LLLL, data); break;
-        case 0x4003: apu_write_safe(system, APU_PULSE1_LLLL_LHHH, data); break; 
-        case 0x4004: apu_write_safe(system, APU_PULSE2_DDLC_NNNN, data); break; // pulse 2
-        case 0x4005: apu_write_safe(system, APU_PULSE2_EPPP_NSSS, data); break;
-        case 0x4006: apu_write_safe(system, APU_PULSE2_LLLL_LLLL, data); break;
-        case 0x4007: apu_write_safe(system, APU_PULSE2_LLLL_LHHH, data); break;
-        case 0x4008: apu_write_safe(system, APU_TRIANG_CRRR_RRRR, data); break; // triangle
-        case 0x400A: apu_write_safe(system, APU_TRIANG_LLLL_LLLL, data); break;
-        case 0x400B: apu_write_safe(system, APU_TRIANG_LLLL_LHHH, data); break;
-        case 0x400C: apu_write_safe(system, APU_NOISER_XXLC_VVVV, data); break; // noise
-        case 0x400E: apu_write_safe(system, APU_NOISER_MXXX_PPPP, data); break;
-        case 0x400F: apu_write_safe(system, APU_NOISER_LLLL_LXXX, data); break;
-        case 0x4015: apu_write_safe(system, APU_STATUS_IFXD_NT21, data); break; // status
-        case 0x4017: apu_write_safe(system, APU_STATUS_MIXX_XXXX, data); break; // misc
-
-        case 0x4014: // OAMDMA
-            ppu_write_oam(&system->ppu, system->memory + (((uint16_t)data)<<8));
-            system->cpu.cycles += system->cpu.cycles&2 + 513;
-            break;
-        case 0x4016:
-            system->controller_strobe = data&1;
-            if (system->controller_strobe)
-            {
-                system->controller_sr = 0;
-            }
-            break;
-        default:
-            system->memory[addr] = data;
-            break;
+    system->events[event] = at;
+    system->next_event = UINT64_MAX;
+
+    // Only a handful of event kinds, a linear min is cheaper than keeping a heap
+
+    for (int i = 0; i < SYSTEM_EVENT_COUNT; i++)
+    {
+        if (system->events[i] < system->next_event)
+        {
+            system->next_event = system->events[i];
+        }
     }
 }
 
-void system_update_controller(struct system *system, struct controller_state cs)
+// Call with the apu mux held, after anything that can move the DMC
+static void _system_sync_dmc(struct system *system)
 {
-    system->controller = cs;
+    system_schedule(system, SYSTEM_EVENT_DMC_FETCH, apu_dmc_next_fetch(&system->apu));
+
+    if (system->apu.dmc.flag_irq)
+    {
+        system->irq |= SYSTEM_IRQ_DMC;
+    }
+    else
+    {
+        system->irq &= ~SYSTEM_IRQ_DMC;
+    }
+}
+
+// Which enum apu_reg each of $4000-$4017 is, the holes are never queued
+static const uint8_t _system_apu_regs[32] = {
+    APU_PULSE1_DDLC_NNNN, APU_PULSE1_EPPP_NSSS, APU_PULSE1_LLLL_LLLL, APU_PULSE1_LLLL_LHHH,
+    APU_PULSE2_DDLC_NNNN, APU_PULSE2_EPPP_NSSS, APU_PULSE2_LLLL_LLLL, APU_PULSE2_LLLL_LHHH,
+    APU_TRIANG_CRRR_RRRR, 0, APU_TRIANG_LLLL_LLLL, APU_TRIANG_LLLL_LHHH,
+    APU_NOISER_XXLC_VVVV, 0, APU_NOISER_MXXX_PPPP, APU_NOISER_LLLL_LXXX,
+    APU_DMCCHN_ILXX_RRRR, APU_DMCCHN_XDDD_DDDD, APU_DMCCHN_AAAA_AAAA, APU_DMCCHN_LLLL_LLLL,
+    0, APU_STATUS_IFXD_NT21, 0, APU_STATUS_MIXX_XXXX,
+};
+
+// Runs the APU up to the CPU, queued writes land on the cycle they were made
+// on so the output is the same as writing straight away. Call with the apu mux held.
+static void _system_apu_catchup(struct system *system)
+{
+    for (uint32_t i = 0; i < system->apu_queue_len; i++)
+    {
+        struct system_apu_write *write = &system->apu_queue[i];
+        apu_catchup_cycles(&system->apu, write->cycle);
+        apu_reg_write(&system->apu, write->reg, write->value);
+    }
+    system->apu_queue_len = 0;
+
+    apu_catchup_cycles(&system->apu, system->cpu.cycles);
 }
 
-void system_generate_samples(struct system *system, uint16_t *samples, uint32_t count)
+static void _system_dmc_fetch(struct system *system)
 {
     system->apu_mux.lock(system->apu_mux.mux);
-    system->apu.samples_read += count;
-    apu_catchup_samples(&system->apu, count);
-    apu_ring_read(&system->apu, samples, count);
+    _system_apu_catchup(system);
+    uint8_t byte = system->mem.get(system->mem.instance, system->apu.dmc.address);
+    apu_dmc_fill(&system->apu, byte);
+    _system_sync_dmc(system);
     system->apu_mux.unlock(system->apu_mux.mux);
+
+    // The DMC takes the bus away from the CPU while it reads
+    system->cpu.cycles += 4;
 }
 
-uint8_t system_mem_read(struct system *system, uint16_t addr)
+// 256 reads and 256 writes, one cycle waiting for the write that started it to
+// finish and one more to line up with a read cycle when that lands on an odd one
+static void _system_oam_dma(struct system *system)
 {
-    if (addr >= 0x2000 && addr < 0x4000)
+    uint8_t oam[256];
+    uint16_t from = system->oam_dma_page << 8;
+    for (int i = 0; i < 256; i++)
     {
-        addr = 0x2000  +((addr-0x2000)%8);
+        oam[i] = system->mem.get(system->mem.instance, from + i);
     }
+    ppu_write_oam(&system->ppu, oam);
 
-    uint8_t val = 0;
+    system->cpu.cycles += 513 + (system->cpu.cycles & 1);
+}
 
-    switch (addr)
+static void _system_run_events(struct system *system)
+{
+    while (system->next_event <= system->cpu.cycles)
     {
-        case 0x2002: return ppu_read(&system->ppu, PPUIO_STATUS);
-        case 0x2004: return ppu_read(&system->ppu, PPUIO_OAMDATA);
-        case 0x2007: return ppu_read(&system->ppu, PPUIO_DATA);
-        case 0x4015:
-            system->apu_mux.lock(system->apu_mux.mux);
-            val = apu_reg_read(&system->apu, APU_STATUS_IFXD_NT21);
-            system->apu_mux.unlock(system->apu_mux.mux);
-            return val;
-        case 0x4017:
-            return 0; // controller 2, not apu, confusing ya
-        case 0x4016:
-            if (system->controller_strobe)
-            {
-                system->controller_sr = 0;
-            }
-            if (system->controller_sr != 8)
+        for (int i = 0; i < SYSTEM_EVENT_COUNT; i++)
+        {
+            if (system->events[i] > system->cpu.cycles)
             {
-                // TODO: games like paperboy require 0x40 to be set, i'm lazy to figure out why right now
-                return system->controller.btns[system->controller_sr++] | 0x40;
+                continue;
             }
-            else
+
+            // Handlers reschedule themselves if they recur
+            system_schedule(system, i, UINT64_MAX);
+
+            switch (i)
             {
-                return 1;
+            case SYSTEM_EVENT_DMC_FETCH: _system_dmc_fetch(system); break;
+            case SYSTEM_EVENT_CART: system->cart_event(system->mem.instance); break;
+            case SYSTEM_EVENT_OAM_DMA: _system_oam_dma(system); break;
             }
-            break;
-        default: 
-            return system->memory[addr];
+        }
+    }
+}
+
+// APU channel registers only change what comes out of the speaker, so writes
+// to them queue up with their cycle and land when something needs the APU
+// caught up. Register writes take no lock that way.
+static void _system_write_apu_queued(struct system *system, uint16_t addr, uint8_t data)
+{
+    if (system->apu_queue_len == SYSTEM_APU_QUEUE_LEN)
+    {
+        system->apu_mux.lock(system->apu_mux.mux);
+        _system_apu_catchup(system);
+        system->apu_mux.unlock(system->apu_mux.mux);
+    }
+
+    system->apu_queue[system->apu_queue_len++] = (struct system_apu_write){
+        .cycle = system->cpu.cycles,
+        .reg = _system_apu_regs[addr & 0x1F],
+        .value = data,
+    };
+}
+
+// DMC rate and $4015 move the next DMC fetch and the IRQ line, those go in right away
+static void _system_write_apu_now(struct system *system, uint16_t addr, uint8_t data)
+{
+    system->apu_mux.lock(system->apu_mux.mux);
+    _system_apu_catchup(system);
+    apu_reg_write(&system->apu, _system_apu_regs[addr & 0x1F], data);
+    _system_sync_dmc(system);
+    system->apu_mux.unlock(system->apu_mux.mux);
+}
+
+// The copy happens as an event, so the CPU stalls after the STA that started it
+static void _system_write_oam_dma(struct system *system, uint16_t addr, uint8_t data)
+{
+    system->oam_dma_page = data;
+    system_schedule(system, SYSTEM_EVENT_OAM_DMA, system->cpu.cycles);
+}
+
+static void _system_write_controller(struct system *system, uint16_t addr, uint8_t data)
+{
+    system->controller_strobe = data&1;
+    if (system->controller_strobe)
+    {
+        system->controller_sr = 0;
+    }
+}
+
+static void _system_write_memory(struct system *system, uint16_t addr, uint8_t data)
+{
+    system->memory[addr] = data;
+}
+
+static void _system_write_ppu(struct system *system, uint16_t addr, uint8_t data)
+{
+    ppu_write(&system->ppu, addr & 7, data);
+}
+
+typedef void (*system_write_fn)(struct system *system, uint16_t addr, uint8_t data);
+typedef uint8_t (*system_read_fn)(struct system *system, uint16_t addr);
+
+// $2000-$2007, mirrored up to $3FFF. PPUIO_* are in register order.
+static const system_write_fn _system_ppu_writes[8] = {
+    _system_write_ppu, _system_write_ppu, _system_write_memory, _system_write_ppu,
+    _system_write_ppu, _system_write_ppu, _system_write_ppu, _system_write_ppu,
+};
+
+// $4000-$401F, the holes are plain memory like everything unmapped
+static const system_write_fn _system_io_writes[32] = {
+    _system_write_apu_queued, _system_write_apu_queued, _system_write_apu_queued, _system_write_apu_queued, // pulse 1
+    _system_write_apu_queued, _system_write_apu_queued, _system_write_apu_queued, _system_write_apu_queued, // pulse 2
+    _system_write_apu_queued, _system_write_memory, _system_write_apu_queued, _system_write_apu_queued, // triangle
+    _system_write_apu_queued, _system_write_memory, _system_write_apu_queued, _system_write_apu_queued, // noise
+    _system_write_apu_now, _system_write_apu_queued, _system_write_apu_queued, _system_write_apu_queued, // dmc
+    _system_write_oam_dma, _system_write_apu_now, _system_write_controller, _system_write_apu_queued,
+    _system_write_memory, _system_write_memory, _system_write_memory, _system_write_memory,
+    _system_write_memory, _system_write_memory, _system_write_memory, _system_write_memory,
+};
+
+// RAM, PRG-RAM and cart space go straight to memory, the tables only see registers
+void system_mem_write(struct system *system, uint16_t addr, uint8_t data)
+{
+    if (addr < 0x2000 || addr >= 0x4020)
+    {
+        system->memory[addr] = data;
+    }
+    else if (addr < 0x4000)
+    {
+        _system_ppu_writes[addr & 7](system, 0x2000 + (addr & 7), data);
+    }
+    else
+    {
+        _system_io_writes[addr & 0x1F](system, addr, data);
+    }
+}
+
+void system_update_controller(struct system *system, struct controller_state cs)
+{
+    system->controller = cs;
+}
+
+void system_set_sample_rate(struct system *system, uint32_t rate)
+{
+    system->apu_mux.lock(system->apu_mux.mux);
+    apu_set_sample_rate(&system->apu, rate);
+    system->apu_mux.unlock(system->apu_mux.mux);
+}
+
+void system_set_audio_ring(struct system *system, struct sample_ring *ring, bool rate_control)
+{
+    system->apu_mux.lock(system->apu_mux.mux);
+    system->apu.ring = ring;
+    system->apu.rate_control = rate_control;
+    system->apu.resampler.step = system->apu.resampler.step_nominal;
+    system->apu_mux.unlock(system->apu_mux.mux);
+}
+
+static uint8_t _system_read_ppu(struct system *system, uint16_t addr)
+{
+    return ppu_read(&system->ppu, addr & 7);
+}
+
+static uint8_t _system_read_apu_status(struct system *system, uint16_t addr)
+{
+    system->apu_mux.lock(system->apu_mux.mux);
+    _system_apu_catchup(system);
+    uint8_t val = apu_reg_read(&system->apu, APU_STATUS_IFXD_NT21);
+    system->apu_mux.unlock(system->apu_mux.mux);
+    return val;
+}
+
+static uint8_t _system_read_controller(struct system *system, uint16_t addr)
+{
+    if (system->controller_strobe)
+    {
+        system->controller_sr = 0;
+    }
+    if (system->controller_sr != 8)
+    {
+        // TODO: games like paperboy require 0x40 to be set, i'm lazy to figure out why right now
+        return system->controller.btns[system->controller_sr++] | 0x40;
     }
 
+    return 1;
+}
+
+// Controller 2, not apu, confusing ya
+static uint8_t _system_read_zero(struct system *system, uint16_t addr)
+{
     return 0;
 }
 
+static uint8_t _system_read_memory(struct system *system, uint16_t addr)
+{
+    return system->memory[addr];
+}
+
+// Write only PPU registers read back whatever memory has there
+static const system_read_fn _system_ppu_reads[8] = {
+    _system_read_memory, _system_read_memory, _system_read_ppu, _system_read_memory,
+    _system_read_ppu, _system_read_memory, _system_read_memory, _system_read_ppu,
+};
+
+static const system_read_fn _system_io_reads[32] = {
+    _system_read_memory, _system_read_memory, _system_read_memory, _system_read_memory,
+    _system_read_memory, _system_read_memory, _system_read_memory, _system_read_memory,
+    _system_read_memory, _system_read_memory, _system_read_memory, _system_read_memory,
+    _system_read_memory, _system_read_memory, _system_read_memory, _system_read_memory,
+    _system_read_memory, _system_read_memory, _system_read_memory, _system_read_memory,
+    _system_read_memory, _system_read_apu_status, _system_read_controller, _system_read_zero,
+    _system_read_memory, _system_read_memory, _system_read_memory, _system_read_memory,
+    _system_read_memory, _system_read_memory, _system_read_memory, _system_read_memory,
+};
+
+uint8_t system_mem_read(struct system *system, uint16_t addr)
+{
+    if (addr < 0x2000 || addr >= 0x4020)
+    {
+        return system->memory[addr];
+    }
+    else if (addr < 0x4000)
+    {
+        return _system_ppu_reads[addr & 7](system, 0x2000 + (addr & 7));
+    }
+
+    return _system_io_reads[addr & 0x1F](system, addr);
+}
+
 uint16_t system_get_vector(struct system *system, enum vector vec)
 {
     switch (vec)
@@ -142,17 +327,72 @@ uint16_t system_get_vector(struct system *system, enum vector vec)
 }
 
 
+// Takes everything emulated from state, the host side (memory callbacks, audio
+// outputs, sample rate) stays as it is, so a state can come from another run
+void system_load_state(struct system *system, const struct system *state)
+{
+    struct ricoh_mem_interface mem = system->mem;
+    void (*cart_event)(void *instance) = system->cart_event;
+    struct block_cache *blocks = system->blocks;
+    struct mux_api apu_mux = system->apu_mux;
+    uint32_t sample_rate = system->apu.resampler.rate;
+    const struct apu_sinc *sinc = system->apu.resampler.sinc;
+    struct sample_ring *ring = system->apu.ring;
+    bool rate_control = system->apu.rate_control;
+    struct apu_writer writer = system->apu.writer;
+    int stream_count = system->apu.stream_count;
+
+    apu_mux.lock(apu_mux.mux);
+    apu_flush(&system->apu);
+    memcpy(system, state, sizeof *system);
+    system->mem = mem;
+    system->cart_event = cart_event;
+    // ROM blocks still hold and RAM ones check their bytes, the cache can stay
+    system->blocks = blocks;
+    // Any tile could differ from what caches decoded before the load
+    ppu_mark_chr_dirty(&system->ppu);
+    system->apu_mux = apu_mux;
+    system->apu.ring = ring;
+    system->apu.rate_control = rate_control;
+    system->apu.writer = writer;
+    system->apu.stream_count = stream_count;
+    // The state's pointer may be from another run
+    system->apu.resampler.sinc = sinc;
+    if (system->apu.resampler.rate != sample_rate)
+    {
+        apu_set_sample_rate(&system->apu, sample_rate);
+    }
+    apu_mux.unlock(apu_mux.mux);
+}
+
 void system_reset(struct system *system)
 {
     printf("system_reset\n");
     system->cpu = (struct ricoh_state){ 0 };
     system->cpu.pc = system_get_vector(system, VEC_RESET);
     printf("system_reset pc: %x\n", system->cpu.pc);
-    system->cpu.flags = 0x24;
+    ricoh_set_flags(&system->cpu, 0x24);
     system->cpu.sp = 0xFD;
     system->cpu.cycles = 7;
-    system->apu = (struct apu){ 0 };
-    apu_init(&system->apu);
+    uint32_t sample_rate = system->apu.resampler.rate ? system->apu.resampler.rate : APU_DEFAULT_SAMPLE_RATE;
+    struct sample_ring *ring = system->apu.ring;
+    bool rate_control = system->apu.rate_control;
+    struct apu_writer writer = system->apu.writer;
+    bool stems = system->apu.stream_count > 1;
+    system->apu_mux.lock(system->apu_mux.mux);
+    apu_flush(&system->apu);
+    memset(&system->apu, 0, sizeof system->apu);
+    system->apu_queue_len = 0;
+    apu_init(&system->apu, sample_rate);
+    system->apu.ring = ring;
+    system->apu.rate_control = rate_control;
+    apu_set_writer(&system->apu, writer, stems);
+    system->apu_mux.unlock(system->apu_mux.mux);
+    system->irq = 0;
+    for (int i = 0; i < SYSTEM_EVENT_COUNT; i++)
+    {
+        system_schedule(system, i, UINT64_MAX);
+    }
     printf("system_reset done\n");
 }
 
@@ -162,11 +402,88 @@ enum
     DEV_PPU,
 };
 
+// One instruction, a block of them, or whatever has to happen before the next
+// one. Blocks start no instruction at or past horizon.
+static void _system_step_cpu(struct system *system, uint64_t horizon)
+{
+    if (system->cpu.cycles >= system->next_event)
+    {
+        // Events can stall the CPU, let the PPU catch up before the next instruction
+        _system_run_events(system);
+        return;
+    }
+
+    if (system->irq && (system->cpu.flags & (1 << FLAG_INT)) == 0)
+    {
+        ricoh_do_interrupt(&system->cpu, &system->mem, system_get_vector(system, VEC_IRQ));
+        return;
+    }
+
+    if (system->blocks && block_run(system->blocks, system, horizon < system->next_event ? horizon : system->next_event))
+    {
+        return;
+    }
+
+    struct instr_decoded decoded = ricoh_decode_instr(&system->decoder, &system->mem, system->cpu.pc);
+    ricoh_run_instr(&system->cpu, decoded, &system->mem);
+}
+
+// Where system_call's fake JSR returns to, nothing is mapped there on the
+// boards we run this on
+#define SYSTEM_CALL_RETURN 0x5FF6
+
+// Runs a subroutine until it returns, without the PPU. This is how NSF
+// drivers are called, their INIT and PLAY routines just RTS when done.
+bool system_call(struct system *system, uint16_t addr, uint64_t max_cycles)
+{
+    uint16_t ret = SYSTEM_CALL_RETURN - 1;
+    system->mem.set(system->mem.instance, 0x100 + system->cpu.sp--, ret >> 8);
+    system->mem.set(system->mem.instance, 0x100 + system->cpu.sp--, ret & 0xFF);
+    system->cpu.pc = addr;
+
+    uint64_t end = system->cpu.cycles + max_cycles;
+
+    while (system->cpu.pc != SYSTEM_CALL_RETURN && system->cpu.cycles < end && !system->cpu.crash)
+    {
+        _system_step_cpu(system, end);
+    }
+
+    return system->cpu.pc == SYSTEM_CALL_RETURN;
+}
+
+// Lets time pass with the CPU doing nothing, events still fire on time
+void system_idle(struct system *system, uint64_t until)
+{
+    while (system->next_event <= until)
+    {
+        if (system->cpu.cycles < system->next_event)
+        {
+            system->cpu.cycles = system->next_event;
+        }
+
+        _system_run_events(system);
+    }
+
+    if (system->cpu.cycles < until)
+    {
+        system->cpu.cycles = until;
+    }
+}
+
+void system_flush_audio(struct system *system)
+{
+    system->apu_mux.lock(system->apu_mux.mux);
+    _system_apu_catchup(system);
+    apu_flush(&system->apu);
+    system->apu_mux.unlock(system->apu_mux.mux);
+}
+
 struct system_frame_result system_frame(struct system *system)
 {
     uint64_t cycles_start = system->cpu.cycles;
+    uint64_t cycles_end = cycles_start + 500000;
 
-    while (!system->cpu.crash && (system->cpu.cycles-cycles_start) < 500000)
+    while (!system->cpu.crash && system->cpu.cycles < cycles_end)
     {
         bool nmi_occured = false;
 
@@ -182,8 +499,12 @@ struct system_frame_result system_frame(struct system *system)
         {
         case DEV_CPU:
             {
-                struct instr_decoded decoded = ricoh_decode_instr(&system->decoder, &system->mem, system->cpu.pc);
-                ricoh_run_instr(&system->cpu, decoded, &system->mem);
+                // The PPU catches up between instructions and raises NMI after the
+                // first one that ends once the vblank cycle is due, a block
+                // mustn't start one past that, or past the end of the frame
+                uint64_t vblank = system->ppu.cycles + ppu_cycles_to_vblank(&system->ppu) - 1;
+                uint64_t horizon = (vblank - 1)/3 + 1;
+                _system_step_cpu(system, horizon < cycles_end ? horizon : cycles_end);
             }
             break;
         case DEV_PPU:
@@ -203,9 +524,12 @@ struct system_frame_result system_frame(struct system *system)
         }
     }
 
+    system_flush_audio(system);
+
     struct system_frame_result result = { 0 };
 
     memcpy(result.screen, system->ppu.screen, sizeof result.screen);
+    memcpy(result.line_mask, system->ppu.line_mask, sizeof result.line_mask);
 
     return result;
 }
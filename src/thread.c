@@ -0,0 +1,372 @@
+// Just enough threading for background writers and a worker pool, the core doesn't depend on SDL
+
+#include "neske.h"
+#include <stdlib.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+struct thread
+{
+    HANDLE handle;
+    thread_fn fn;
+    void *arg;
+};
+
+struct thread_signal
+{
+    HANDLE event;
+};
+
+static DWORD WINAPI _thread_entry(LPVOID param)
+{
+    struct thread *thread = param;
+    return (DWORD)thread->fn(thread->arg);
+}
+
+struct thread *thread_start(thread_fn fn, void *arg)
+{
+    struct thread *thread = calloc(1, sizeof *thread);
+    if (!thread)
+    {
+        return NULL;
+    }
+
+    thread->fn = fn;
+    thread->arg = arg;
+    thread->handle = CreateThread(NULL, 0, _thread_entry, thread, 0, NULL);
+
+    if (!thread->handle)
+    {
+        free(thread);
+        return NULL;
+    }
+
+    return thread;
+}
+
+void thread_join(struct thread *thread)
+{
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+    free(thread);
+}
+
+struct thread_signal *thread_signal_new()
+{
+    struct thread_signal *signal = calloc(1, sizeof *signal);
+    if (!signal)
+    {
+        return NULL;
+    }
+
+    // Auto reset, a raise wakes one wait and raises without a waiter aren't lost
+    signal->event = CreateEventA(NULL, FALSE, FALSE, NULL);
+    return signal;
+}
+
+void thread_signal_free(struct thread_signal *signal)
+{
+    CloseHandle(signal->event);
+    free(signal);
+}
+
+void thread_signal_raise(struct thread_signal *signal)
+{
+    SetEvent(signal->event);
+}
+
+void thread_signal_wait(struct thread_signal *signal)
+{
+    WaitForSingleObject(signal->event, INFINITE);
+}
+
+bool thread_signal_wait_ms(struct thread_signal *signal, uint32_t ms)
+{
+    return WaitForSingleObject(signal->event, ms) == WAIT_OBJECT_0;
+}
+
+int thread_cpu_count()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+}
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+struct thread
+{
+    pthread_t handle;
+    thread_fn fn;
+    void *arg;
+};
+
+struct thread_signal
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool raised;
+};
+
+static void *_thread_entry(void *param)
+{
+    struct thread *thread = param;
+    thread->fn(thread->arg);
+    return NULL;
+}
+
+struct thread *thread_start(thread_fn fn, void *arg)
+{
+    struct thread *thread = calloc(1, sizeof *thread);
+    if (!thread)
+    {
+        return NULL;
+    }
+
+    thread->fn = fn;
+    thread->arg = arg;
+
+    if (pthread_create(&thread->handle, NULL, _thread_entry, thread) != 0)
+    {
+        free(thread);
+        return NULL;
+    }
+
+    return thread;
+}
+
+void thread_join(struct thread *thread)
+{
+    pthread_join(thread->handle, NULL);
+    free(thread);
+}
+
+struct thread_signal *thread_signal_new()
+{
+    struct thread_signal *signal = calloc(1, sizeof *signal);
+    if (!signal)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_init(&signal->mutex, NULL);
+    pthread_cond_init(&signal->cond, NULL);
+    return signal;
+}
+
+void thread_signal_free(struct thread_signal *signal)
+{
+    pthread_cond_destroy(&signal->cond);
+    pthread_mutex_destroy(&signal->mutex);
+    free(signal);
+}
+
+void thread_signal_raise(struct thread_signal *signal)
+{
+    pthread_mutex_lock(&signal->mutex);
+    signal->raised = true;
+    pthread_cond_signal(&signal->cond);
+    pthread_mutex_unlock(&signal->mutex);
+}
+
+void thread_signal_wait(struct thread_signal *signal)
+{
+    pthread_mutex_lock(&signal->mutex);
+    while (!signal->raised)
+    {
+        pthread_cond_wait(&signal->cond, &signal->mutex);
+    }
+    signal->raised = false;
+    pthread_mutex_unlock(&signal->mutex);
+}
+
+bool thread_signal_wait_ms(struct thread_signal *signal, uint32_t ms)
+{
+    // Condition variables time out against the realtime clock, which is C11's TIME_UTC
+    struct timespec until;
+    timespec_get(&until, TIME_UTC);
+    until.tv_sec += ms/1000;
+    until.tv_nsec += (long)(ms%1000)*1000000;
+    if (until.tv_nsec >= 1000000000)
+    {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&signal->mutex);
+    while (!signal->raised)
+    {
+        if (pthread_cond_timedwait(&signal->cond, &signal->mutex, &until) != 0)
+        {
+            break;
+        }
+    }
+    bool raised = signal->raised;
+    signal->raised = false;
+    pthread_mutex_unlock(&signal->mutex);
+    return raised;
+}
+
+int thread_cpu_count()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+#endif
+
+// Parallel for on top of the above, workers sleep on their own signal between runs
+
+#define THREAD_POOL_MAX 64
+
+struct thread_pool_worker
+{
+    struct thread_pool *pool;
+    struct thread *thread;
+    struct thread_signal *start;
+};
+
+struct thread_pool
+{
+    int worker_count;
+    struct thread_pool_worker workers[THREAD_POOL_MAX];
+    struct thread_signal *done;
+
+    thread_pool_fn fn;
+    void *userdata;
+    uint32_t count;
+    volatile uint32_t next;
+    volatile uint32_t busy; // workers still in this run
+    volatile uint32_t quit;
+};
+
+static void _thread_pool_work(struct thread_pool *pool)
+{
+    uint32_t index;
+    while ((index = atomic32_add(&pool->next, 1) - 1) < pool->count)
+    {
+        pool->fn(pool->userdata, (int)index);
+    }
+}
+
+static int _thread_pool_worker(void *arg)
+{
+    struct thread_pool_worker *worker = arg;
+    struct thread_pool *pool = worker->pool;
+
+    for (;;)
+    {
+        thread_signal_wait(worker->start);
+
+        if (atomic32_load(&pool->quit))
+        {
+            return 0;
+        }
+
+        _thread_pool_work(pool);
+
+        if (atomic32_add(&pool->busy, (uint32_t)-1) == 0)
+        {
+            thread_signal_raise(pool->done);
+        }
+    }
+}
+
+void thread_pool_free(struct thread_pool *pool)
+{
+    atomic32_store(&pool->quit, 1);
+
+    for (int i = 0; i < THREAD_POOL_MAX; i++)
+    {
+        struct thread_pool_worker *worker = &pool->workers[i];
+
+        if (worker->thread)
+        {
+            thread_signal_raise(worker->start);
+            thread_join(worker->thread);
+        }
+
+        if (worker->start)
+        {
+            thread_signal_free(worker->start);
+        }
+    }
+
+    if (pool->done)
+    {
+        thread_signal_free(pool->done);
+    }
+
+    free(pool);
+}
+
+// thread_count includes the caller, 0 means one per CPU
+struct thread_pool *thread_pool_new(int thread_count)
+{
+    if (thread_count <= 0)
+    {
+        thread_count = thread_cpu_count();
+    }
+    if (thread_count > THREAD_POOL_MAX)
+    {
+        thread_count = THREAD_POOL_MAX;
+    }
+
+    struct thread_pool *pool = calloc(1, sizeof *pool);
+    if (!pool)
+    {
+        return NULL;
+    }
+
+    pool->done = thread_signal_new();
+    if (!pool->done)
+    {
+        thread_pool_free(pool);
+        return NULL;
+    }
+
+    for (int i = 0; i < thread_count - 1; i++)
+    {
+        struct thread_pool_worker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->start = thread_signal_new();
+        worker->thread = worker->start ? thread_start(_thread_pool_worker, worker) : NULL;
+
+        if (!worker->thread)
+        {
+            thread_pool_free(pool);
+            return NULL;
+        }
+
+        pool->worker_count++;
+    }
+
+    return pool;
+}
+
+// Calls fn(userdata, 0..count-1) spread over the pool and returns once all are done
+void thread_pool_run(struct thread_pool *pool, int count, thread_pool_fn fn, void *userdata)
+{
+    pool->fn = fn;
+    pool->userdata = userdata;
+    pool->count = count;
+    atomic32_store(&pool->next, 0);
+    atomic32_store(&pool->busy, pool->worker_count);
+
+    for (int i = 0; i < pool->worker_count; i++)
+    {
+        thread_signal_raise(pool->workers[i].start);
+    }
+
+    // The caller works too instead of just waiting
+    _thread_pool_work(pool);
+
+    while (atomic32_load(&pool->busy) != 0)
+    {
+        thread_signal_wait(pool->done);
+    }
+}
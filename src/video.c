@@ -0,0 +1,262 @@
+#include "neske.h"
+#include <string.h>
+
+// The AVX2 kernel is always built on x86-64 and picked by cpuid, so a plain
+// cl /O2 or gcc -O2 build still gets it on CPUs that have it
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define VIDEO_TARGET_AVX2
+#else
+#define VIDEO_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define VIDEO_MASK_GRAYSCALE (1 << 0)
+
+const uint32_t video_palette[64] =
+{
+    0x626262ff, 0x001fb2ff, 0x2404c8ff, 0x5200b2ff,
+    0x730076ff, 0x800024ff, 0x730b00ff, 0x522800ff,
+    0x244400ff, 0x005700ff, 0x005c00ff, 0x005324ff,
+    0x003c76ff, 0x000000ff, 0x000000ff, 0x000000ff,
+    0xabababff, 0x0d57ffff, 0x4b30ffff, 0x8a13ffff,
+    0xbc08d6ff, 0xd21269ff, 0xc72e00ff, 0x9d5400ff,
+    0x607b00ff, 0x209800ff, 0x00a300ff, 0x009942ff,
+    0x007db4ff, 0x000000ff, 0x000000ff, 0x000000ff,
+    0xffffffff, 0x53aeffff, 0x9085ffff, 0xd365ffff,
+    0xff57ffff, 0xff5dcfff, 0xff7757ff, 0xfa9e00ff,
+    0xbdc700ff, 0x7ae700ff, 0x43f611ff, 0x26ef7eff,
+    0x2cd5f6ff, 0x4e4e4eff, 0x000000ff, 0x000000ff,
+    0xffffffff, 0xb6e1ffff, 0xced1ffff, 0xe9c3ffff,
+    0xffbcffff, 0xffbdf4ff, 0xffc6c3ff, 0xffd59aff,
+    0xe9e681ff, 0xcef481ff, 0xb6fb9aff, 0xa9fac3ff,
+    0xa9f0f4ff, 0xb8b8b8ff, 0x000000ff, 0x000000ff,
+};
+
+// How much the non emphasized channels get darkened, roughly what 2C02 does
+#define VIDEO_EMPHASIS_ATTENUATION 0.816f
+
+static uint32_t _video_emphasize(uint32_t color, uint8_t emphasis)
+{
+    if (emphasis == 0)
+    {
+        return color;
+    }
+
+    // Color is 0xRRGGBBAA, emphasis bits are R G B from lowest
+    float channel_scale[3] = { 1.0f, 1.0f, 1.0f };
+
+    for (int channel = 0; channel < 3; channel++)
+    {
+        if (emphasis & (1 << channel))
+        {
+            for (int other = 0; other < 3; other++)
+            {
+                if (other != channel)
+                {
+                    channel_scale[other] *= VIDEO_EMPHASIS_ATTENUATION;
+                }
+            }
+        }
+    }
+
+    uint32_t result = color & 0xFF;
+
+    for (int channel = 0; channel < 3; channel++)
+    {
+        int shift = 24 - channel*8;
+        uint32_t value = (uint32_t)(((color >> shift) & 0xFF) * channel_scale[channel] + 0.5f);
+        result |= value << shift;
+    }
+
+    return result;
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+static bool _video_has_avx2(void)
+{
+#if defined(_MSC_VER)
+    int regs[4];
+    __cpuid(regs, 0);
+    if (regs[0] < 7)
+    {
+        return false;
+    }
+
+    // AVX and OSXSAVE, then the OS has to actually save the YMM registers
+    __cpuid(regs, 1);
+    if ((regs[2] & (3 << 27)) != (3 << 27) || (_xgetbv(0) & 6) != 6)
+    {
+        return false;
+    }
+
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+bool video_lut_update(struct video_lut *lut, const uint32_t *source)
+{
+    if (lut->is_valid && memcmp(lut->source, source, sizeof lut->source) == 0)
+    {
+        return false;
+    }
+
+    memcpy(lut->source, source, sizeof lut->source);
+#if defined(__x86_64__) || defined(_M_X64)
+    lut->avx2 = _video_has_avx2();
+#endif
+
+    for (int emphasis = 0; emphasis < 8; emphasis++)
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t color = _video_emphasize(source[i], emphasis);
+            lut->rgba[emphasis*64 + i] = color;
+#if defined(__aarch64__) && defined(__ARM_NEON)
+            for (int byte = 0; byte < 4; byte++)
+            {
+                lut->planes[emphasis][byte][i] = (color >> (byte*8)) & 0xFF;
+            }
+#endif
+        }
+    }
+
+    lut->is_valid = true;
+
+    return true;
+}
+
+const char *video_convert_simd(const struct video_lut *lut)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    return lut->avx2 ? "avx2" : "none";
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    (void)lut;
+    return "neon";
+#else
+    (void)lut;
+    return "none";
+#endif
+}
+
+// What the vector paths have to match, bench convert checks they do
+void video_convert_line_scalar(const struct video_lut *lut, uint32_t *dest, const uint8_t *line, uint8_t mask)
+{
+    uint8_t index_mask = (mask & VIDEO_MASK_GRAYSCALE) ? 0x30 : 0x3F;
+    const uint32_t *colors = lut->rgba + ((mask >> 5) & 7)*64;
+
+    for (int i = 0; i < 256; i++)
+    {
+        dest[i] = colors[line[i] & index_mask];
+    }
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+VIDEO_TARGET_AVX2 static void _video_convert_line_avx2(const uint32_t *colors, uint32_t *dest, const uint8_t *line, uint8_t index_mask)
+{
+    __m256i vmask = _mm256_set1_epi32(index_mask);
+
+    for (int i = 0; i < 256; i += 8)
+    {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(line + i)));
+        index = _mm256_and_si256(index, vmask);
+        __m256i rgba = _mm256_i32gather_epi32((const int *)colors, index, 4);
+        _mm256_storeu_si256((__m256i *)(dest + i), rgba);
+    }
+}
+#endif
+
+void video_convert_line(const struct video_lut *lut, uint32_t *dest, const uint8_t *line, uint8_t mask)
+{
+    uint8_t emphasis = (mask >> 5) & 7;
+    // Grayscale only keeps the luma column of the palette
+    uint8_t index_mask = (mask & VIDEO_MASK_GRAYSCALE) ? 0x30 : 0x3F;
+    const uint32_t *colors = lut->rgba + emphasis*64;
+
+    int i = 0;
+
+#if defined(__x86_64__) || defined(_M_X64)
+    if (lut->avx2)
+    {
+        _video_convert_line_avx2(colors, dest, line, index_mask);
+        return;
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    uint8x16_t vmask = vdupq_n_u8(index_mask);
+    uint8x16x4_t planes[4];
+
+    for (int byte = 0; byte < 4; byte++)
+    {
+        planes[byte] = vld1q_u8_x4(lut->planes[emphasis][byte]);
+    }
+
+    for (; i+16 <= 256; i += 16)
+    {
+        uint8x16_t index = vandq_u8(vld1q_u8(line + i), vmask);
+        uint8x16x4_t rgba;
+        rgba.val[0] = vqtbl4q_u8(planes[0], index);
+        rgba.val[1] = vqtbl4q_u8(planes[1], index);
+        rgba.val[2] = vqtbl4q_u8(planes[2], index);
+        rgba.val[3] = vqtbl4q_u8(planes[3], index);
+        vst4q_u8((uint8_t *)(dest + i), rgba);
+    }
+#endif
+
+    for (; i < 256; i++)
+    {
+        dest[i] = colors[line[i] & index_mask];
+    }
+}
+
+void video_convert_frame(const struct video_lut *lut, uint32_t *dest, int pitch, struct system_frame_result *result)
+{
+    for (int y = 0; y < 240; y++)
+    {
+        video_convert_line(lut, (uint32_t *)((uint8_t *)dest + y*pitch), result->screen + y*256, result->line_mask[y]);
+    }
+}
+
+// One word into the hash. The multiply only carries a change upwards, the
+// shift brings the top half back down so the next word's multiply spreads
+// it over everything
+static uint64_t _video_hash_word(uint64_t hash, uint64_t word)
+{
+    hash = (hash ^ word)*0x9e3779b97f4a7c15;
+    return hash ^ (hash >> 32);
+}
+
+uint64_t video_frame_hash(struct system_frame_result *result)
+{
+    // Screen and line masks are both multiples of 8 bytes
+    uint64_t hash = 0xcbf29ce484222325;
+
+    for (size_t i = 0; i < sizeof result->screen; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, result->screen + i, 8);
+        hash = _video_hash_word(hash, word);
+    }
+
+    for (size_t i = 0; i < sizeof result->line_mask; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, result->line_mask + i, 8);
+        hash = _video_hash_word(hash, word);
+    }
+
+    // The last words only had one round, finish like murmur3's fmix64
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccd;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53;
+    return hash ^ (hash >> 33);
+}
@@ -0,0 +1,353 @@
+// Captures every emulated frame. The emulation thread only hashes and copies
+// the frame into a bounded queue, conversion and file I/O happen on a writer
+// thread.
+//
+// Indexed captures (.nesv) are the raw PPU output:
+//   "NESV" u16 width u16 height u32 fps_num u32 fps_den, 64 RGBA palette entries
+//   then per frame one record byte, VIDREC_RECORD_FRAME is followed by
+//   240 PPUMASK bytes (one per line) and 256*240 palette indices,
+//   VIDREC_RECORD_REPEAT means the previous frame again.
+
+#include "neske.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// NTSC frame rate as an exact fraction, 1789773/29780.5
+#define VIDREC_FPS_NUM 3579546
+#define VIDREC_FPS_DEN 59561
+
+#define VIDREC_RECORD_FRAME 0
+#define VIDREC_RECORD_REPEAT 1
+
+static void _vidrec_put_u16(uint8_t *at, uint16_t value)
+{
+    at[0] = value;
+    at[1] = value >> 8;
+}
+
+static void _vidrec_put_u32(uint8_t *at, uint32_t value)
+{
+    _vidrec_put_u16(at, value);
+    _vidrec_put_u16(at + 2, value >> 16);
+}
+
+static uint8_t _vidrec_clamp(float value)
+{
+    return value < 0 ? 0 : value > 255 ? 255 : (uint8_t)(value + 0.5f);
+}
+
+// BT.601 limited range, what Y4M readers assume without a colorspace tag
+static void _vidrec_build_yuv(struct video_recorder *recorder, const uint32_t *palette)
+{
+    struct video_lut lut = { 0 };
+    video_lut_update(&lut, palette);
+
+    for (int i = 0; i < VIDEO_LUT_LEN; i++)
+    {
+        float r = (lut.rgba[i] >> 24) & 0xFF;
+        float g = (lut.rgba[i] >> 16) & 0xFF;
+        float b = (lut.rgba[i] >> 8) & 0xFF;
+
+        recorder->yuv_lut[i][0] = _vidrec_clamp(16.0f + 0.2568f*r + 0.5041f*g + 0.0979f*b);
+        recorder->yuv_lut[i][1] = _vidrec_clamp(128.0f - 0.1482f*r - 0.2910f*g + 0.4392f*b);
+        recorder->yuv_lut[i][2] = _vidrec_clamp(128.0f + 0.4392f*r - 0.3678f*g - 0.0714f*b);
+    }
+}
+
+static void _vidrec_write_header(struct video_recorder *recorder, const uint32_t *palette)
+{
+    if (recorder->format == VIDREC_Y4M)
+    {
+        fprintf(recorder->fp, "YUV4MPEG2 W256 H240 F%d:%d Ip A1:1 C444\n", VIDREC_FPS_NUM, VIDREC_FPS_DEN);
+        return;
+    }
+
+    uint8_t header[16 + 64*4];
+    memcpy(header, "NESV", 4);
+    _vidrec_put_u16(header + 4, 256);
+    _vidrec_put_u16(header + 6, 240);
+    _vidrec_put_u32(header + 8, VIDREC_FPS_NUM);
+    _vidrec_put_u32(header + 12, VIDREC_FPS_DEN);
+
+    for (int i = 0; i < 64; i++)
+    {
+        _vidrec_put_u32(header + 16 + i*4, palette[i]);
+    }
+
+    fwrite(header, 1, sizeof header, recorder->fp);
+}
+
+static void _vidrec_write_frame(struct video_recorder *recorder, struct vidrec_slot *slot)
+{
+    if (recorder->format == VIDREC_INDEXED)
+    {
+        fputc(slot->repeat ? VIDREC_RECORD_REPEAT : VIDREC_RECORD_FRAME, recorder->fp);
+
+        if (!slot->repeat)
+        {
+            fwrite(slot->line_mask, 1, sizeof slot->line_mask, recorder->fp);
+            fwrite(slot->screen, 1, sizeof slot->screen, recorder->fp);
+        }
+
+        return;
+    }
+
+    uint8_t *y_plane = recorder->planes;
+    uint8_t *u_plane = y_plane + 256*240;
+    uint8_t *v_plane = u_plane + 256*240;
+
+    // A repeated frame still has to be in the file, but the planes from last time are still good
+    if (!slot->repeat)
+    {
+        for (int y = 0; y < 240; y++)
+        {
+            uint8_t mask = slot->line_mask[y];
+            uint8_t index_mask = (mask & 1) ? 0x30 : 0x3F;
+            const uint8_t (*colors)[3] = recorder->yuv_lut + ((mask >> 5) & 7)*64;
+            const uint8_t *line = slot->screen + y*256;
+
+            for (int x = 0; x < 256; x++)
+            {
+                const uint8_t *yuv = colors[line[x] & index_mask];
+                y_plane[y*256 + x] = yuv[0];
+                u_plane[y*256 + x] = yuv[1];
+                v_plane[y*256 + x] = yuv[2];
+            }
+        }
+    }
+
+    fputs("FRAME\n", recorder->fp);
+    fwrite(recorder->planes, 1, 256*240*3, recorder->fp);
+}
+
+static int _vidrec_writer(void *arg)
+{
+    struct video_recorder *recorder = arg;
+
+    for (;;)
+    {
+        thread_signal_wait(recorder->ready);
+
+        // Checked before draining, the last frame is queued before stop is set
+        bool stopping = atomic32_load(&recorder->stop) != 0;
+
+        uint32_t read_at = recorder->read_at;
+        while (read_at != atomic32_load(&recorder->write_at))
+        {
+            _vidrec_write_frame(recorder, &recorder->slots[read_at % VIDREC_QUEUE_LEN]);
+            atomic32_store(&recorder->read_at, ++read_at);
+            thread_signal_raise(recorder->space);
+        }
+
+        if (stopping)
+        {
+            return 0;
+        }
+    }
+}
+
+static void _vidrec_free(struct video_recorder *recorder)
+{
+    if (recorder->fp)
+    {
+        fclose(recorder->fp);
+    }
+
+    if (recorder->ready)
+    {
+        thread_signal_free(recorder->ready);
+    }
+
+    if (recorder->space)
+    {
+        thread_signal_free(recorder->space);
+    }
+
+    free(recorder->slots);
+    free(recorder->planes);
+    free(recorder);
+}
+
+static struct video_recorder *_vidrec_new(FILE *fp, enum vidrec_format format, const uint32_t *palette)
+{
+    struct video_recorder *recorder = calloc(1, sizeof *recorder);
+    if (!recorder)
+    {
+        fclose(fp);
+        return NULL;
+    }
+
+    recorder->fp = fp;
+    recorder->format = format;
+    recorder->planes = calloc(3, 256*240);
+
+    if (!recorder->planes)
+    {
+        _vidrec_free(recorder);
+        return NULL;
+    }
+
+    _vidrec_build_yuv(recorder, palette);
+    _vidrec_write_header(recorder, palette);
+
+    return recorder;
+}
+
+// With lossless set a full queue makes the caller wait, otherwise the frame is dropped
+struct video_recorder *video_recorder_start(const char *path, enum vidrec_format format, bool lossless)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+    {
+        printf("Can't write %s\n", path);
+        return NULL;
+    }
+
+    struct video_recorder *recorder = _vidrec_new(fp, format, video_palette);
+    if (!recorder)
+    {
+        return NULL;
+    }
+
+    recorder->lossless = lossless;
+    recorder->slots = malloc(VIDREC_QUEUE_LEN*sizeof *recorder->slots);
+    recorder->ready = thread_signal_new();
+    recorder->space = thread_signal_new();
+
+    if (!recorder->slots || !recorder->ready || !recorder->space)
+    {
+        _vidrec_free(recorder);
+        return NULL;
+    }
+
+    recorder->thread = thread_start(_vidrec_writer, recorder);
+    if (!recorder->thread)
+    {
+        _vidrec_free(recorder);
+        return NULL;
+    }
+
+    return recorder;
+}
+
+void video_recorder_push(struct video_recorder *recorder, struct system_frame_result *frame)
+{
+    uint32_t write_at = recorder->write_at;
+
+    while (write_at - atomic32_load(&recorder->read_at) == VIDREC_QUEUE_LEN)
+    {
+        if (!recorder->lossless)
+        {
+            recorder->dropped++;
+            return;
+        }
+
+        thread_signal_wait(recorder->space);
+    }
+
+    struct vidrec_slot *slot = &recorder->slots[write_at % VIDREC_QUEUE_LEN];
+
+    // Static screens are common (menus, pauses, text), those only cost a hash
+    // and a compare. The hash only rules frames out, a repeat has its pixels
+    // thrown away so it has to be the same frame for sure.
+    uint64_t hash = video_frame_hash(frame);
+    slot->repeat = recorder->frames > 0 && hash == recorder->last_hash &&
+        memcmp(recorder->last.screen, frame->screen, sizeof frame->screen) == 0 &&
+        memcmp(recorder->last.line_mask, frame->line_mask, sizeof frame->line_mask) == 0;
+    recorder->last_hash = hash;
+
+    if (!slot->repeat)
+    {
+        memcpy(slot->line_mask, frame->line_mask, sizeof slot->line_mask);
+        memcpy(slot->screen, frame->screen, sizeof slot->screen);
+        memcpy(recorder->last.line_mask, frame->line_mask, sizeof frame->line_mask);
+        memcpy(recorder->last.screen, frame->screen, sizeof frame->screen);
+    }
+    else
+    {
+        recorder->repeats++;
+    }
+
+    recorder->frames++;
+    atomic32_store(&recorder->write_at, write_at + 1);
+    thread_signal_raise(recorder->ready);
+}
+
+void video_recorder_stop(struct video_recorder *recorder)
+{
+    atomic32_store(&recorder->stop, 1);
+    thread_signal_raise(recorder->ready);
+    thread_join(recorder->thread);
+
+    printf("Video capture: %llu frames, %llu repeats, %u dropped\n",
+        (unsigned long long)recorder->frames, (unsigned long long)recorder->repeats, recorder->dropped);
+
+    _vidrec_free(recorder);
+}
+
+// Turns an indexed capture into Y4M, for when a failure needs watching
+bool video_capture_to_y4m(const char *in_path, const char *out_path)
+{
+    FILE *in = fopen(in_path, "rb");
+    if (!in)
+    {
+        printf("Can't open %s\n", in_path);
+        return false;
+    }
+
+    uint8_t header[16 + 64*4];
+    if (fread(header, 1, sizeof header, in) != sizeof header || memcmp(header, "NESV", 4) != 0)
+    {
+        printf("%s isn't an indexed capture\n", in_path);
+        fclose(in);
+        return false;
+    }
+
+    uint32_t palette[64];
+    for (int i = 0; i < 64; i++)
+    {
+        uint8_t *at = header + 16 + i*4;
+        palette[i] = at[0] | (at[1] << 8) | (at[2] << 16) | ((uint32_t)at[3] << 24);
+    }
+
+    FILE *out = fopen(out_path, "wb");
+    if (!out)
+    {
+        printf("Can't write %s\n", out_path);
+        fclose(in);
+        return false;
+    }
+
+    struct video_recorder *recorder = _vidrec_new(out, VIDREC_Y4M, palette);
+    struct vidrec_slot *slot = malloc(sizeof *slot);
+
+    if (!recorder || !slot)
+    {
+        free(slot);
+        fclose(in);
+        return false;
+    }
+
+    int record;
+    while ((record = fgetc(in)) != EOF)
+    {
+        slot->repeat = record == VIDREC_RECORD_REPEAT;
+
+        if (!slot->repeat &&
+            (fread(slot->line_mask, 1, sizeof slot->line_mask, in) != sizeof slot->line_mask ||
+             fread(slot->screen, 1, sizeof slot->screen, in) != sizeof slot->screen))
+        {
+            printf("%s is truncated\n", in_path);
+            break;
+        }
+
+        _vidrec_write_frame(recorder, slot);
+    }
+
+    free(slot);
+    fclose(in);
+    _vidrec_free(recorder);
+
+    return true;
+}
@@ -0,0 +1,250 @@
+// Records the APU output to WAV. The emulation thread only copies into one
+// of two blocks, a writer thread does all the file I/O.
+
+#include "neske.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WAVREC_HEADER_LEN 44
+
+static const char *wavrec_stem_names[APU_STREAM_COUNT] =
+{
+    [APU_STREAM_PULSE1] = "pulse1",
+    [APU_STREAM_PULSE2] = "pulse2",
+    [APU_STREAM_TRI]    = "tri",
+    [APU_STREAM_NOISE]  = "noise",
+    [APU_STREAM_DMC]    = "dmc",
+};
+
+static void _wavrec_put_u32(uint8_t *at, uint32_t value)
+{
+    at[0] = value;
+    at[1] = value >> 8;
+    at[2] = value >> 16;
+    at[3] = value >> 24;
+}
+
+static void _wavrec_write_header(FILE *fp, uint32_t rate, uint32_t samples)
+{
+    uint8_t header[WAVREC_HEADER_LEN] =
+    {
+        'R', 'I', 'F', 'F', 0, 0, 0, 0, 'W', 'A', 'V', 'E',
+        'f', 'm', 't', ' ', 16, 0, 0, 0,
+        1, 0,  // PCM
+        1, 0,  // mono
+        0, 0, 0, 0, 0, 0, 0, 0,
+        2, 0,  // block align
+        16, 0, // bits per sample
+        'd', 'a', 't', 'a', 0, 0, 0, 0,
+    };
+
+    _wavrec_put_u32(header + 4, 36 + samples*2);
+    _wavrec_put_u32(header + 24, rate);
+    _wavrec_put_u32(header + 28, rate*2);
+    _wavrec_put_u32(header + 40, samples*2);
+
+    fseek(fp, 0, SEEK_SET);
+    fwrite(header, 1, sizeof header, fp);
+}
+
+static int16_t *_wavrec_block(struct wav_recorder *recorder, int block, int stream)
+{
+    return recorder->blocks[block] + stream*WAVREC_BLOCK_LEN;
+}
+
+static void _wavrec_write_block(struct wav_recorder *recorder, int block, uint32_t count)
+{
+    // WAV is little endian and so is everything we build for
+    for (int stream = 0; stream < recorder->stream_count; stream++)
+    {
+        fwrite(_wavrec_block(recorder, block, stream), sizeof(int16_t), count, recorder->files[stream]);
+    }
+
+    recorder->samples_written += count;
+}
+
+static int _wavrec_writer(void *arg)
+{
+    struct wav_recorder *recorder = arg;
+    int next = 0;
+
+    for (;;)
+    {
+        thread_signal_wait(recorder->signal);
+
+        // Checked before draining, the last block is handed over before stop is set
+        bool stopping = atomic32_load(&recorder->stop) != 0;
+
+        // Blocks are handed over alternately, so writing them in turn keeps the order
+        uint32_t count;
+        while ((count = atomic32_load(&recorder->pending[next])) != 0)
+        {
+            _wavrec_write_block(recorder, next, count);
+            atomic32_store(&recorder->pending[next], 0);
+            next ^= 1;
+        }
+
+        if (stopping)
+        {
+            return 0;
+        }
+    }
+}
+
+static void _wavrec_handoff(struct wav_recorder *recorder)
+{
+    atomic32_store(&recorder->pending[recorder->active], recorder->block_fill);
+    thread_signal_raise(recorder->signal);
+    recorder->active ^= 1;
+    recorder->block_fill = 0;
+}
+
+static void _wavrec_write(void *userdata, int16_t *const *streams, int stream_count, uint32_t count)
+{
+    struct wav_recorder *recorder = userdata;
+    uint32_t offset = 0;
+
+    while (offset < count)
+    {
+        // Writer is two blocks behind, drop rather than stall the emulation
+        if (atomic32_load(&recorder->pending[recorder->active]) != 0)
+        {
+            atomic32_add(&recorder->dropped, count - offset);
+            return;
+        }
+
+        uint32_t space = WAVREC_BLOCK_LEN - recorder->block_fill;
+        uint32_t n = count - offset < space ? count - offset : space;
+
+        for (int stream = 0; stream < recorder->stream_count; stream++)
+        {
+            int16_t *dest = _wavrec_block(recorder, recorder->active, stream) + recorder->block_fill;
+
+            if (stream < stream_count)
+            {
+                memcpy(dest, streams[stream] + offset, n*sizeof *dest);
+            }
+            else
+            {
+                memset(dest, 0, n*sizeof *dest);
+            }
+        }
+
+        recorder->block_fill += n;
+        offset += n;
+
+        if (recorder->block_fill == WAVREC_BLOCK_LEN)
+        {
+            _wavrec_handoff(recorder);
+        }
+    }
+}
+
+static void _wavrec_free(struct wav_recorder *recorder)
+{
+    for (int stream = 0; stream < recorder->stream_count; stream++)
+    {
+        if (recorder->files[stream])
+        {
+            fclose(recorder->files[stream]);
+        }
+    }
+
+    if (recorder->signal)
+    {
+        thread_signal_free(recorder->signal);
+    }
+
+    free(recorder->blocks[0]);
+    free(recorder->blocks[1]);
+    free(recorder);
+}
+
+struct wav_recorder *wav_recorder_start(const char *path, uint32_t rate, bool stems)
+{
+    struct wav_recorder *recorder = calloc(1, sizeof *recorder);
+    if (!recorder)
+    {
+        return NULL;
+    }
+
+    recorder->rate = rate;
+    recorder->stream_count = stems ? APU_STREAM_COUNT : 1;
+
+    for (int stream = 0; stream < recorder->stream_count; stream++)
+    {
+        char stem_path[1024];
+        const char *file_path = path;
+
+        // Stems go next to the mix, foo.wav gets foo_pulse1.wav and so on
+        if (stream != APU_STREAM_MIX)
+        {
+            const char *dot = strrchr(path, '.');
+            int base_len = dot ? (int)(dot - path) : (int)strlen(path);
+            snprintf(stem_path, sizeof stem_path, "%.*s_%s.wav", base_len, path, wavrec_stem_names[stream]);
+            file_path = stem_path;
+        }
+
+        recorder->files[stream] = fopen(file_path, "wb");
+        if (!recorder->files[stream])
+        {
+            printf("Can't write %s\n", file_path);
+            _wavrec_free(recorder);
+            return NULL;
+        }
+
+        // Placeholder sizes, fixed up when recording stops
+        _wavrec_write_header(recorder->files[stream], rate, 0);
+    }
+
+    recorder->blocks[0] = malloc(recorder->stream_count*WAVREC_BLOCK_LEN*sizeof(int16_t));
+    recorder->blocks[1] = malloc(recorder->stream_count*WAVREC_BLOCK_LEN*sizeof(int16_t));
+    recorder->signal = thread_signal_new();
+
+    if (!recorder->blocks[0] || !recorder->blocks[1] || !recorder->signal)
+    {
+        _wavrec_free(recorder);
+        return NULL;
+    }
+
+    recorder->thread = thread_start(_wavrec_writer, recorder);
+    if (!recorder->thread)
+    {
+        _wavrec_free(recorder);
+        return NULL;
+    }
+
+    return recorder;
+}
+
+struct apu_writer wav_recorder_writer(struct wav_recorder *recorder)
+{
+    return (struct apu_writer){ recorder, _wavrec_write };
+}
+
+// Detach the writer from the APU first, nothing may call it after this starts
+void wav_recorder_stop(struct wav_recorder *recorder)
+{
+    // The active block is never still pending while it has samples in it
+    if (recorder->block_fill > 0)
+    {
+        _wavrec_handoff(recorder);
+    }
+
+    atomic32_store(&recorder->stop, 1);
+    thread_signal_raise(recorder->signal);
+    thread_join(recorder->thread);
+
+    if (recorder->dropped)
+    {
+        printf("Audio recording dropped %u samples, disk too slow\n", recorder->dropped);
+    }
+
+    for (int stream = 0; stream < recorder->stream_count; stream++)
+    {
+        _wavrec_write_header(recorder->files[stream], recorder->rate, (uint32_t)recorder->samples_written);
+    }
+
+    _wavrec_free(recorder);
+}